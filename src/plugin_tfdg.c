@@ -15,37 +15,99 @@ Contributors:
 */
 
 #include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <cJSON.h>
 #include <uthash.h>
 #include <utlist.h>
 #include <time.h>
+#include <unistd.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 
 #include "mosquitto_broker.h"
 #include "mosquitto_plugin.h"
 #include "mosquitto.h"
 #include "mqtt_protocol.h"
 
-#define ANSI_RED "\e[0;31m"
-#define ANSI_GREEN "\e[0;32m"
-#define ANSI_YELLOW "\e[0;33m"
-#define ANSI_BLUE "\e[0;34m"
-#define ANSI_MAGENTA "\e[0;35m"
-#define ANSI_CYAN "\e[0;36m"
-#define ANSI_WHITE "\e[0;37m"
-#define ANSI_RESET "\e[0m"
-
-#define GAME_NAME "TFDG  "
 #define MAX_DICE 20
 #define MAX_DICE_VALUE 9
-#define MAX_LOG_LEN 15
+#define LOG_RING_SIZE 4096 /* records, must be a power of two */
+#define LOG_EVENT_LEN 24
+#define LOG_DETAIL_LEN 64
+#define LOG_FLUSH_MS 20
+#define HIST_SUB_BITS 3 /* 8 buckets per power of two, ~12% resolution */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define TRACE_RING_SIZE 32768 /* spans per thread, must be a power of two */
 #define MAX_NAME_LEN 30
 #define UUIDLEN 36
 /* 00000000-0000-0000-0000-000000000000 */
+#define EXPIRY_WHEEL_SIZE 1024 /* seconds, must be a power of two */
+#define POOL_CHUNK_ITEMS 256
+#define POOL_ALIGN 16
+#define CLIENT_ID_INLINE 40
+#define RNG_BLOCKS 16 /* ChaCha20 blocks generated per refill */
+#define RNG_RESEED_BYTES (1024*1024)
+#define WORKER_RING_SIZE 1024 /* must be a power of two */
+#define CAPTURE_MAGIC "TFDGCAP1"
+#define CAPTURE_BUF_SIZE (64*1024)
+#define CAPTURE_RECORD_HEADER (1+8+2+2+4)
 
 struct tfdg_room;
 
+/* Fixed size object pool. Items are carved out of chunks of POOL_CHUNK_ITEMS
+ * and go on a free list when released, chunks are never returned to malloc
+ * while anything is in use. */
+struct tfdg_pool_chunk{
+	struct tfdg_pool_chunk *next;
+	char pad[POOL_ALIGN - sizeof(struct tfdg_pool_chunk *)];
+};
+
+struct tfdg_pool{
+	struct tfdg_pool_chunk *chunks;
+	void *free_list;
+	size_t item_size;
+	long in_use;
+	long chunk_count;
+};
+
+/* Command classes for rate limiting, see command_rate_class[] */
+enum tfdg_rate_class{
+	trc_game = 0,
+	trc_sound,
+	trc_option,
+	trc_login,
+	TRC_COUNT
+};
+
+/* Token bucket, tokens are in thousandths. last_ms == 0 for a bucket that
+ * hasn't been used and so starts full. */
+struct tfdg_bucket{
+	uint64_t last_ms;
+	uint32_t tokens;
+};
+
+/* Interned client id, shared by every player using that client */
+struct tfdg_client_id{
+	UT_hash_handle hh;
+	char *id;
+	int refcount;
+	bool rate_held; /* one reference held for the buckets, see rate_release() */
+	uint64_t cool_until_ms; /* disconnected, buckets kept until this time */
+	struct tfdg_client_id *cool_next, *cool_prev;
+	struct tfdg_player *players; /* one per room the client is in */
+	int rooms_created; /* live rooms, for max-rooms-per-client */
+	struct tfdg_bucket buckets[TRC_COUNT];
+	char id_buf[CLIENT_ID_INLINE];
+};
+
 enum tfdg_game_state{
 	tgs_none = -1,
 	tgs_lobby = 0,
@@ -59,6 +121,38 @@ enum tfdg_game_state{
 	tgs_resetting = 10,
 };
 
+enum tfdg_command{
+	tc_login = 0,
+	tc_logout,
+	tc_start_game,
+	tc_new_name,
+	tc_roll_dice,
+	tc_call_dudo,
+	tc_call_calza,
+	tc_i_lost,
+	tc_i_won,
+	tc_undo_loser,
+	tc_undo_winner,
+	tc_leave_game,
+	tc_kick_player,
+	tc_reset_game,
+	tc_set_option,
+	tc_snd_higher,
+	tc_snd_exact,
+	tc_unknown,
+	TC_COUNT
+};
+
+/* Why a login was turned away */
+enum tfdg_reject{
+	tr_max_rooms = 0,
+	tr_max_players,
+	tr_max_memory,
+	tr_max_client_rooms,
+	tr_max_spectators,
+	TR_COUNT
+};
+
 enum tfdg_player_state{
 	tps_none = -1,
 	tps_lobby = 0,
@@ -74,23 +168,42 @@ enum tfdg_player_state{
 	tps_pre_roll_lost = 10,
 };
 
+/* Everything the round logic touches comes first so that it shares a cache
+ * line, the lookup handles and identity strings follow. Dice are packed one
+ * per nibble, use player_die()/player_set_die() to access them. next/prev are
+ * only used for the lost players list, seated players are in room_s->seats. */
 struct tfdg_player{
-	UT_hash_handle hh_uuid;
-	UT_hash_handle hh_client_id;
 	struct tfdg_player *next, *prev;
-	char *uuid;
-	char *name;
-	char *client_id;
 	cJSON *json;
-	int dice_count;
-	int dice_values[MAX_DICE];
-	int dice_mask[MAX_DICE];
-	int login_count;
-	enum tfdg_player_state state;
+	uint8_t dice[(MAX_DICE+1)/2];
+	uint32_t dice_mask;
+	uint8_t dice_count;
+	int8_t state; /* enum tfdg_player_state */
 	uint8_t pre_roll;
 	bool ex_palifico;
+	bool compact;
+	bool away;
+	bool client_mapped;
+	int16_t login_count;
+	int index;
+	int seat;
+
+	UT_hash_handle hh_uuid;
+	UT_hash_handle hh_client_id;
+	struct tfdg_player *client_next, *client_prev;
+	struct tfdg_room *room;
+	struct tfdg_client_id *client;
+	const char *client_id;
+	time_t away_time;
+	char uuid[UUIDLEN+1];
+	char name[MAX_NAME_LEN+1];
 };
 
+_Static_assert(MAX_DICE_VALUE < 16, "dice values must fit in a nibble");
+_Static_assert(MAX_DICE <= 32, "dice mask must fit in a uint32_t");
+_Static_assert(MAX_DICE < 256, "dice count must fit in a uint8_t");
+_Static_assert(offsetof(struct tfdg_player, hh_uuid) <= 64, "player round state should fit in one cache line");
+
 
 struct tfdg_room_options{
 	int max_dice;
@@ -107,16 +220,27 @@ struct tfdg_room_options{
 
 struct tfdg_room{
 	UT_hash_handle hh;
+	struct tfdg_room *expiry_next, *expiry_prev;
+	struct tfdg_room *cleanup_next;
+	const char *cleanup_reason;
 	struct tfdg_player *player_by_uuid;
 	struct tfdg_player *player_by_client_id;
 	char uuid[UUIDLEN+1];
-	struct tfdg_player *players;
+	struct tfdg_player **seats; /* in turn order */
+	struct tfdg_rng *rng; /* only set for deterministic rooms */
+	struct tfdg_client_id *creator; /* holds a reference, unset for loaded rooms */
+	int seat_count;
+	int seat_alloc;
 	struct tfdg_player *lost_players;
 	int player_count;
 	int current_count;
 	enum tfdg_game_state state;
 	time_t start_time;
 	time_t last_event;
+	time_t expiry_time;
+	time_t idle_expiry_time;
+	time_t away_expiry_time;
+	int expiry_slot;
 	struct tfdg_player *host;
 	struct tfdg_player *starter;
 	struct tfdg_player *dudo_caller;
@@ -132,7 +256,15 @@ struct tfdg_room{
 	cJSON *json;
 	struct tfdg_room_options options;
 	int pre_roll_count;
-	int totals[20];
+	int totals[MAX_DICE_VALUE];
+	int faces[MAX_DICE_VALUE+1]; /* dice held by seated players, [0] is unrolled */
+	unsigned char *scratch; /* random bytes for the current operation */
+	size_t scratch_len;
+	int next_player_index;
+	int compact_count;
+	size_t mem_bytes; /* from room_account() */
+	struct tfdg_bucket buckets[TRC_COUNT];
+	uint64_t sound_ms[2]; /* last snd-higher and snd-exact sent */
 	bool forwards;
 };
 
@@ -163,12 +295,307 @@ static char *state_file = NULL;
 
 static struct tfdg_room *room_by_uuid = NULL;
 static int room_expiry_time = 7200;
+static int lobby_expiry_time = 1800;
+static int game_over_expiry_time = 60;
+static int resetting_expiry_time = 10;
+static int reconnect_grace_time = 60;
+
+/* Admission limits, 0 for no limit. memory_total is what room_account() has
+ * counted for all rooms, not the size of the broker. */
+static int max_rooms = 0;
+static int max_client_rooms = 0;
+static int max_room_players = 0; /* seated players, checked in the lobby */
+static int max_room_spectators = 0;
+static size_t max_memory = 0;
+static size_t memory_total = 0;
+
+/* Per second and burst for each rate class, per_second == 0 for no limit */
+struct tfdg_rate{
+	uint32_t per_second;
+	uint32_t burst;
+};
+
+static const struct tfdg_rate default_client_rates[TRC_COUNT] = {
+	{10, 50}, {2, 5}, {2, 10}, {1, 10}
+};
+static const struct tfdg_rate default_room_rates[TRC_COUNT] = {
+	{50, 200}, {5, 10}, {5, 30}, {5, 50}
+};
+static bool rate_limit = true;
+static struct tfdg_rate client_rates[TRC_COUNT];
+static struct tfdg_rate room_rates[TRC_COUNT];
+static int sound_window_ms = 250;
+static bool command_dropped = false; /* throttled or coalesced, so not captured */
+
+/* Number of players with a connected client, across all rooms */
+static unsigned int client_player_count = 0;
+
+static struct tfdg_pool room_pool = {NULL, NULL, sizeof(struct tfdg_room), 0, 0};
+static struct tfdg_pool player_pool = {NULL, NULL, sizeof(struct tfdg_player), 0, 0};
+static struct tfdg_pool client_id_pool = {NULL, NULL, sizeof(struct tfdg_client_id), 0, 0};
+static struct tfdg_client_id *client_id_by_id = NULL;
+static struct tfdg_client_id *rate_cooling = NULL;
+
+/* ChaCha20 keystream used as a DRBG for all game randomness. Each refill
+ * produces RNG_BLOCKS blocks and immediately replaces the key with the first
+ * 32 bytes of output, so earlier output can't be recovered from the state.
+ * Fresh OpenSSL entropy is mixed into the key every RNG_RESEED_BYTES, unless
+ * the generator is deterministic. */
+struct tfdg_rng{
+	uint32_t key[8];
+	uint64_t counter;
+	uint64_t draws;
+	size_t pos;
+	size_t since_reseed;
+	bool deterministic;
+	unsigned char buf[64*RNG_BLOCKS];
+};
+
+static struct tfdg_rng dice_rng;
+static char *rng_seed = NULL;
+static uint64_t rng_nonce_last = 0; /* starts at the time of plugin init */
+static uint64_t rng_nonce_next = 0; /* set by tfdg_replay to the captured nonce */
+
+/* Hashed timer wheel of rooms, one slot per second. A room is in the slot for
+ * its expiry time modulo EXPIRY_WHEEL_SIZE, so rescheduling is O(1) and each
+ * tick only looks at the slots for the seconds that have passed. */
+static struct tfdg_room *expiry_wheel[EXPIRY_WHEEL_SIZE];
+static time_t expiry_wheel_time = 0;
+
+/* Rooms waiting to be torn down. They are removed from room_by_uuid when
+ * queued and freed from the tick, so that stats and state file writes don't
+ * happen while the broker is delivering messages. */
+static struct tfdg_room *cleanup_queue = NULL;
+static struct tfdg_room *cleanup_queue_tail = NULL;
+static long cleanup_budget_us = 2000;
+static bool state_dirty = false;
+
+/* Anything that grows with the stats history runs on a background worker:
+ * appending to the history, the aggregate stats, building the tfdg/stats
+ * payload and writing the state file. Once the worker has started it owns
+ * j_statistics, j_stats_games and stats, the broker thread only hands it
+ * fixed size jobs. Jobs and results pass through single producer, single
+ * consumer rings. Results are published from the tick, because
+ * mosquitto_broker_publish() may only be called on the broker thread. */
+enum tfdg_job_type{
+	tj_game_result = 0,
+	tj_game_record = 1,
+	tj_save_state = 2,
+	tj_write_prom = 3,
+	tj_trace_dump = 4,
+	tj_capture_write = 5,
+};
+
+/* Counts from a finished game, folded into the aggregate stats */
+struct tfdg_game_result{
+	int player_count;
+	int duration;
+	int calza_success;
+	int calza_fail;
+	int dudo_success;
+	int dudo_fail;
+	int max_dice;
+	int max_dice_value;
+	int totals[MAX_DICE_VALUE];
+};
+
+struct tfdg_job{
+	enum tfdg_job_type type;
+	struct tfdg_game_result result; /* tj_game_result */
+	cJSON *record; /* tj_game_record */
+	char *games_json; /* tj_save_state, the active games */
+	char *prom; /* tj_write_prom, the broker thread metrics */
+	int trace_seconds; /* tj_trace_dump, how far back to dump */
+	char *capture; /* tj_capture_write, whole records */
+	size_t capture_len;
+};
+
+struct tfdg_publish{
+	const char *topic;
+	char *payload;
+	int payloadlen;
+};
+
+struct tfdg_ring{
+	_Alignas(64) atomic_size_t head; /* only written by the producer */
+	_Alignas(64) atomic_size_t tail; /* only written by the consumer */
+	void *items[WORKER_RING_SIZE];
+};
+
+struct tfdg_worker{
+	struct tfdg_ring jobs; /* broker -> worker */
+	struct tfdg_ring results; /* worker -> broker */
+	pthread_t thread;
+	sem_t wake;
+	atomic_bool stop;
+};
+
+static struct tfdg_worker *worker = NULL;
+static bool background_worker = true;
+static cJSON *j_statistics = NULL;
+
+/* Log records are written into a fixed ring without locking or allocating,
+ * and formatted as key=value lines by a logging thread. If the ring is full
+ * the record is dropped and counted, logging never blocks the caller. */
+enum tfdg_log_level{
+	tll_error = 0,
+	tll_warning = 1,
+	tll_notice = 2,
+	tll_info = 3,
+	tll_debug = 4,
+};
+
+struct tfdg_log_record{
+	time_t time;
+	int level;
+	char room[UUIDLEN+1];
+	char event[LOG_EVENT_LEN];
+	char player[UUIDLEN+1];
+	char name[MAX_NAME_LEN+1];
+	char detail[LOG_DETAIL_LEN];
+};
+
+/* seq == position when free for that position, position+1 once written */
+struct tfdg_log_slot{
+	atomic_size_t seq;
+	struct tfdg_log_record record;
+};
+
+static const char *log_level_names[] = {"error", "warning", "notice", "info", "debug"};
+static struct tfdg_log_slot log_ring[LOG_RING_SIZE];
+static atomic_size_t log_head;
+static size_t log_tail = 0;
+static atomic_long log_dropped;
+static long log_dropped_reported = 0;
+static int log_level = tll_info;
+static char *log_file = NULL;
+static FILE *log_fptr = NULL;
+static pthread_t log_thread;
+static bool log_thread_running = false;
+static atomic_bool log_stop;
+
+static const char *command_names[TC_COUNT] = {
+	"login", "logout", "start-game", "new-name", "roll-dice", "call-dudo",
+	"call-calza", "i-lost", "i-won", "undo-loser", "undo-winner",
+	"leave-game", "kick-player", "reset-game", "set-option", "snd-higher",
+	"snd-exact", "unknown"
+};
+
+static const char *reject_names[TR_COUNT] = {
+	"max-rooms", "max-players", "max-memory", "max-rooms-per-client",
+	"max-spectators"
+};
+
+static const char *rate_class_names[TRC_COUNT] = {
+	"game", "sound", "option", "login"
+};
+
+static const enum tfdg_rate_class command_rate_class[TC_COUNT] = {
+	trc_login, trc_login, trc_game, trc_option, trc_game, trc_game,
+	trc_game, trc_game, trc_game, trc_game, trc_game,
+	trc_game, trc_game, trc_game, trc_option, trc_sound,
+	trc_sound, trc_game
+};
+
+/* Log-linear latency histogram in ns, in the style of HdrHistogram */
+struct tfdg_histogram{
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/* Counters for tfdg/metrics. Everything here is reset each time the metrics
+ * are published, so the numbers cover one metrics-interval. */
+struct tfdg_metrics{
+	struct tfdg_histogram acl_read;
+	struct tfdg_histogram acl_write;
+	long commands[TC_COUNT];
+	long publish_count;
+	long publish_bytes;
+	long snapshot_count;
+	long snapshot_serialise_us;
+	long login_rejected[TR_COUNT];
+	long throttled[2][TRC_COUNT]; /* [0] client buckets, [1] room buckets */
+	long sounds_coalesced;
+};
+
+static struct tfdg_metrics metrics;
+static struct tfdg_metrics metrics_total; /* since the plugin started */
+static char *prom_file = NULL;
+static int metrics_interval = 10;
+static time_t metrics_start = 0;
+static atomic_long snapshot_write_us; /* set by the worker */
+
+/* Span names after the tfdg_handle_* spans, which use enum tfdg_command */
+enum tfdg_trace_name{
+	tt_acl_read = TC_COUNT,
+	tt_acl_write,
+	tt_tick,
+	tt_save_state,
+	tt_publish_stats,
+	tt_publish_metrics,
+	tt_job_game_result, /* tt_job_* are in enum tfdg_job_type order */
+	tt_job_game_record,
+	tt_job_save_state,
+	tt_job_write_prom,
+	tt_job_trace_dump,
+	tt_job_capture_write,
+};
+
+static const char *trace_names[] = {
+	"acl-read", "acl-write", "tick", "save-state", "publish-stats",
+	"publish-metrics", "job-game-result", "job-game-record",
+	"job-save-state", "job-write-prom", "job-trace-dump", "job-capture-write"
+};
+
+struct tfdg_trace_span{
+	uint64_t start_ns;
+	uint32_t duration_ns;
+	uint32_t name;
+};
+
+/* Each thread records its most recent spans into its own ring. The only
+ * other reader is the trace dump, which discards any span that was
+ * overwritten while it was being copied. */
+struct tfdg_trace_ring{
+	atomic_size_t head;
+	struct tfdg_trace_span spans[TRACE_RING_SIZE];
+};
+
+static struct tfdg_trace_ring trace_broker;
+static struct tfdg_trace_ring trace_worker;
+static bool trace_enabled = false;
+static int trace_dump_seconds = 10;
+static char *trace_file = NULL;
+static volatile sig_atomic_t trace_dump_requested = 0;
+static struct sigaction trace_old_sigusr2;
+
+/* Capture of inbound commands for tfdg_replay. The file starts with
+ * CAPTURE_MAGIC, then a uint16_t length and the rng-seed (empty if unset).
+ * Each record is a uint8_t enum tfdg_capture_type, uint64_t CLOCK_REALTIME
+ * ns, uint16_t client id length, uint16_t topic length, uint32_t payload
+ * length, then the three strings without terminators. Integers are in host
+ * byte order. Commands that were throttled and sounds that were coalesced
+ * aren't captured. */
+enum tfdg_capture_type{
+	tct_command = 0,
+	tct_disconnect = 1,
+	tct_rng_nonce = 2, /* topic is the room uuid, payload the uint64_t nonce */
+};
+
+static char *capture_file = NULL;
+static FILE *capture_fptr = NULL; /* written by the worker once it has started */
+static char *capture_batch = NULL; /* records not yet handed to the worker */
+static size_t capture_batch_len = 0;
+static size_t capture_batch_size = 0;
+static time_t capture_flushed = 0;
 
 static cJSON *json_create_results_array(struct tfdg_room *room_s);
 static cJSON *json_create_dudo_candidates_object(struct tfdg_room *room_s);
 static cJSON *json_create_my_dice_array(struct tfdg_player *player_s);
 static void save_full_state(void);
-static void room_append_player(struct tfdg_room *room_s, struct tfdg_player *player_s, bool onload);
+static int room_append_player(struct tfdg_room *room_s, struct tfdg_player *player_s, bool onload);
 static cJSON *room_dice_totals(struct tfdg_room *room_s);
 static void room_set_current_count(struct tfdg_room *room_s, int count);
 static void room_set_host(struct tfdg_room *room_s, struct tfdg_player *host);
@@ -177,15 +604,447 @@ static void report_summary_results(struct tfdg_room *room_s, const char *topic_s
 static cJSON *json_delete_game(cJSON *j_game);
 static void tfdg_handle_player_lost(struct tfdg_room *room_s, struct tfdg_player *player_s);
 static void player_set_state(struct tfdg_player *player_s, enum tfdg_player_state state);
+static void player_set_compact(struct tfdg_room *room_s, struct tfdg_player *player_s, bool compact);
 static void room_pre_roll_init(struct tfdg_room *room_s);
 static void publish_int_option(struct tfdg_room *room_s, const char *option, int value);
 static cJSON *room_pre_roll_to_cjson(struct tfdg_room *room_s);
 static void load_stats(void);
 static int callback_acl_check(int event, void *event_data, void *userdata);
+static int callback_tick(int event, void *event_data, void *userdata);
+static int callback_disconnect(int event, void *event_data, void *userdata);
+static int callback_reload(int event, void *event_data, void *userdata);
+static void trace_handle_sigusr2(int signal, siginfo_t *info, void *context);
 static void publish_stats(void);
+static int stats_payload(char **payload, int *payloadlen);
+static void log_drain(void);
+static void job_submit(struct tfdg_job *job);
+static void broker_publish(const char *topic, int payloadlen, void *payload, bool retain);
 
 static struct tfdg_stats stats;
 
+static void log_copy(char *dst, size_t size, const char *src)
+{
+	size_t len = 0;
+
+	if(src){
+		len = strnlen(src, size-1);
+		memcpy(dst, src, len);
+	}
+	dst[len] = '\0';
+}
+
+
+/* room, player_s and fmt may all be NULL */
+__attribute__((format(printf, 5, 6)))
+static void tfdg_log(enum tfdg_log_level level, const char *room, const char *event,
+		const struct tfdg_player *player_s, const char *fmt, ...)
+{
+	struct tfdg_log_slot *slot;
+	struct tfdg_log_record *record;
+	size_t pos, seq;
+	va_list va;
+
+	if((int)level > log_level) return;
+
+	pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+	while(1){
+		slot = &log_ring[pos & (LOG_RING_SIZE-1)];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if(seq == pos){
+			if(atomic_compare_exchange_weak_explicit(&log_head, &pos, pos+1,
+						memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}else if((ptrdiff_t)(seq - pos) < 0){
+			atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+			return;
+		}else{
+			pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+		}
+	}
+
+	record = &slot->record;
+	record->time = time(NULL);
+	record->level = (int)level;
+	log_copy(record->room, sizeof(record->room), room);
+	log_copy(record->event, sizeof(record->event), event);
+	log_copy(record->player, sizeof(record->player), player_s?player_s->uuid:NULL);
+	log_copy(record->name, sizeof(record->name), player_s?player_s->name:NULL);
+	if(fmt){
+		va_start(va, fmt);
+		vsnprintf(record->detail, sizeof(record->detail), fmt, va);
+		va_end(va);
+	}else{
+		record->detail[0] = '\0';
+	}
+	atomic_store_explicit(&slot->seq, pos+1, memory_order_release);
+
+	if(log_thread_running == false && log_fptr){
+		log_drain();
+	}
+}
+
+
+static void log_write(const struct tfdg_log_record *record)
+{
+	struct tm lt;
+	char timestr[30];
+	const char *c;
+
+	localtime_r(&record->time, &lt);
+	strftime(timestr, sizeof(timestr), "%FT%T", &lt);
+	fprintf(log_fptr, "%s level=%s", timestr, log_level_names[record->level]);
+	if(record->room[0]){
+		fprintf(log_fptr, " room=%s", record->room);
+	}
+	fprintf(log_fptr, " event=%s", record->event);
+	if(record->player[0]){
+		fprintf(log_fptr, " player=%s name=\"", record->player);
+		/* Names come from clients */
+		for(c=record->name; *c; c++){
+			if(*c == '"' || *c == '\\'){
+				fputc('\\', log_fptr);
+				fputc(*c, log_fptr);
+			}else if(iscntrl((unsigned char)*c)){
+				fputc('?', log_fptr);
+			}else{
+				fputc(*c, log_fptr);
+			}
+		}
+		fputc('"', log_fptr);
+	}
+	if(record->detail[0]){
+		fprintf(log_fptr, " %s", record->detail);
+	}
+	fputc('\n', log_fptr);
+}
+
+
+/* Only ever called from one thread at a time */
+static void log_drain(void)
+{
+	struct tfdg_log_slot *slot;
+	struct tfdg_log_record dropped_record;
+	long dropped;
+	bool written = false;
+
+	while(1){
+		slot = &log_ring[log_tail & (LOG_RING_SIZE-1)];
+		if(atomic_load_explicit(&slot->seq, memory_order_acquire) != log_tail+1){
+			break;
+		}
+		log_write(&slot->record);
+		atomic_store_explicit(&slot->seq, log_tail+LOG_RING_SIZE, memory_order_release);
+		log_tail++;
+		written = true;
+	}
+
+	dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+	if(dropped != log_dropped_reported){
+		memset(&dropped_record, 0, sizeof(dropped_record));
+		dropped_record.time = time(NULL);
+		dropped_record.level = tll_warning;
+		log_copy(dropped_record.event, sizeof(dropped_record.event), "log-dropped");
+		snprintf(dropped_record.detail, sizeof(dropped_record.detail), "count=%ld", dropped - log_dropped_reported);
+		log_write(&dropped_record);
+		log_dropped_reported = dropped;
+		written = true;
+	}
+	if(written){
+		fflush(log_fptr);
+	}
+}
+
+
+static void *log_main(void *arg)
+{
+	struct timespec ts;
+	bool stop;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = LOG_FLUSH_MS*1000000L;
+	while(1){
+		stop = atomic_load(&log_stop);
+		log_drain();
+		if(stop){
+			return NULL;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+static int log_level_parse(const char *str)
+{
+	int i;
+
+	for(i=0; i<(int)(sizeof(log_level_names)/sizeof(log_level_names[0])); i++){
+		if(!strcmp(str, log_level_names[i])){
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/* If the thread can't be started, records are written by whoever logs them */
+static void log_start(void)
+{
+	size_t i;
+
+	for(i=0; i<LOG_RING_SIZE; i++){
+		atomic_init(&log_ring[i].seq, i);
+	}
+	atomic_init(&log_head, 0);
+	atomic_init(&log_dropped, 0);
+	atomic_init(&log_stop, false);
+	log_tail = 0;
+	log_dropped_reported = 0;
+
+	log_fptr = NULL;
+	if(log_file){
+		log_fptr = fopen(log_file, "at");
+	}
+	if(log_fptr == NULL){
+		log_fptr = stdout;
+	}
+	log_thread_running = (pthread_create(&log_thread, NULL, log_main, NULL) == 0);
+}
+
+
+static void log_finish(void)
+{
+	if(log_thread_running){
+		atomic_store(&log_stop, true);
+		pthread_join(log_thread, NULL);
+		log_thread_running = false;
+	}else if(log_fptr){
+		log_drain();
+	}
+	if(log_fptr && log_fptr != stdout){
+		fclose(log_fptr);
+	}
+	log_fptr = NULL;
+}
+
+
+/* Check an existing capture and cut off a record left half written by a
+ * crash, so that new records follow the last whole one. Returns the length of
+ * the valid part of the file, 0 if not even the header is complete, or -1 if
+ * the file isn't a capture. */
+static long capture_recover(FILE *fptr)
+{
+	char magic[sizeof(CAPTURE_MAGIC)-1];
+	uint8_t header[CAPTURE_RECORD_HEADER];
+	uint16_t seed_len, client_id_len, topic_len;
+	uint32_t payloadlen;
+	long size, end, next;
+	size_t len;
+
+	if(fseek(fptr, 0, SEEK_END)) return -1;
+	size = ftell(fptr);
+	if(size <= 0) return size;
+
+	rewind(fptr);
+	len = fread(magic, 1, sizeof(magic), fptr);
+	if(memcmp(magic, CAPTURE_MAGIC, len)){
+		return -1;
+	}
+	if(len < sizeof(magic) || fread(&seed_len, sizeof(seed_len), 1, fptr) != 1){
+		return 0;
+	}
+	end = (long)(sizeof(magic) + sizeof(seed_len) + seed_len);
+	if(end > size){
+		return 0;
+	}
+
+	while(fseek(fptr, end, SEEK_SET) == 0
+			&& fread(header, 1, sizeof(header), fptr) == sizeof(header)
+			&& header[0] <= tct_rng_nonce){
+
+		memcpy(&client_id_len, &header[9], sizeof(client_id_len));
+		memcpy(&topic_len, &header[11], sizeof(topic_len));
+		memcpy(&payloadlen, &header[13], sizeof(payloadlen));
+		next = end + (long)sizeof(header) + client_id_len + topic_len + (long)payloadlen;
+		if(next > size) break;
+		end = next;
+	}
+	return end;
+}
+
+
+/* Appending to an existing capture keeps its header, so a restart with a
+ * different rng-seed makes the replay non-deterministic. */
+static void capture_start(void)
+{
+	uint16_t seed_len;
+	long size, end;
+
+	capture_fptr = fopen(capture_file, "r+b");
+	if(capture_fptr == NULL){
+		capture_fptr = fopen(capture_file, "wb");
+	}
+	if(capture_fptr == NULL){
+		tfdg_log(tll_error, NULL, "capture-open-failed", NULL, "file=\"%s\"", capture_file);
+		return;
+	}
+
+	end = capture_recover(capture_fptr);
+	if(end < 0){
+		tfdg_log(tll_error, NULL, "capture-invalid", NULL, "file=\"%s\"", capture_file);
+		fclose(capture_fptr);
+		capture_fptr = NULL;
+		return;
+	}
+	fseek(capture_fptr, 0, SEEK_END);
+	size = ftell(capture_fptr);
+	if(end < size){
+		fflush(capture_fptr);
+		if(ftruncate(fileno(capture_fptr), end)){
+			tfdg_log(tll_error, NULL, "capture-open-failed", NULL, "file=\"%s\"", capture_file);
+			fclose(capture_fptr);
+			capture_fptr = NULL;
+			return;
+		}
+		tfdg_log(tll_warning, NULL, "capture-truncated", NULL, "file=\"%s\" bytes=%ld", capture_file, size-end);
+	}
+	fseek(capture_fptr, end, SEEK_SET);
+
+	if(end == 0){
+		seed_len = rng_seed ? (uint16_t)strlen(rng_seed) : 0;
+		fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_fptr);
+		fwrite(&seed_len, sizeof(seed_len), 1, capture_fptr);
+		if(seed_len){
+			fwrite(rng_seed, 1, seed_len, capture_fptr);
+		}
+		fflush(capture_fptr);
+	}
+	capture_flushed = time(NULL);
+	tfdg_log(tll_notice, NULL, "capture-start", NULL, "file=\"%s\"", capture_file);
+}
+
+
+/* Hand the records gathered so far to the worker to write. Each batch is
+ * written and flushed as a whole, so the file only ends part way through a
+ * record if the broker dies during the write. */
+static void capture_flush(void)
+{
+	struct tfdg_job *job;
+
+	if(capture_batch_len == 0) return;
+
+	job = calloc(1, sizeof(struct tfdg_job));
+	if(job == NULL) return;
+
+	job->type = tj_capture_write;
+	job->capture = capture_batch;
+	job->capture_len = capture_batch_len;
+	capture_batch = NULL;
+	capture_batch_len = 0;
+	capture_batch_size = 0;
+	job_submit(job);
+}
+
+
+static void capture_stop(void)
+{
+	if(capture_fptr){
+		capture_flush();
+		fclose(capture_fptr);
+		capture_fptr = NULL;
+	}
+	free(capture_batch);
+	capture_batch = NULL;
+	capture_batch_len = 0;
+	capture_batch_size = 0;
+}
+
+
+static void capture_append(const void *data, size_t len)
+{
+	if(len == 0) return;
+	memcpy(&capture_batch[capture_batch_len], data, len);
+	capture_batch_len += len;
+}
+
+
+/* Only copied into the batch on the broker thread, the file is written by the
+ * worker from capture_flush(), which the tick calls at most once a second. */
+static void capture_record(enum tfdg_capture_type type, const char *client_id, const char *topic, const void *payload, uint32_t payloadlen)
+{
+	struct timespec ts;
+	uint64_t time_ns;
+	uint16_t client_id_len, topic_len;
+	uint8_t type8;
+	size_t len, size;
+	char *batch;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time_ns = (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+	type8 = (uint8_t)type;
+	client_id_len = client_id ? (uint16_t)strnlen(client_id, UINT16_MAX) : 0;
+	topic_len = topic ? (uint16_t)strnlen(topic, UINT16_MAX) : 0;
+	if(payload == NULL){
+		payloadlen = 0;
+	}
+
+	len = (size_t)CAPTURE_RECORD_HEADER + client_id_len + topic_len + payloadlen;
+	if(capture_batch_len + len > CAPTURE_BUF_SIZE){
+		capture_flush();
+	}
+	if(capture_batch_len + len > capture_batch_size){
+		size = len > CAPTURE_BUF_SIZE ? len : CAPTURE_BUF_SIZE;
+		batch = realloc(capture_batch, size);
+		if(batch == NULL) return;
+		capture_batch = batch;
+		capture_batch_size = size;
+	}
+
+	capture_append(&type8, sizeof(type8));
+	capture_append(&time_ns, sizeof(time_ns));
+	capture_append(&client_id_len, sizeof(client_id_len));
+	capture_append(&topic_len, sizeof(topic_len));
+	capture_append(&payloadlen, sizeof(payloadlen));
+	capture_append(client_id, client_id_len);
+	capture_append(topic, topic_len);
+	capture_append(payload, payloadlen);
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/* Returns 0 if tracing is off, so trace_span() can skip the clock */
+static uint64_t trace_begin(void)
+{
+	return trace_enabled ? now_ns() : 0;
+}
+
+
+static void trace_span(struct tfdg_trace_ring *ring, uint32_t name, uint64_t start_ns)
+{
+	struct tfdg_trace_span *span;
+	uint64_t duration;
+	size_t head;
+
+	if(start_ns == 0) return;
+
+	duration = now_ns() - start_ns;
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	span = &ring->spans[head & (TRACE_RING_SIZE-1)];
+	span->start_ns = start_ns;
+	span->duration_ns = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+	span->name = name;
+	atomic_store_explicit(&ring->head, head+1, memory_order_release);
+}
+
+
 static int json_get_long(cJSON *json, const char *name, long *value)
 {
 	cJSON *jtmp;
@@ -260,69 +1119,1064 @@ static int json_get_string(cJSON *json, const char *name, char **value)
 }
 
 
-static void cleanup_player(struct tfdg_player *player_s)
+static int player_die(const struct tfdg_player *player_s, int i)
 {
-	if(player_s){
-		free(player_s->name);
-		free(player_s->uuid);
-		free(player_s->client_id);
-		free(player_s);
-	}
+	return (player_s->dice[i/2] >> ((i&1)*4)) & 0x0F;
 }
 
 
-static bool is_hex(char c)
+static void player_set_die(struct tfdg_player *player_s, int i, int value)
 {
-	if(isdigit(c)
-			|| (c >= 'A' && c <= 'F')
-			|| (c >= 'a' && c <= 'f')){
+	int shift = (i&1)*4;
 
-		return true;
-	}else{
-		return false;
-	}
+	player_s->dice[i/2] = (uint8_t)((player_s->dice[i/2] & ~(0x0F << shift)) | ((value & 0x0F) << shift));
 }
 
 
-static bool validate_uuid(const char *uuid)
+static bool player_die_masked(const struct tfdg_player *player_s, int i)
 {
-	size_t len, i;
+	return (player_s->dice_mask & (1U << i)) != 0;
+}
 
-	len = strlen(uuid);
-	if(len != UUIDLEN){
-		return false;
-	}
-	if(uuid[8] != '-' || uuid[13] != '-' || uuid[18] != '-' || uuid[23] != '-'){
-		return false;
-	}
-	for(i=0; i<8; i++){
-		if(is_hex(uuid[i] == false)) return false;
-	}
-	for(i=9; i<13; i++){
-		if(is_hex(uuid[i] == false)) return false;
+
+/* Add the first count packed dice to faces. The low and high nibbles are
+ * counted separately so that consecutive dice don't wait on the same counter,
+ * then merged. */
+static void dice_histogram(const uint8_t *dice, int count, int faces[MAX_DICE_VALUE+1])
+{
+	int lo[16] = {0}, hi[16] = {0};
+	int i;
+
+	for(i=0; i<count/2; i++){
+		lo[dice[i] & 0x0F]++;
+		hi[dice[i] >> 4]++;
 	}
-	for(i=14; i<18; i++){
-		if(is_hex(uuid[i] == false)) return false;
+	if(count & 1){
+		lo[dice[count/2] & 0x0F]++;
 	}
-	for(i=19; i<len; i++){
-		if(is_hex(uuid[i] == false)) return false;
+	for(i=0; i<=MAX_DICE_VALUE; i++){
+		faces[i] += lo[i] + hi[i];
 	}
-	return true;
 }
 
 
-static void add_room_to_stats(struct tfdg_room *room_s, const char *reason)
+/* Adjust the room face counts for dice [from, to) of a player. */
+static void room_count_dice(struct tfdg_room *room_s, const struct tfdg_player *player_s, int from, int to, int delta)
 {
-	cJSON *game, *jtmp;
-	time_t now;
-	struct tm *lt;
-	char timestr[100];
+	int i;
 
-	if(room_s->player_count == 0){
-		return;
+	for(i=from; i<to; i++){
+		room_s->faces[player_die(player_s, i)] += delta;
 	}
+}
 
-	now = time(NULL);
+
+static bool room_player_seated(const struct tfdg_room *room_s, const struct tfdg_player *player_s)
+{
+	return player_s != NULL
+			&& player_s->seat >= 0
+			&& player_s->seat < room_s->seat_count
+			&& room_s->seats[player_s->seat] == player_s;
+}
+
+
+static struct tfdg_player *room_first_player(const struct tfdg_room *room_s)
+{
+	if(room_s->seat_count == 0){
+		return NULL;
+	}
+	return room_s->seats[0];
+}
+
+
+/* The player to the left, wrapping around the table. */
+static struct tfdg_player *room_next_player(const struct tfdg_room *room_s, const struct tfdg_player *player_s)
+{
+	if(room_player_seated(room_s, player_s) == false){
+		return NULL;
+	}
+	return room_s->seats[(player_s->seat + 1) % room_s->seat_count];
+}
+
+
+/* The player to the right, wrapping around the table. */
+static struct tfdg_player *room_prev_player(const struct tfdg_room *room_s, const struct tfdg_player *player_s)
+{
+	if(room_player_seated(room_s, player_s) == false){
+		return NULL;
+	}
+	return room_s->seats[(player_s->seat + room_s->seat_count - 1) % room_s->seat_count];
+}
+
+
+static int room_add_seat(struct tfdg_room *room_s, struct tfdg_player *player_s)
+{
+	struct tfdg_player **seats;
+	int seat_alloc;
+
+	if(room_s->seat_count == room_s->seat_alloc){
+		seat_alloc = room_s->seat_alloc ? room_s->seat_alloc*2 : 8;
+		seats = realloc(room_s->seats, sizeof(struct tfdg_player *)*(size_t)seat_alloc);
+		if(seats == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		room_s->seats = seats;
+		room_s->seat_alloc = seat_alloc;
+	}
+	player_s->seat = room_s->seat_count;
+	room_s->seats[room_s->seat_count] = player_s;
+	room_s->seat_count++;
+	room_count_dice(room_s, player_s, 0, player_s->dice_count, 1);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void room_remove_seat(struct tfdg_room *room_s, struct tfdg_player *player_s)
+{
+	int i;
+
+	if(room_player_seated(room_s, player_s) == false){
+		return;
+	}
+	room_count_dice(room_s, player_s, 0, player_s->dice_count, -1);
+	room_s->seat_count--;
+	for(i=player_s->seat; i<room_s->seat_count; i++){
+		room_s->seats[i] = room_s->seats[i+1];
+		room_s->seats[i]->seat = i;
+	}
+	player_s->seat = -1;
+}
+
+
+/* Return the room scratch buffer, grown to at least len bytes. The buffer is
+ * kept for the lifetime of the room and only ever grows, so rounds in a large
+ * room don't need an allocation each time. */
+static unsigned char *room_scratch(struct tfdg_room *room_s, size_t len)
+{
+	unsigned char *scratch;
+
+	if(len > room_s->scratch_len){
+		scratch = realloc(room_s->scratch, len);
+		if(scratch == NULL){
+			return NULL;
+		}
+		room_s->scratch = scratch;
+		room_s->scratch_len = len;
+	}
+	return room_s->scratch;
+}
+
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+	a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+	c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+	a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+	c += d; b ^= c; b = CHACHA_ROTL(b, 7);
+
+static void chacha20_block(const uint32_t key[8], uint64_t counter, unsigned char out[64])
+{
+	uint32_t in[16], x[16];
+	int i;
+
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	memcpy(&in[4], key, 32);
+	in[12] = (uint32_t)counter;
+	in[13] = (uint32_t)(counter >> 32);
+	in[14] = 0;
+	in[15] = 0;
+
+	memcpy(x, in, sizeof(x));
+	for(i=0; i<10; i++){
+		CHACHA_QR(x[0], x[4], x[8], x[12]);
+		CHACHA_QR(x[1], x[5], x[9], x[13]);
+		CHACHA_QR(x[2], x[6], x[10], x[14]);
+		CHACHA_QR(x[3], x[7], x[11], x[15]);
+		CHACHA_QR(x[0], x[5], x[10], x[15]);
+		CHACHA_QR(x[1], x[6], x[11], x[12]);
+		CHACHA_QR(x[2], x[7], x[8], x[13]);
+		CHACHA_QR(x[3], x[4], x[9], x[14]);
+	}
+	for(i=0; i<16; i++){
+		x[i] += in[i];
+		out[i*4+0] = (unsigned char)(x[i]);
+		out[i*4+1] = (unsigned char)(x[i] >> 8);
+		out[i*4+2] = (unsigned char)(x[i] >> 16);
+		out[i*4+3] = (unsigned char)(x[i] >> 24);
+	}
+}
+
+
+/* Mix fresh entropy into the key. Returns false if OpenSSL couldn't provide
+ * any, in which case the existing key is kept. */
+static bool rng_reseed(struct tfdg_rng *rng)
+{
+	uint32_t seed[8];
+	int i;
+
+	if(RAND_bytes((unsigned char *)seed, sizeof(seed)) <= 0){
+		return false;
+	}
+	for(i=0; i<8; i++){
+		rng->key[i] ^= seed[i];
+	}
+	memset(seed, 0, sizeof(seed));
+	rng->since_reseed = 0;
+	return true;
+}
+
+
+static void rng_refill(struct tfdg_rng *rng)
+{
+	int i;
+
+	if(rng->deterministic == false && rng->since_reseed >= RNG_RESEED_BYTES){
+		rng_reseed(rng);
+	}
+	for(i=0; i<RNG_BLOCKS; i++){
+		chacha20_block(rng->key, rng->counter++, &rng->buf[i*64]);
+	}
+	memcpy(rng->key, rng->buf, sizeof(rng->key));
+	memset(rng->buf, 0, sizeof(rng->key));
+	rng->pos = sizeof(rng->key);
+	rng->since_reseed += sizeof(rng->buf);
+}
+
+
+static bool rng_init(struct tfdg_rng *rng)
+{
+	memset(rng, 0, sizeof(struct tfdg_rng));
+	if(rng_reseed(rng) == false){
+		return false;
+	}
+	rng->pos = sizeof(rng->buf);
+	return true;
+}
+
+
+static uint32_t rng_u32(struct tfdg_rng *rng)
+{
+	uint32_t value;
+
+	if(rng->pos + sizeof(value) > sizeof(rng->buf)){
+		rng_refill(rng);
+	}
+	memcpy(&value, &rng->buf[rng->pos], sizeof(value));
+	memset(&rng->buf[rng->pos], 0, sizeof(value));
+	rng->pos += sizeof(value);
+	rng->draws++;
+	return value;
+}
+
+
+/* A generator whose output depends only on the seed, the room uuid and the
+ * nonce, so a room can be replayed from the same sequence of commands. The
+ * nonce is different each time a room is created, so a room recreated with
+ * the same uuid doesn't repeat the previous game's dice. A nonce of 0 is
+ * from a snapshot saved before there were nonces. */
+static void rng_init_seeded(struct tfdg_rng *rng, const char *seed, const char *room_uuid, uint64_t nonce)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	char material[300];
+	int len;
+
+	memset(rng, 0, sizeof(struct tfdg_rng));
+	if(nonce){
+		len = snprintf(material, sizeof(material), "%s/%s/%" PRIu64, seed, room_uuid, nonce);
+	}else{
+		len = snprintf(material, sizeof(material), "%s/%s", seed, room_uuid);
+	}
+	if(len < 0) len = 0;
+	if(len >= (int)sizeof(material)) len = (int)sizeof(material)-1;
+	SHA256((const unsigned char *)material, (size_t)len, digest);
+	memcpy(rng->key, digest, sizeof(rng->key));
+	rng->deterministic = true;
+	rng->pos = sizeof(rng->buf);
+}
+
+
+/* A nonce for a new seeded room. The count starts from the time in ns when
+ * the plugin started, so it doesn't repeat across restarts. */
+static uint64_t rng_nonce_new(void)
+{
+	uint64_t nonce;
+
+	if(rng_nonce_next){
+		nonce = rng_nonce_next;
+		rng_nonce_next = 0;
+	}else{
+		nonce = ++rng_nonce_last;
+	}
+	return nonce;
+}
+
+
+/* Move a generator on to where it was after `draws` draws. */
+static void rng_skip(struct tfdg_rng *rng, uint64_t draws)
+{
+	while(rng->draws < draws){
+		rng_u32(rng);
+	}
+}
+
+
+/* Unbiased integer in [0, bound), using Lemire's multiply and reject method.
+ * The division is only needed on the rare occasions a draw might be biased. */
+static uint32_t rng_uniform(struct tfdg_rng *rng, uint32_t bound)
+{
+	uint64_t m;
+	uint32_t low, threshold;
+
+	if(bound < 2) return 0;
+
+	m = (uint64_t)rng_u32(rng) * bound;
+	low = (uint32_t)m;
+	if(low < bound){
+		threshold = (0U - bound) % bound;
+		while(low < threshold){
+			m = (uint64_t)rng_u32(rng) * bound;
+			low = (uint32_t)m;
+		}
+	}
+	return (uint32_t)(m >> 32);
+}
+
+
+/* Fill out with count unbiased values in [0, bound), bound must be <= 256. */
+static void rng_uniform_batch(struct tfdg_rng *rng, uint32_t bound, uint8_t *out, size_t count)
+{
+	size_t i;
+
+	for(i=0; i<count; i++){
+		out[i] = (uint8_t)rng_uniform(rng, bound);
+	}
+}
+
+
+static struct tfdg_rng *room_rng(struct tfdg_room *room_s)
+{
+	if(room_s->rng){
+		return room_s->rng;
+	}
+	return &dice_rng;
+}
+
+
+/* Give a room its own deterministic generator. The seed, nonce and draw count
+ * are kept in the room json so a restart continues the same sequence. The
+ * nonce is a string because a double can't hold all 64 bits. */
+static int room_init_deterministic_rng(struct tfdg_room *room_s, const char *seed, uint64_t nonce, uint64_t draws)
+{
+	cJSON *jtmp;
+	char buf[21];
+
+	room_s->rng = malloc(sizeof(struct tfdg_rng));
+	if(room_s->rng == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	rng_init_seeded(room_s->rng, seed, room_s->uuid, nonce);
+	rng_skip(room_s->rng, draws);
+
+	if(cJSON_GetObjectItemCaseSensitive(room_s->json, "rng-seed") == NULL){
+		jtmp = cJSON_CreateString(seed);
+		cJSON_AddItemToObject(room_s->json, "rng-seed", jtmp);
+		snprintf(buf, sizeof(buf), "%" PRIu64, nonce);
+		jtmp = cJSON_CreateString(buf);
+		cJSON_AddItemToObject(room_s->json, "rng-nonce", jtmp);
+		jtmp = cJSON_CreateNumber((double)draws);
+		cJSON_AddItemToObject(room_s->json, "rng-draws", jtmp);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void room_sync_rng_json(struct tfdg_room *room_s)
+{
+	cJSON *jtmp;
+
+	if(room_s->rng == NULL) return;
+
+	jtmp = cJSON_GetObjectItemCaseSensitive(room_s->json, "rng-draws");
+	if(jtmp){
+		cJSON_SetNumberValue(jtmp, (double)room_s->rng->draws);
+	}
+}
+
+
+static void *pool_alloc(struct tfdg_pool *pool)
+{
+	struct tfdg_pool_chunk *chunk;
+	char *item;
+	size_t item_size;
+	int i;
+
+	if(pool->free_list == NULL){
+		item_size = (pool->item_size + POOL_ALIGN-1) & ~(size_t)(POOL_ALIGN-1);
+		chunk = malloc(sizeof(struct tfdg_pool_chunk) + item_size*POOL_CHUNK_ITEMS);
+		if(chunk == NULL) return NULL;
+
+		chunk->next = pool->chunks;
+		pool->chunks = chunk;
+		pool->chunk_count++;
+
+		item = (char *)&chunk[1];
+		for(i=POOL_CHUNK_ITEMS-1; i>=0; i--){
+			*(void **)&item[item_size*(size_t)i] = pool->free_list;
+			pool->free_list = &item[item_size*(size_t)i];
+		}
+	}
+	item = pool->free_list;
+	pool->free_list = *(void **)item;
+	pool->in_use++;
+	memset(item, 0, pool->item_size);
+	return item;
+}
+
+
+static void pool_free(struct tfdg_pool *pool, void *item)
+{
+	if(item == NULL) return;
+
+	*(void **)item = pool->free_list;
+	pool->free_list = item;
+	pool->in_use--;
+}
+
+
+static void pool_cleanup(struct tfdg_pool *pool)
+{
+	struct tfdg_pool_chunk *chunk, *next;
+
+	if(pool->in_use > 0) return;
+
+	for(chunk=pool->chunks; chunk; chunk=next){
+		next = chunk->next;
+		free(chunk);
+	}
+	pool->chunks = NULL;
+	pool->free_list = NULL;
+	pool->chunk_count = 0;
+}
+
+
+static struct tfdg_client_id *client_id_intern(const char *id)
+{
+	struct tfdg_client_id *client;
+	size_t len;
+
+	len = strlen(id);
+	HASH_FIND(hh, client_id_by_id, id, (unsigned int)len, client);
+	if(client){
+		client->refcount++;
+		return client;
+	}
+
+	client = pool_alloc(&client_id_pool);
+	if(client == NULL) return NULL;
+	if(len < sizeof(client->id_buf)){
+		memcpy(client->id_buf, id, len+1);
+		client->id = client->id_buf;
+	}else{
+		client->id = strdup(id);
+		if(client->id == NULL){
+			pool_free(&client_id_pool, client);
+			return NULL;
+		}
+	}
+	client->refcount = 1;
+	HASH_ADD_KEYPTR(hh, client_id_by_id, client->id, (unsigned int)len, client);
+	return client;
+}
+
+
+static void client_id_release(struct tfdg_client_id *client)
+{
+	if(client == NULL) return;
+
+	client->refcount--;
+	if(client->refcount == 0){
+		HASH_DELETE(hh, client_id_by_id, client);
+		if(client->id != client->id_buf){
+			free(client->id);
+		}
+		pool_free(&client_id_pool, client);
+	}
+}
+
+
+static void client_map_delete(struct tfdg_player *player_s)
+{
+	if(player_s->client_mapped){
+		DL_DELETE2(player_s->client->players, player_s, client_prev, client_next);
+		player_s->client_mapped = false;
+		client_player_count--;
+	}
+}
+
+
+/* A client may be in several rooms at once, so each interned client id keeps
+ * a list of its players, at most one per room. */
+static void client_map_add(struct tfdg_room *room_s, struct tfdg_player *player_s)
+{
+	struct tfdg_player *p, *tmp;
+
+	client_map_delete(player_s);
+	DL_FOREACH_SAFE2(player_s->client->players, p, tmp, client_next){
+		if(p->room == room_s){
+			client_map_delete(p);
+		}
+	}
+	player_s->room = room_s;
+	DL_APPEND2(player_s->client->players, player_s, client_prev, client_next);
+	player_s->client_mapped = true;
+	client_player_count++;
+}
+
+
+/* Only removes player_s's own entry - its client id may since have been
+ * taken over by another player in the room. */
+static void room_remove_client(struct tfdg_room *room_s, struct tfdg_player *player_s)
+{
+	struct tfdg_player *p;
+
+	if(player_s->client_id == NULL) return;
+
+	HASH_FIND(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), p);
+	if(p == player_s){
+		HASH_DELETE(hh_client_id, room_s->player_by_client_id, p);
+	}
+	client_map_delete(player_s);
+}
+
+
+static void cleanup_player(struct tfdg_player *player_s)
+{
+	if(player_s){
+		client_map_delete(player_s);
+		client_id_release(player_s->client);
+		pool_free(&player_pool, player_s);
+	}
+}
+
+
+/* Spectators and kicked players aren't part of the room json, so own theirs */
+static void cleanup_detached_player(struct tfdg_player *player_s)
+{
+	cJSON_Delete(player_s->json);
+	player_s->json = NULL;
+	cleanup_player(player_s);
+}
+
+
+/* Attach player_s to client_id, replacing whoever had that client in this room */
+static void room_set_client(struct tfdg_room *room_s, struct tfdg_player *player_s, const char *client_id)
+{
+	struct tfdg_player *p;
+	struct tfdg_client_id *client;
+
+	client = client_id_intern(client_id);
+	if(client == NULL) return;
+
+	if(player_s->client_id){
+		HASH_FIND(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), p);
+		if(p == player_s){
+			HASH_DELETE(hh_client_id, room_s->player_by_client_id, player_s);
+		}
+		client_map_delete(player_s);
+		client_id_release(player_s->client);
+	}
+	player_s->client = client;
+	player_s->client_id = client->id;
+
+	HASH_FIND(hh_client_id, room_s->player_by_client_id, client_id, (unsigned int)strlen(client_id), p);
+	if(p){
+		HASH_DELETE(hh_client_id, room_s->player_by_client_id, p);
+		client_map_delete(p);
+		player_set_compact(room_s, p, false);
+		if(p->state == tps_spectator && p != room_s->host){
+			/* Spectators aren't referenced from anywhere else */
+			cleanup_detached_player(p);
+		}
+	}
+	HASH_ADD_KEYPTR(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), player_s);
+	client_map_add(room_s, player_s);
+}
+
+
+/* Heap used by a cJSON tree: the items, their names and string values */
+static size_t cjson_memory(const cJSON *item)
+{
+	const cJSON *child;
+	size_t bytes;
+
+	bytes = sizeof(cJSON);
+	if(item->string){
+		bytes += strlen(item->string)+1;
+	}
+	if(item->valuestring){
+		bytes += strlen(item->valuestring)+1;
+	}
+	for(child=item->child; child; child=child->next){
+		bytes += cjson_memory(child);
+	}
+	return bytes;
+}
+
+
+/* Bytes held by a room: its struct and buffers, the room cJSON mirror, which
+ * includes the seated players' mirrors, and seated, lost and spectating
+ * players. Interned client ids are shared between rooms and aren't counted. */
+static size_t room_memory(const struct tfdg_room *room_s, int *players)
+{
+	struct tfdg_player *p, *tmp;
+	size_t bytes;
+
+	bytes = sizeof(struct tfdg_room)
+			+ (size_t)room_s->seat_alloc*sizeof(struct tfdg_player *)
+			+ room_s->scratch_len;
+	if(room_s->rng){
+		bytes += sizeof(struct tfdg_rng);
+	}
+	if(room_s->json){
+		bytes += cjson_memory(room_s->json);
+	}
+
+	*players = room_s->seat_count;
+	DL_FOREACH(room_s->lost_players, p){
+		(*players)++;
+	}
+	HASH_ITER(hh_client_id, room_s->player_by_client_id, p, tmp){
+		if(p->state == tps_spectator){
+			(*players)++;
+			if(p->json){
+				bytes += cjson_memory(p->json);
+			}
+		}
+	}
+	bytes += (size_t)*players*sizeof(struct tfdg_player);
+
+	return bytes;
+}
+
+
+/* Recount a room after players have come or gone, keeping memory_total in
+ * step. Anything else that changes the size of a room is picked up when the
+ * metrics are published. */
+static void room_account(struct tfdg_room *room_s)
+{
+	size_t bytes;
+	int players;
+
+	bytes = room_memory(room_s, &players);
+	memory_total = memory_total - room_s->mem_bytes + bytes;
+	room_s->mem_bytes = bytes;
+}
+
+
+static int room_spectator_count(struct tfdg_room *room_s)
+{
+	struct tfdg_player *p, *tmp;
+	int count = 0;
+
+	HASH_ITER(hh_client_id, room_s->player_by_client_id, p, tmp){
+		if(p->state == tps_spectator){
+			count++;
+		}
+	}
+	return count;
+}
+
+
+/* Returns the limit a login from client_id would break, or -1. A new room is
+ * checked against max-rooms-per-client and then max-rooms. A new player in
+ * room_s is checked against max-players-per-room if it will take a seat in
+ * the lobby, or against max-spectators-per-room once the game has started.
+ * Everything is checked against max-memory. */
+static int admission_check(struct tfdg_room *room_s, const char *client_id)
+{
+	struct tfdg_client_id *client = NULL;
+
+	if(room_s == NULL){
+		if(max_client_rooms > 0 && client_id){
+			HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+			if(client && client->rooms_created >= max_client_rooms){
+				return tr_max_client_rooms;
+			}
+		}
+		if(max_rooms > 0 && (int)HASH_COUNT(room_by_uuid) >= max_rooms){
+			return tr_max_rooms;
+		}
+	}else{
+		if(room_s->state == tgs_lobby){
+			if(max_room_players > 0 && room_s->seat_count >= max_room_players){
+				return tr_max_players;
+			}
+		}else if(max_room_spectators > 0 && room_spectator_count(room_s) >= max_room_spectators){
+			return tr_max_spectators;
+		}
+	}
+	if(max_memory > 0 && memory_total >= max_memory){
+		return tr_max_memory;
+	}
+	return -1;
+}
+
+
+/* Recount every live room, returns the size of the largest */
+static size_t memory_recount(void)
+{
+	struct tfdg_room *room_s, *room_tmp;
+	size_t largest = 0;
+
+	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
+		room_account(room_s);
+		if(room_s->mem_bytes > largest){
+			largest = room_s->mem_bytes;
+		}
+	}
+	return largest;
+}
+
+
+/* Parse "<per-second>/<burst>", or "0" for no limit */
+static void rate_parse(struct tfdg_rate *rate, const char *value)
+{
+	const char *slash;
+	int per_second, burst;
+
+	per_second = atoi(value);
+	slash = strchr(value, '/');
+	burst = slash ? atoi(slash+1) : per_second;
+	if(per_second <= 0){
+		rate->per_second = 0;
+		rate->burst = 0;
+	}else{
+		rate->per_second = (uint32_t)per_second;
+		rate->burst = (uint32_t)(burst > 0 ? burst : 1);
+	}
+}
+
+
+/* Handles "<prefix><class>" options, returns false if key isn't one */
+static bool rate_option(struct tfdg_rate *rates, const char *prefix, const char *key, const char *value)
+{
+	size_t len;
+	int i;
+
+	len = strlen(prefix);
+	if(strncmp(key, prefix, len)) return false;
+
+	for(i=0; i<TRC_COUNT; i++){
+		if(!strcmp(key+len, rate_class_names[i])){
+			rate_parse(&rates[i], value);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static uint64_t bucket_tokens(const struct tfdg_bucket *bucket, const struct tfdg_rate *rate, uint64_t now_ms)
+{
+	uint64_t tokens;
+
+	if(bucket->last_ms == 0){
+		return (uint64_t)rate->burst*1000;
+	}
+	tokens = bucket->tokens + (now_ms - bucket->last_ms)*rate->per_second;
+	if(tokens > (uint64_t)rate->burst*1000){
+		tokens = (uint64_t)rate->burst*1000;
+	}
+	return tokens;
+}
+
+
+static bool bucket_take(struct tfdg_bucket *bucket, const struct tfdg_rate *rate, uint64_t now_ms)
+{
+	uint64_t tokens;
+
+	if(rate->per_second == 0) return true;
+
+	tokens = bucket_tokens(bucket, rate, now_ms);
+	bucket->last_ms = now_ms;
+	if(tokens < 1000){
+		bucket->tokens = (uint32_t)tokens;
+		return false;
+	}
+	bucket->tokens = (uint32_t)(tokens - 1000);
+	return true;
+}
+
+
+/* ms until every one of the client's buckets is full again */
+static uint64_t bucket_refill_ms(const struct tfdg_client_id *client, uint64_t now_ms)
+{
+	uint64_t deficit, ms, longest = 0;
+	int i;
+
+	for(i=0; i<TRC_COUNT; i++){
+		if(client_rates[i].per_second == 0) continue;
+
+		deficit = (uint64_t)client_rates[i].burst*1000 - bucket_tokens(&client->buckets[i], &client_rates[i], now_ms);
+		ms = (deficit + client_rates[i].per_second - 1)/client_rates[i].per_second;
+		if(ms > longest){
+			longest = ms;
+		}
+	}
+	return longest;
+}
+
+
+/* Commands that end a round or take a player out of a room. Refusing one of
+ * these leaves a round waiting or a ghost player, so when they come from a
+ * player in the room they are charged to the buckets but always let through.
+ * Repeats are no-ops once the player has left or the round is decided. */
+static bool rate_exempt(enum tfdg_command command)
+{
+	switch(command){
+		case tc_logout:
+		case tc_start_game:
+		case tc_i_lost:
+		case tc_i_won:
+		case tc_leave_game:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/* Take a token for command from the client's bucket and then the room's.
+ * The first command from a client takes a reference on its interned id so
+ * the buckets outlive any players, it is dropped by rate_release() once the
+ * client has gone and its buckets have refilled. Only players in the room
+ * are charged to the room's bucket, so an outsider can't use up a room's
+ * budget and lock its players out. */
+static bool rate_check(const struct mosquitto_evt_acl_check *ed, struct tfdg_room *room_s, enum tfdg_command command)
+{
+	struct tfdg_client_id *client = NULL;
+	struct tfdg_player *player_s = NULL;
+	enum tfdg_rate_class rate_class;
+	const char *client_id;
+	uint64_t now_ms;
+	bool exempt;
+
+	if(rate_limit == false) return true;
+
+	rate_class = command_rate_class[command];
+	now_ms = now_ns()/1000000;
+
+	client_id = mosquitto_client_id(ed->client);
+	if(client_id){
+		HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+		if(client == NULL){
+			client = client_id_intern(client_id);
+			if(client) client->rate_held = true;
+		}else if(client->rate_held == false){
+			client->refcount++;
+			client->rate_held = true;
+		}else if(client->cool_until_ms){
+			/* Reconnected during the cool-down, carry on with the old buckets */
+			DL_DELETE2(rate_cooling, client, cool_prev, cool_next);
+			client->cool_until_ms = 0;
+		}
+	}
+	if(room_s && client){
+		HASH_FIND(hh_client_id, room_s->player_by_client_id, client->id, (unsigned int)strlen(client->id), player_s);
+	}
+	exempt = player_s && rate_exempt(command);
+
+	if(client && bucket_take(&client->buckets[rate_class], &client_rates[rate_class], now_ms) == false && exempt == false){
+		metrics.throttled[0][rate_class]++;
+		return false;
+	}
+	if(player_s && bucket_take(&room_s->buckets[rate_class], &room_rates[rate_class], now_ms) == false && exempt == false){
+		metrics.throttled[1][rate_class]++;
+		return false;
+	}
+	return true;
+}
+
+
+/* Called on disconnect. A client that reconnects straight away would start
+ * with full buckets, so keep them until they would have refilled anyway. */
+static void rate_release(const char *client_id)
+{
+	struct tfdg_client_id *client;
+	uint64_t now_ms, refill_ms;
+
+	HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+	if(client == NULL || client->rate_held == false || client->cool_until_ms) return;
+
+	now_ms = now_ns()/1000000;
+	refill_ms = bucket_refill_ms(client, now_ms);
+	if(refill_ms == 0){
+		client->rate_held = false;
+		client_id_release(client);
+	}else{
+		client->cool_until_ms = now_ms + refill_ms;
+		DL_APPEND2(rate_cooling, client, cool_prev, cool_next);
+	}
+}
+
+
+/* Drop the buckets of clients whose cool-down has passed */
+static void rate_cool(void)
+{
+	struct tfdg_client_id *client, *client_tmp;
+	uint64_t now_ms;
+
+	if(rate_cooling == NULL) return;
+
+	now_ms = now_ns()/1000000;
+	DL_FOREACH_SAFE2(rate_cooling, client, client_tmp, cool_next){
+		if(now_ms >= client->cool_until_ms){
+			DL_DELETE2(rate_cooling, client, cool_prev, cool_next);
+			client->cool_until_ms = 0;
+			client->rate_held = false;
+			client_id_release(client);
+		}
+	}
+}
+
+
+static bool is_hex(char c)
+{
+	if(isdigit(c)
+			|| (c >= 'A' && c <= 'F')
+			|| (c >= 'a' && c <= 'f')){
+
+		return true;
+	}else{
+		return false;
+	}
+}
+
+
+static bool validate_uuid(const char *uuid)
+{
+	size_t len, i;
+
+	len = strlen(uuid);
+	if(len != UUIDLEN){
+		return false;
+	}
+	if(uuid[8] != '-' || uuid[13] != '-' || uuid[18] != '-' || uuid[23] != '-'){
+		return false;
+	}
+	for(i=0; i<8; i++){
+		if(is_hex(uuid[i] == false)) return false;
+	}
+	for(i=9; i<13; i++){
+		if(is_hex(uuid[i] == false)) return false;
+	}
+	for(i=14; i<18; i++){
+		if(is_hex(uuid[i] == false)) return false;
+	}
+	for(i=19; i<len; i++){
+		if(is_hex(uuid[i] == false)) return false;
+	}
+	return true;
+}
+
+
+static void room_unschedule_expiry(struct tfdg_room *room_s)
+{
+	if(room_s->expiry_prev){
+		DL_DELETE2(expiry_wheel[room_s->expiry_slot], room_s, expiry_prev, expiry_next);
+		room_s->expiry_prev = NULL;
+		room_s->expiry_next = NULL;
+	}
+}
+
+
+static void room_schedule_expiry(struct tfdg_room *room_s, time_t expiry_time)
+{
+	time_t slot_time;
+
+	room_unschedule_expiry(room_s);
+	if(room_s->cleanup_reason){
+		return;
+	}
+
+	/* Anything already due goes in the next slot to be processed, otherwise
+	 * it would wait for a full turn of the wheel. */
+	slot_time = expiry_time;
+	if(slot_time <= expiry_wheel_time){
+		slot_time = expiry_wheel_time + 1;
+	}
+	room_s->expiry_time = expiry_time;
+	room_s->expiry_slot = (int)(slot_time & (EXPIRY_WHEEL_SIZE-1));
+	DL_APPEND2(expiry_wheel[room_s->expiry_slot], room_s, expiry_prev, expiry_next);
+}
+
+
+/* The room wakes up for whichever comes first, going idle or an away player's
+ * reconnect grace time running out. */
+static void room_update_expiry(struct tfdg_room *room_s)
+{
+	time_t expiry_time;
+
+	expiry_time = room_s->idle_expiry_time;
+	if(room_s->away_expiry_time != 0 && room_s->away_expiry_time < expiry_time){
+		expiry_time = room_s->away_expiry_time;
+	}
+	room_schedule_expiry(room_s, expiry_time);
+}
+
+
+/* How long a room may sit idle in its current state before being reclaimed */
+static int room_state_expiry_time(enum tfdg_game_state state)
+{
+	switch(state){
+		case tgs_lobby:
+			return lobby_expiry_time;
+		case tgs_game_over:
+			return game_over_expiry_time;
+		case tgs_resetting:
+			return resetting_expiry_time;
+		default:
+			return room_expiry_time;
+	}
+}
+
+
+/* Finished rooms are not kept alive by further activity */
+static bool room_is_finished(struct tfdg_room *room_s)
+{
+	return room_s->state == tgs_game_over || room_s->state == tgs_resetting;
+}
+
+
+static const char *room_cleanup_reason(struct tfdg_room *room_s)
+{
+	switch(room_s->state){
+		case tgs_game_over:
+			return "game-over";
+		case tgs_resetting:
+			return "reset-game";
+		default:
+			return "expire";
+	}
+}
+
+
+static void add_room_to_stats(struct tfdg_room *room_s, const char *reason)
+{
+	struct tfdg_job *job;
+	cJSON *game, *jtmp;
+	time_t now;
+	struct tm *lt;
+	char timestr[100];
+
+	if(room_s->player_count == 0){
+		return;
+	}
+
+	now = time(NULL);
 	game = cJSON_CreateObject();
 
 	jtmp = cJSON_CreateNumber(room_s->player_count);
@@ -401,45 +2255,138 @@ static void add_room_to_stats(struct tfdg_room *room_s, const char *reason)
 	jtmp = room_dice_totals(room_s);
 	cJSON_AddItemToObject(game, "dice-totals", jtmp);
 
-	cJSON_AddItemToArray(j_stats_games, game);
+	job = calloc(1, sizeof(struct tfdg_job));
+	if(job == NULL){
+		cJSON_Delete(game);
+		return;
+	}
+	job->type = tj_game_record;
+	job->record = game;
+	job_submit(job);
 
-	save_full_state();
+	state_dirty = true;
 }
 
 
 static void cleanup_room(struct tfdg_room *room_s, const char *reason)
 {
-	struct tfdg_player *p, *tmp1, *tmp2, *tmp3;
+	struct tfdg_player *p, *tmp1, *tmp3;
+	int i;
 
 	add_room_to_stats(room_s, reason);
-	printf(ANSI_YELLOW GAME_NAME ANSI_RED "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : " ANSI_YELLOW "%s" ANSI_RESET "\n", room_s->uuid, MAX_LOG_LEN, "cleanup", reason);
-	CDL_FOREACH_SAFE(room_s->players, p, tmp1, tmp2){
-		CDL_DELETE(room_s->players, p);
-		HASH_DELETE(hh_uuid, room_s->player_by_uuid, p);
-		if(p->client_id){
-			HASH_FIND(hh_client_id, room_s->player_by_client_id, p->client_id, (unsigned int)strlen(p->client_id), tmp3);
-			if(tmp3){
-				HASH_DELETE(hh_client_id, room_s->player_by_client_id, tmp3);
-			}
+	tfdg_log(tll_notice, room_s->uuid, "cleanup", NULL, "reason=\"%s\"", reason);
+	memory_total -= room_s->mem_bytes;
+	room_s->mem_bytes = 0;
+	/* A spectator host is kept after losing its client entry, so may only
+	 * be reachable from here */
+	p = room_s->host;
+	room_s->host = NULL;
+	if(p && p->state == tps_spectator){
+		room_remove_client(room_s, p);
+		HASH_FIND(hh_uuid, room_s->player_by_uuid, p->uuid, (unsigned int)strlen(p->uuid), tmp3);
+		if(tmp3 == p){
+			HASH_DELETE(hh_uuid, room_s->player_by_uuid, p);
 		}
+		cleanup_detached_player(p);
+	}
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[i];
+		HASH_DELETE(hh_uuid, room_s->player_by_uuid, p);
+		room_remove_client(room_s, p);
 		cleanup_player(p);
 	}
+	free(room_s->seats);
+	room_s->seats = NULL;
+	room_s->seat_count = 0;
+	free(room_s->scratch);
+	room_s->scratch = NULL;
+	free(room_s->rng);
+	room_s->rng = NULL;
+	if(room_s->creator){
+		room_s->creator->rooms_created--;
+		client_id_release(room_s->creator);
+		room_s->creator = NULL;
+	}
 	DL_FOREACH_SAFE(room_s->lost_players, p, tmp1){
 		DL_DELETE(room_s->lost_players, p);
 		HASH_DELETE(hh_uuid, room_s->player_by_uuid, p);
-		if(p->client_id){
-			HASH_FIND(hh_client_id, room_s->player_by_client_id, p->client_id, (unsigned int)strlen(p->client_id), tmp3);
-			if(tmp3){
-				HASH_DELETE(hh_client_id, room_s->player_by_client_id, tmp3);
-			}
-		}
+		room_remove_client(room_s, p);
 		cleanup_player(p);
 	}
+	/* Anything left is a spectator or a kicked player */
+	HASH_ITER(hh_client_id, room_s->player_by_client_id, p, tmp1){
+		HASH_DELETE(hh_client_id, room_s->player_by_client_id, p);
+		HASH_FIND(hh_uuid, room_s->player_by_uuid, p->uuid, (unsigned int)strlen(p->uuid), tmp3);
+		if(tmp3 == p){
+			HASH_DELETE(hh_uuid, room_s->player_by_uuid, p);
+		}
+		cleanup_detached_player(p);
+	}
 	if(room_s->json){
 		json_delete_game(room_s->json);
 	}
+	room_unschedule_expiry(room_s);
+	if(room_s->cleanup_reason == NULL){
+		HASH_DELETE(hh, room_by_uuid, room_s);
+	}
+	pool_free(&room_pool, room_s);
+}
+
+
+/* Detach a room so no further messages can reach it, and leave the rest of
+ * the teardown to cleanup_queue_drain(). */
+static void room_queue_cleanup(struct tfdg_room *room_s, const char *reason)
+{
+	if(room_s->cleanup_reason){
+		return;
+	}
+	room_unschedule_expiry(room_s);
 	HASH_DELETE(hh, room_by_uuid, room_s);
-	free(room_s);
+	room_s->cleanup_reason = reason;
+	room_s->cleanup_next = NULL;
+	if(cleanup_queue_tail){
+		cleanup_queue_tail->cleanup_next = room_s;
+	}else{
+		cleanup_queue = room_s;
+	}
+	cleanup_queue_tail = room_s;
+}
+
+
+static long elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)*1000000 + (now.tv_nsec - start->tv_nsec)/1000;
+}
+
+
+/* Free queued rooms until the queue is empty or budget_us has been used, at
+ * least one room is always freed. A budget of < 0 means no limit. The state
+ * file is written once at the end if anything changed. */
+static void cleanup_queue_drain(long budget_us)
+{
+	struct tfdg_room *room_s;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(cleanup_queue){
+		room_s = cleanup_queue;
+		cleanup_queue = room_s->cleanup_next;
+		if(cleanup_queue == NULL){
+			cleanup_queue_tail = NULL;
+		}
+		cleanup_room(room_s, room_s->cleanup_reason);
+
+		if(budget_us >= 0 && elapsed_us(&start) >= budget_us){
+			break;
+		}
+	}
+	if(state_dirty){
+		save_full_state();
+		state_dirty = false;
+	}
 }
 
 static void cleanup_all(void)
@@ -488,6 +2435,24 @@ int json_parse_name_uuid(const char *json_str, size_t json_str_len, char **name,
 }
 
 
+/* Returns true if the client asked for compact payloads with "encoding":"cbor" */
+static bool json_parse_compact(const char *json_str, size_t json_str_len)
+{
+	cJSON *tree, *jtmp;
+	bool compact = false;
+
+	tree = cJSON_ParseWithLength(json_str, json_str_len);
+	if(tree){
+		jtmp = cJSON_GetObjectItemCaseSensitive(tree, "encoding");
+		if(jtmp && cJSON_IsString(jtmp) && !strcmp(jtmp->valuestring, "cbor")){
+			compact = true;
+		}
+		cJSON_Delete(tree);
+	}
+	return compact;
+}
+
+
 int find_player_from_json(const char *json_str, size_t json_str_len, struct tfdg_room *room_s, struct tfdg_player **player_s)
 {
 	char *name, *uuid;
@@ -495,11 +2460,9 @@ int find_player_from_json(const char *json_str, size_t json_str_len, struct tfdg
 
 	*player_s = NULL;
 	if(json_parse_name_uuid(json_str, json_str_len, &name, &uuid) == 0){
-		CDL_FOREACH(room_s->players, p){
-			if(!strcmp(p->uuid, uuid)){
-				*player_s = p;
-				break;
-			}
+		HASH_FIND(hh_uuid, room_s->player_by_uuid, uuid, (unsigned int)strlen(uuid), p);
+		if(room_player_seated(room_s, p)){
+			*player_s = p;
 		}
 	}
 	free(name);
@@ -610,6 +2573,8 @@ static cJSON *player_to_cjson(struct tfdg_player *player_s)
 {
 	cJSON *tree, *jtmp;
 
+	if(player_s == NULL) return NULL;
+
 	tree = cJSON_CreateObject();
 	jtmp = cJSON_CreateString(player_s->name);
 	cJSON_AddItemToObject(tree, "name", jtmp);
@@ -620,51 +2585,324 @@ static cJSON *player_to_cjson(struct tfdg_player *player_s)
 }
 
 
-static cJSON *json_create_lobby_players_obj(struct tfdg_room *room_s)
+static cJSON *json_create_lobby_players_obj(struct tfdg_room *room_s)
+{
+	cJSON *tree, *j_player;
+	int i;
+
+	tree = cJSON_CreateArray();
+	for(i=0; i<room_s->seat_count; i++){
+		j_player = player_to_cjson(room_s->seats[i]);
+		if(j_player){
+			cJSON_AddItemToArray(tree, j_player);
+		}
+	}
+
+	return tree;
+}
+
+
+static cJSON *json_create_options_obj(struct tfdg_room *room_s)
+{
+	cJSON *j_options, *jtmp;
+
+	j_options = cJSON_CreateObject();
+
+	jtmp = cJSON_CreateBool(room_s->options.losers_see_dice);
+	cJSON_AddItemToObject(j_options, "losers-see-dice", jtmp);
+
+	jtmp = cJSON_CreateNumber(room_s->options.max_dice);
+	cJSON_AddItemToObject(j_options, "max-dice", jtmp);
+
+	jtmp = cJSON_CreateNumber(room_s->options.max_dice_value);
+	cJSON_AddItemToObject(j_options, "max-dice-value", jtmp);
+
+	jtmp = cJSON_CreateNumber(room_s->options.random_mask_percentage);
+	cJSON_AddItemToObject(j_options, "random-mask-percentage", jtmp);
+
+	jtmp = cJSON_CreateBool(room_s->options.random_position);
+	cJSON_AddItemToObject(j_options, "random-position", jtmp);
+
+	jtmp = cJSON_CreateBool(room_s->options.show_results_table);
+	cJSON_AddItemToObject(j_options, "show-results-table", jtmp);
+
+	jtmp = cJSON_CreateBool(room_s->options.swap_direction);
+	cJSON_AddItemToObject(j_options, "swap-direction", jtmp);
+
+	return j_options;
+}
+
+
+/* Compact payloads
+ *
+ * A client that logs in with "encoding":"cbor" receives room messages on
+ * tfdgc/<room>/<cmd> instead of tfdg/<room>/<cmd>. The payload is the same
+ * cJSON tree encoded as CBOR, with the keys in compact_keys[] replaced by
+ * their index, and {"name":..., "uuid":...} player objects replaced by
+ * {0:<player index>}. The name and uuid for each index are only sent in the
+ * "players" array of lobby-players and state.
+ */
+static const char compact_keys[][24] = {
+	"p", "name", "uuid", "players", "options", "state", "results",
+	"dudo-candidates", "calza-candidate", "host", "pre-roll", "starter",
+	"dice", "forwards", "next-player", "round-loser", "round-winner",
+	"palifico-round", "losers-see-dice", "max-dice", "max-dice-value",
+	"random-mask-percentage", "random-position", "show-results-table",
+	"swap-direction", "roll-dice-at-start", "random-max-dice-value",
+	"value", "totals", "winner", "sound",
+};
+#define COMPACT_KEY_PLAYER 0
+#define COMPACT_ROSTER_MEMBER 0x01
+#define COMPACT_ROSTER_PARENT 0x02
+
+struct cbor_buf{
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+
+static int cbor_reserve(struct cbor_buf *buf, size_t len)
+{
+	uint8_t *data;
+	size_t size;
+
+	if(buf->len + len <= buf->size){
+		return MOSQ_ERR_SUCCESS;
+	}
+	size = buf->size?buf->size:128;
+	while(size < buf->len + len){
+		size *= 2;
+	}
+	data = realloc(buf->data, size);
+	if(data == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	buf->data = data;
+	buf->size = size;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int cbor_put_head(struct cbor_buf *buf, uint8_t major, uint64_t value)
+{
+	uint8_t *p;
+	int i, bytes;
+
+	if(cbor_reserve(buf, 9)){
+		return MOSQ_ERR_NOMEM;
+	}
+	p = &buf->data[buf->len];
+	major = (uint8_t)(major << 5);
+
+	if(value < 24){
+		p[0] = (uint8_t)(major | value);
+		buf->len++;
+		return MOSQ_ERR_SUCCESS;
+	}else if(value <= UINT8_MAX){
+		p[0] = major | 24;
+		bytes = 1;
+	}else if(value <= UINT16_MAX){
+		p[0] = major | 25;
+		bytes = 2;
+	}else if(value <= UINT32_MAX){
+		p[0] = major | 26;
+		bytes = 4;
+	}else{
+		p[0] = major | 27;
+		bytes = 8;
+	}
+	for(i=0; i<bytes; i++){
+		p[bytes-i] = (uint8_t)(value >> (8*i));
+	}
+	buf->len += (size_t)bytes + 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int cbor_put_text(struct cbor_buf *buf, const char *str)
+{
+	size_t len;
+
+	len = strlen(str);
+	if(cbor_put_head(buf, 3, len) || cbor_reserve(buf, len)){
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(&buf->data[buf->len], str, len);
+	buf->len += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int cbor_put_number(struct cbor_buf *buf, double value)
+{
+	uint8_t *p;
+	float fvalue;
+	uint32_t u32;
+	uint64_t u64;
+	int i;
+
+	if(value == (double)(int64_t)value && value > -9e18 && value < 9e18){
+		if(value < 0){
+			return cbor_put_head(buf, 1, (uint64_t)(-1 - (int64_t)value));
+		}else{
+			return cbor_put_head(buf, 0, (uint64_t)value);
+		}
+	}
+
+	if(cbor_reserve(buf, 9)){
+		return MOSQ_ERR_NOMEM;
+	}
+	p = &buf->data[buf->len];
+	fvalue = (float)value;
+	if((double)fvalue == value){
+		memcpy(&u32, &fvalue, sizeof(u32));
+		p[0] = 0xFA;
+		for(i=0; i<4; i++){
+			p[4-i] = (uint8_t)(u32 >> (8*i));
+		}
+		buf->len += 5;
+	}else{
+		memcpy(&u64, &value, sizeof(u64));
+		p[0] = 0xFB;
+		for(i=0; i<8; i++){
+			p[8-i] = (uint8_t)(u64 >> (8*i));
+		}
+		buf->len += 9;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int compact_key_index(const char *key)
+{
+	int i;
+
+	for(i=0; i<(int)(sizeof(compact_keys)/sizeof(compact_keys[0])); i++){
+		if(!strcmp(compact_keys[i], key)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+static int cbor_put_key(struct cbor_buf *buf, const char *key)
 {
-	struct tfdg_player *p;
-	cJSON *tree, *j_player;
+	int idx;
 
-	tree = cJSON_CreateArray();
-	CDL_FOREACH(room_s->players, p){
-		j_player = player_to_cjson(p);
-		if(j_player){
-			cJSON_AddItemToArray(tree, j_player);
-		}
+	idx = compact_key_index(key);
+	if(idx < 0){
+		return cbor_put_text(buf, key);
+	}else{
+		return cbor_put_head(buf, 0, (uint64_t)idx);
 	}
-
-	return tree;
 }
 
 
-static cJSON *json_create_options_obj(struct tfdg_room *room_s)
+static int cbor_put_item(struct cbor_buf *buf, struct tfdg_room *room_s, const cJSON *item, int flags)
 {
-	cJSON *j_options, *jtmp;
+	const cJSON *child, *j_uuid;
+	struct tfdg_player *player_s = NULL;
+	uint64_t count;
+	int child_flags;
+	bool is_player_key;
+
+	if(cJSON_IsNumber(item)){
+		return cbor_put_number(buf, item->valuedouble);
+	}else if(cJSON_IsString(item)){
+		return cbor_put_text(buf, item->valuestring);
+	}else if(cJSON_IsBool(item)){
+		return cbor_put_head(buf, 7, cJSON_IsTrue(item)?21:20);
+	}else if(cJSON_IsArray(item)){
+		if(cbor_put_head(buf, 4, (uint64_t)cJSON_GetArraySize(item))){
+			return MOSQ_ERR_NOMEM;
+		}
+		cJSON_ArrayForEach(child, item){
+			if(cbor_put_item(buf, room_s, child, flags & COMPACT_ROSTER_MEMBER)){
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		return MOSQ_ERR_SUCCESS;
+	}else if(cJSON_IsObject(item)){
+		j_uuid = cJSON_GetObjectItemCaseSensitive(item, "uuid");
+		if(cJSON_IsString(j_uuid)){
+			HASH_FIND(hh_uuid, room_s->player_by_uuid, j_uuid->valuestring, (unsigned int)strlen(j_uuid->valuestring), player_s);
+		}
 
-	j_options = cJSON_CreateObject();
+		count = 0;
+		cJSON_ArrayForEach(child, item){
+			if(player_s == NULL || (flags & COMPACT_ROSTER_MEMBER)
+					|| (strcmp(child->string, "name") && strcmp(child->string, "uuid"))){
+				count++;
+			}
+		}
+		if(player_s){
+			count++;
+		}
 
-	jtmp = cJSON_CreateBool(room_s->options.losers_see_dice);
-	cJSON_AddItemToObject(j_options, "losers-see-dice", jtmp);
+		if(cbor_put_head(buf, 5, count)){
+			return MOSQ_ERR_NOMEM;
+		}
+		if(player_s){
+			if(cbor_put_head(buf, 0, COMPACT_KEY_PLAYER)
+					|| cbor_put_head(buf, 0, (uint64_t)player_s->index)){
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		cJSON_ArrayForEach(child, item){
+			is_player_key = !strcmp(child->string, "name") || !strcmp(child->string, "uuid");
+			if(player_s && is_player_key && !(flags & COMPACT_ROSTER_MEMBER)){
+				continue;
+			}
+			if((flags & COMPACT_ROSTER_PARENT) && !strcmp(child->string, "players")){
+				child_flags = COMPACT_ROSTER_MEMBER;
+			}else{
+				child_flags = 0;
+			}
+			if(cbor_put_key(buf, child->string)
+					|| cbor_put_item(buf, room_s, child, child_flags)){
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		return MOSQ_ERR_SUCCESS;
+	}else{
+		return cbor_put_head(buf, 7, 22); /* null */
+	}
+}
 
-	jtmp = cJSON_CreateNumber(room_s->options.max_dice);
-	cJSON_AddItemToObject(j_options, "max-dice", jtmp);
 
-	jtmp = cJSON_CreateNumber(room_s->options.max_dice_value);
-	cJSON_AddItemToObject(j_options, "max-dice-value", jtmp);
+static void broker_publish(const char *topic, int payloadlen, void *payload, bool retain)
+{
+	metrics.publish_count++;
+	metrics.publish_bytes += payloadlen;
+	mosquitto_broker_publish(NULL, topic, payloadlen, payload, 1, retain, NULL);
+}
 
-	jtmp = cJSON_CreateNumber(room_s->options.random_mask_percentage);
-	cJSON_AddItemToObject(j_options, "random-mask-percentage", jtmp);
 
-	jtmp = cJSON_CreateBool(room_s->options.random_position);
-	cJSON_AddItemToObject(j_options, "random-position", jtmp);
+/* Publish to a single client, the broker doesn't ACL check these */
+static void client_publish(const char *client_id, const char *topic, int payloadlen, void *payload)
+{
+	metrics.publish_count++;
+	metrics.publish_bytes += payloadlen;
+	mosquitto_broker_publish(client_id, topic, payloadlen, payload, 1, false, NULL);
+}
 
-	jtmp = cJSON_CreateBool(room_s->options.show_results_table);
-	cJSON_AddItemToObject(j_options, "show-results-table", jtmp);
 
-	jtmp = cJSON_CreateBool(room_s->options.swap_direction);
-	cJSON_AddItemToObject(j_options, "swap-direction", jtmp);
+static void compact_publish(struct tfdg_room *room_s, const char *topic, cJSON *tree, bool roster)
+{
+	struct cbor_buf buf;
 
-	return j_options;
+	memset(&buf, 0, sizeof(buf));
+	if(tree){
+		if(cbor_put_item(&buf, room_s, tree, roster?COMPACT_ROSTER_PARENT:0)
+				|| buf.len > MQTT_MAX_PAYLOAD){
+
+			free(buf.data);
+			return;
+		}
+	}
+	broker_publish(topic, (int)buf.len, buf.data, false);
 }
 
 
@@ -672,7 +2910,7 @@ static void easy_publish(struct tfdg_room *room_s, const char *topic_suffix, cJS
 {
 	char *json_str;
 	size_t json_str_len;
-	char topic[200];
+	char topic[200], ctopic[200];
 
 	if(tree){
 		json_str = cJSON_PrintUnformatted(tree);
@@ -687,7 +2925,12 @@ static void easy_publish(struct tfdg_room *room_s, const char *topic_suffix, cJS
 	}
 
 	snprintf(topic, sizeof(topic), "tfdg/%s/%s", room_s->uuid, topic_suffix);
-	mosquitto_broker_publish(NULL, topic, (int)json_str_len, json_str, 1, 0, NULL);
+	if(room_s->compact_count > 0){
+		snprintf(ctopic, sizeof(ctopic), "tfdgc/%s/%s", room_s->uuid, topic_suffix);
+		compact_publish(room_s, ctopic, tree,
+				!strcmp(topic_suffix, "lobby-players") || !strcmp(topic_suffix, "state"));
+	}
+	broker_publish(topic, (int)json_str_len, json_str, false);
 }
 
 
@@ -743,9 +2986,7 @@ void tfdg_send_current_state(struct tfdg_room *room_s, struct tfdg_player *playe
 	}
 	cJSON_AddItemToObject(tree, "players", players);
 
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "sending-state", player_s->uuid, player_s->name);
+	tfdg_log(tll_debug, room_s->uuid, "sending-state", player_s, NULL);
 
 
 	switch(room_s->state){
@@ -841,9 +3082,9 @@ void tfdg_send_current_state(struct tfdg_room *room_s, struct tfdg_player *playe
 
 			if(room_s->current_count > 2){
 				if(room_s->forwards){
-					jtmp = player_to_cjson(room_s->starter->next);
+					jtmp = player_to_cjson(room_next_player(room_s, room_s->starter));
 				}else{
-					jtmp = player_to_cjson(room_s->starter->prev);
+					jtmp = player_to_cjson(room_prev_player(room_s, room_s->starter));
 				}
 				if(jtmp){
 					cJSON_AddItemToObject(tree, "next-player", jtmp);
@@ -898,26 +3139,392 @@ int mosquitto_plugin_version(int supported_version_count, const int *supported_v
 }
 
 
+/* Only the active games are serialised here, the worker adds the stats
+ * history and writes the file. */
 static void save_full_state(void)
 {
-	char *json_str;
+	struct tfdg_job *job;
+	struct tfdg_room *room_s, *room_tmp;
+	struct timespec start;
+
+	if(j_all_games == NULL) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
+		room_sync_rng_json(room_s);
+	}
+
+	job = calloc(1, sizeof(struct tfdg_job));
+	if(job == NULL) return;
+
+	job->type = tj_save_state;
+	job->games_json = cJSON_Print(j_all_games);
+	if(job->games_json == NULL){
+		free(job);
+		return;
+	}
+	metrics.snapshot_count++;
+	metrics.snapshot_serialise_us = elapsed_us(&start);
+	trace_span(&trace_broker, tt_save_state,
+			trace_enabled ? (uint64_t)start.tv_sec*1000000000 + (uint64_t)start.tv_nsec : 0);
+	job_submit(job);
+}
+
+
+static void write_state_file(const char *games_json)
+{
+	char *stats_str;
 	FILE *fptr;
+	struct timespec start;
 
-	if(j_full_state){
-		json_str = cJSON_Print(j_full_state);
-		if(json_str){
-			fptr = fopen(state_file, "wt");
-			if(fptr){
-				fprintf(fptr, "%s", json_str);
-				fclose(fptr);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stats_str = cJSON_Print(j_statistics);
+	if(stats_str == NULL) return;
+
+	fptr = fopen(state_file, "wt");
+	if(fptr){
+		fprintf(fptr, "{\n\t\"statistics\":\t%s,\n\t\"games\":\t%s\n}", stats_str, games_json);
+		fclose(fptr);
+	}
+	free(stats_str);
+	atomic_store(&snapshot_write_us, elapsed_us(&start));
+}
+
+
+static void prom_counter(FILE *fptr, const char *name, const char *help)
+{
+	fprintf(fptr, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+}
+
+
+/* Write the broker thread metrics followed by the aggregate game stats, via
+ * a temporary file so a scrape never sees a partial file. */
+static void write_prom_file(const char *prom)
+{
+	char *tmp_file;
+	size_t len;
+	FILE *fptr;
+	long games = 0;
+	int i;
+
+	len = strlen(prom_file) + strlen(".tmp") + 1;
+	tmp_file = malloc(len);
+	if(tmp_file == NULL) return;
+	snprintf(tmp_file, len, "%s.tmp", prom_file);
+
+	fptr = fopen(tmp_file, "wt");
+	if(fptr == NULL){
+		free(tmp_file);
+		return;
+	}
+	fputs(prom, fptr);
+
+	for(i=0; i<=100; i++){
+		games += stats.players[i];
+	}
+	prom_counter(fptr, "tfdg_games_total", "Games won since the statistics began.");
+	fprintf(fptr, "tfdg_games_total %ld\n", games);
+	prom_counter(fptr, "tfdg_dudo_total", "Dudo calls by result.");
+	fprintf(fptr, "tfdg_dudo_total{result=\"success\"} %d\n", stats.dudo_success);
+	fprintf(fptr, "tfdg_dudo_total{result=\"fail\"} %d\n", stats.dudo_fail);
+	prom_counter(fptr, "tfdg_calza_total", "Calza calls by result.");
+	fprintf(fptr, "tfdg_calza_total{result=\"success\"} %d\n", stats.calza_success);
+	fprintf(fptr, "tfdg_calza_total{result=\"fail\"} %d\n", stats.calza_fail);
+	prom_counter(fptr, "tfdg_thrown_dice_total", "Dice thrown by face value.");
+	for(i=0; i<MAX_DICE_VALUE; i++){
+		fprintf(fptr, "tfdg_thrown_dice_total{value=\"%d\"} %d\n", i+1, stats.thrown_dice_values[i]);
+	}
+
+	if(fclose(fptr) == 0){
+		rename(tmp_file, prom_file);
+	}else{
+		remove(tmp_file);
+	}
+	free(tmp_file);
+}
+
+
+static const char *trace_name(uint32_t name)
+{
+	if(name < TC_COUNT){
+		return command_names[name];
+	}else if(name - TC_COUNT < sizeof(trace_names)/sizeof(trace_names[0])){
+		return trace_names[name - TC_COUNT];
+	}else{
+		return "unknown";
+	}
+}
+
+
+static void trace_write_ring(FILE *fptr, struct tfdg_trace_ring *ring, int tid, uint64_t since_ns)
+{
+	struct tfdg_trace_span span;
+	size_t head, i;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	for(i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i<head; i++){
+		span = ring->spans[i & (TRACE_RING_SIZE-1)];
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&ring->head, memory_order_relaxed) - i >= TRACE_RING_SIZE){
+			/* Overwritten while it was being copied */
+			continue;
+		}
+		if(span.start_ns < since_ns) continue;
+
+		fprintf(fptr, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				trace_name(span.name), tid,
+				(double)span.start_ns/1000.0, (double)span.duration_ns/1000.0);
+	}
+}
+
+
+/* Write the spans from the last seconds as Chrome trace event JSON, which
+ * can be loaded in chrome://tracing or Perfetto. */
+static void write_trace_file(int seconds)
+{
+	FILE *fptr;
+	uint64_t now, since;
+
+	now = now_ns();
+	since = now > (uint64_t)seconds*1000000000 ? now - (uint64_t)seconds*1000000000 : 0;
+
+	fptr = fopen(trace_file, "wt");
+	if(fptr == NULL) return;
+
+	fprintf(fptr, "{\"traceEvents\":[");
+	fprintf(fptr, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"broker\"}}");
+	fprintf(fptr, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"worker\"}}");
+	trace_write_ring(fptr, &trace_broker, 1, since);
+	trace_write_ring(fptr, &trace_worker, 2, since);
+	fprintf(fptr, "\n]}\n");
+	fclose(fptr);
+}
+
+
+static void stats_add_result(const struct tfdg_game_result *result)
+{
+	int i;
+
+	if(result->player_count > 1 && result->player_count < 100){
+		stats.players[result->player_count]++;
+		if(result->player_count > stats.max_players){
+			stats.max_players = result->player_count;
+		}
+		stats.duration_counts[result->player_count]++;
+		stats.durations[result->player_count] += result->duration;
+	}
+	stats.calza_success += result->calza_success;
+	stats.calza_fail += result->calza_fail;
+	stats.dudo_success += result->dudo_success;
+	stats.dudo_fail += result->dudo_fail;
+
+	if(result->max_dice >= 3 && result->max_dice <= 20){
+		stats.dice_count[result->max_dice]++;
+	}
+	if(result->max_dice_value >= 3 && result->max_dice_value <= 9){
+		stats.dice_values[result->max_dice_value]++;
+	}
+	for(i=0; i<MAX_DICE_VALUE; i++){
+		stats.thrown_dice_values[i] += result->totals[i];
+	}
+}
+
+
+static bool ring_push(struct tfdg_ring *ring, void *item)
+{
+	size_t head, tail;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if(head - tail == WORKER_RING_SIZE){
+		return false;
+	}
+	ring->items[head & (WORKER_RING_SIZE-1)] = item;
+	atomic_store_explicit(&ring->head, head+1, memory_order_release);
+	return true;
+}
+
+
+static void *ring_pop(struct tfdg_ring *ring)
+{
+	size_t head, tail;
+	void *item;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if(head == tail){
+		return NULL;
+	}
+	item = ring->items[tail & (WORKER_RING_SIZE-1)];
+	atomic_store_explicit(&ring->tail, tail+1, memory_order_release);
+	return item;
+}
+
+
+/* Publish directly when running inline (w is NULL), otherwise pass the
+ * payload back to the broker thread. If the result ring is full the payload
+ * is dropped, everything published this way is retained and replaced by the
+ * next result anyway. */
+static void job_publish(struct tfdg_worker *w, const char *topic, char *payload, int payloadlen)
+{
+	struct tfdg_publish *pub;
+
+	if(w == NULL){
+		broker_publish(topic, payloadlen, payload, true);
+		return;
+	}
+
+	pub = malloc(sizeof(struct tfdg_publish));
+	if(pub == NULL){
+		free(payload);
+		return;
+	}
+	pub->topic = topic;
+	pub->payload = payload;
+	pub->payloadlen = payloadlen;
+	if(ring_push(&w->results, pub) == false){
+		free(payload);
+		free(pub);
+	}
+}
+
+
+static void job_run(struct tfdg_worker *w, struct tfdg_job *job)
+{
+	char *payload;
+	int payloadlen;
+	uint64_t start;
+
+	start = trace_begin();
+	switch(job->type){
+		case tj_game_result:
+			stats_add_result(&job->result);
+			if(stats_payload(&payload, &payloadlen) == MOSQ_ERR_SUCCESS){
+				job_publish(w, "tfdg/stats", payload, payloadlen);
 			}
+			break;
 
-			free(json_str);
+		case tj_game_record:
+			cJSON_AddItemToArray(j_stats_games, job->record);
+			job->record = NULL;
+			break;
+
+		case tj_save_state:
+			write_state_file(job->games_json);
+			break;
+
+		case tj_write_prom:
+			write_prom_file(job->prom);
+			break;
+
+		case tj_trace_dump:
+			write_trace_file(job->trace_seconds);
+			break;
+
+		case tj_capture_write:
+			fwrite(job->capture, 1, job->capture_len, capture_fptr);
+			fflush(capture_fptr);
+			break;
+	}
+	trace_span(w ? &trace_worker : &trace_broker, tt_job_game_result + (uint32_t)job->type, start);
+	cJSON_Delete(job->record);
+	free(job->games_json);
+	free(job->prom);
+	free(job->capture);
+	free(job);
+}
+
+
+static void *worker_main(void *arg)
+{
+	struct tfdg_worker *w = arg;
+	struct tfdg_job *job;
+
+	while(1){
+		sem_wait(&w->wake);
+		while((job = ring_pop(&w->jobs)) != NULL){
+			job_run(w, job);
+		}
+		if(atomic_load(&w->stop)){
+			return NULL;
 		}
 	}
 }
 
 
+/* Hand a job to the worker, or run it straight away if there isn't one. This
+ * only waits if the worker is a full ring of jobs behind. */
+static void job_submit(struct tfdg_job *job)
+{
+	if(worker == NULL){
+		job_run(NULL, job);
+		return;
+	}
+
+	while(ring_push(&worker->jobs, job) == false){
+		sched_yield();
+	}
+	sem_post(&worker->wake);
+}
+
+
+/* Publish whatever the worker has finished since the last tick */
+static void worker_collect(void)
+{
+	struct tfdg_publish *pub;
+
+	if(worker == NULL) return;
+
+	while((pub = ring_pop(&worker->results)) != NULL){
+		broker_publish(pub->topic, pub->payloadlen, pub->payload, true);
+		free(pub);
+	}
+}
+
+
+static int worker_start(void)
+{
+	struct tfdg_worker *w;
+
+	w = aligned_alloc(_Alignof(struct tfdg_worker), sizeof(struct tfdg_worker));
+	if(w == NULL) return MOSQ_ERR_NOMEM;
+
+	memset(w, 0, sizeof(struct tfdg_worker));
+	atomic_init(&w->jobs.head, 0);
+	atomic_init(&w->jobs.tail, 0);
+	atomic_init(&w->results.head, 0);
+	atomic_init(&w->results.tail, 0);
+	atomic_init(&w->stop, false);
+	if(sem_init(&w->wake, 0, 0)){
+		free(w);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if(pthread_create(&w->thread, NULL, worker_main, w)){
+		sem_destroy(&w->wake);
+		free(w);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	worker = w;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Let the worker finish every queued job, then publish its last results.
+ * Afterwards everything it owned belongs to the broker thread again. */
+static void worker_stop(void)
+{
+	if(worker == NULL) return;
+
+	atomic_store(&worker->stop, true);
+	sem_post(&worker->wake);
+	pthread_join(worker->thread, NULL);
+	worker_collect();
+	sem_destroy(&worker->wake);
+	free(worker);
+	worker = NULL;
+}
+
+
 /* Returns next game in array */
 static cJSON *json_delete_game(cJSON *j_game)
 {
@@ -935,26 +3542,22 @@ static struct tfdg_player *load_lost_player_state(struct tfdg_room *room_s, cJSO
 	char *uuid;
 	char *name;
 
-	player_s = calloc(1, sizeof(struct tfdg_player));
+	player_s = pool_alloc(&player_pool);
+	if(player_s == NULL) return NULL;
 
 	if(json_get_string(j_player, "uuid", &uuid) != 0
 			|| json_get_string(j_player, "name", &name) != 0){
 
-		free(player_s);
+		pool_free(&player_pool, player_s);
 		return NULL;
 	}
 	if(validate_uuid(uuid) == false){
-		free(player_s);
-		return NULL;
-	}
-	player_s->uuid = strdup(uuid);
-	player_s->name = strdup(name);
-	if(player_s->uuid == NULL || player_s->name == NULL){
-		free(player_s->uuid);
-		free(player_s->name);
-		free(player_s);
+		pool_free(&player_pool, player_s);
 		return NULL;
 	}
+	snprintf(player_s->uuid, sizeof(player_s->uuid), "%s", uuid);
+	snprintf(player_s->name, sizeof(player_s->name), "%s", name);
+	player_s->index = room_s->next_player_index++;
 
 	DL_APPEND(room_s->lost_players, player_s);
 	HASH_ADD_KEYPTR(hh_uuid, room_s->player_by_uuid, player_s->uuid, (unsigned int)strlen(player_s->uuid), player_s);
@@ -970,12 +3573,14 @@ static struct tfdg_player *load_player_state(struct tfdg_room *room_s, cJSON *j_
 	char *uuid;
 	char *name;
 	int i;
+	int state, dice_count, value;
 
-	player_s = calloc(1, sizeof(struct tfdg_player));
+	player_s = pool_alloc(&player_pool);
+	if(player_s == NULL) return NULL;
 	player_s->json = j_player;
 
-	if(json_get_int(j_player, "state", &player_s->state) != 0
-			|| json_get_int(j_player, "dice-count", &player_s->dice_count) != 0
+	if(json_get_int(j_player, "state", &state) != 0
+			|| json_get_int(j_player, "dice-count", &dice_count) != 0
 			|| json_get_string(j_player, "uuid", &uuid) != 0
 			|| json_get_string(j_player, "name", &name) != 0
 			|| json_get_bool(j_player, "ex-palifico", &player_s->ex_palifico) != 0){
@@ -985,45 +3590,47 @@ static struct tfdg_player *load_player_state(struct tfdg_room *room_s, cJSON *j_
 	if(validate_uuid(uuid) == false){
 		goto cleanup;
 	}
-	player_s->uuid = strdup(uuid);
-	player_s->name = strdup(name);
-	if(player_s->uuid == NULL || player_s->name == NULL){
-		goto cleanup;
-	}
+	snprintf(player_s->uuid, sizeof(player_s->uuid), "%s", uuid);
+	snprintf(player_s->name, sizeof(player_s->name), "%s", name);
+	player_s->index = room_s->next_player_index++;
 
 	j_dice = cJSON_GetObjectItemCaseSensitive(j_player, "dice");
 	if(cJSON_IsArray(j_dice) == false){
 		goto cleanup;
 	}
-	if(player_s->dice_count > MAX_DICE
-			|| player_s->dice_count > room_s->options.max_dice){
+	if(dice_count < 0
+			|| dice_count > MAX_DICE
+			|| dice_count > room_s->options.max_dice
+			|| state < tps_none || state > tps_pre_roll_lost){
 
 		goto cleanup;
 	}
+	/* compact isn't saved, it is set again when the client logs back in */
+	player_s->state = (int8_t)state;
+	player_s->dice_count = (uint8_t)dice_count;
 	i = 0;
 	cJSON_ArrayForEach(j_die, j_dice){
-		if(cJSON_IsNumber(j_die) == false){
+		if(cJSON_IsNumber(j_die) == false || i >= MAX_DICE){
 			goto cleanup;
 		}
-		player_s->dice_values[i] = (int)j_die->valuedouble;
-		if(player_s->dice_values[i] > MAX_DICE_VALUE
-				|| player_s->dice_values[i] < 0
-				|| player_s->dice_values[i] > room_s->options.max_dice_value){
+		value = (int)j_die->valuedouble;
+		if(value > MAX_DICE_VALUE
+				|| value < 0
+				|| value > room_s->options.max_dice_value){
 
 			goto cleanup;
 		}
+		player_set_die(player_s, i, value);
 		i++;
 	}
-	room_append_player(room_s, player_s, onload);
+	if(room_append_player(room_s, player_s, onload) != MOSQ_ERR_SUCCESS){
+		goto cleanup;
+	}
 	HASH_ADD_KEYPTR(hh_uuid, room_s->player_by_uuid, player_s->uuid, (unsigned int)strlen(player_s->uuid), player_s);
 
 	return player_s;
 cleanup:
-	if(player_s){
-		free(player_s->uuid);
-		free(player_s->name);
-		free(player_s);
-	}
+	pool_free(&player_pool, player_s);
 	return NULL;
 }
 
@@ -1032,8 +3639,9 @@ static void load_game_state(void)
 {
 	struct tfdg_room *room_s;
 	struct tfdg_player *player_s;
-	cJSON *jtmp, *j_game, *j_players, *j_player, *j_options;
+	cJSON *jtmp, *j_game, *j_players, *j_player, *j_options, *j_draws, *j_nonce;
 	time_t now;
+	uint64_t nonce;
 	char *uuid;
 	char *host;
 	char *starter;
@@ -1059,7 +3667,7 @@ static void load_game_state(void)
 			continue;
 		}
 
-		room_s = calloc(1, sizeof(struct tfdg_room));
+		room_s = pool_alloc(&room_pool);
 		if(room_s == NULL) return;
 		room_s->json = j_game;
 		room_s->forwards = true;
@@ -1083,7 +3691,7 @@ static void load_game_state(void)
 				|| json_get_bool(j_game, "palifico-round", &room_s->palifico_round) != 0){
 
 			/* Invalid */
-			free(room_s);
+			pool_free(&room_pool, room_s);
 			j_game = json_delete_game(j_game);
 			continue;
 		}
@@ -1094,6 +3702,8 @@ static void load_game_state(void)
 		}
 		strncpy(room_s->uuid, uuid, sizeof(room_s->uuid));
 		HASH_ADD_KEYPTR(hh, room_by_uuid, room_s->uuid, (unsigned int)strlen(room_s->uuid), room_s);
+		room_s->idle_expiry_time = room_s->last_event + room_state_expiry_time(room_s->state);
+		room_update_expiry(room_s);
 
 		j_options = cJSON_GetObjectItemCaseSensitive(j_game, "options");
 		if(j_options == NULL){
@@ -1128,6 +3738,20 @@ static void load_game_state(void)
 			room_s->options.max_dice_value = MAX_DICE_VALUE;
 		}
 
+		jtmp = cJSON_GetObjectItemCaseSensitive(j_game, "rng-seed");
+		if(cJSON_IsString(jtmp)){
+			j_draws = cJSON_GetObjectItemCaseSensitive(j_game, "rng-draws");
+			j_nonce = cJSON_GetObjectItemCaseSensitive(j_game, "rng-nonce");
+			nonce = cJSON_IsString(j_nonce) ? strtoull(j_nonce->valuestring, NULL, 10) : 0;
+			if(cJSON_IsNumber(j_draws) == false || j_draws->valuedouble < 0
+					|| room_init_deterministic_rng(room_s, jtmp->valuestring, nonce, (uint64_t)j_draws->valuedouble) != MOSQ_ERR_SUCCESS){
+
+				j_game = j_game->next;
+				cleanup_room(room_s, "config-load 3");
+				continue;
+			}
+		}
+
 		j_players = cJSON_GetObjectItemCaseSensitive(j_game, "players");
 		if(cJSON_IsArray(j_players) == false){
 			j_game = j_game->next;
@@ -1193,7 +3817,7 @@ static void load_full_state(void)
 	char *json_str;
 	cJSON *statistics = NULL;
 
-	fptr = fopen("tfdg-state.json", "rt");
+	fptr = fopen(state_file, "rt");
 	if(fptr){
 		fseek(fptr, 0, SEEK_END);
 		len = (size_t)ftell(fptr);
@@ -1232,49 +3856,241 @@ static void load_full_state(void)
 		j_stats_games = cJSON_CreateArray();
 		cJSON_AddItemToObject(statistics, "games", j_stats_games);
 	}
+	if(j_all_games == NULL){
+		j_all_games = cJSON_CreateArray();
+		cJSON_AddItemToObject(j_full_state, "games", j_all_games);
+	}
+	j_statistics = cJSON_DetachItemViaPointer(j_full_state, statistics);
 }
 
 
 int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
 {
 	int i;
+	int rc;
+	struct sigaction sa;
+	struct timespec ts;
 
 	mosq_pid = identifier;
 
 	j_full_state = NULL;
+	j_statistics = NULL;
 	j_stats_games = NULL;
 	j_all_games = NULL;
 
 	room_by_uuid = NULL;
 	room_expiry_time = 7200;
+	lobby_expiry_time = 1800;
+	game_over_expiry_time = 60;
+	resetting_expiry_time = 10;
+	reconnect_grace_time = 60;
+	client_player_count = 0;
+	cleanup_queue = NULL;
+	cleanup_queue_tail = NULL;
+	cleanup_budget_us = 2000;
+	state_dirty = false;
 	state_file = NULL;
+	rng_seed = NULL;
+	background_worker = true;
+	log_level = tll_info;
+	log_file = NULL;
+	metrics_interval = 10;
+	metrics_start = time(NULL);
+	memset(&metrics, 0, sizeof(metrics));
+	memset(&metrics_total, 0, sizeof(metrics_total));
+	prom_file = NULL;
+	trace_enabled = false;
+	trace_dump_seconds = 10;
+	trace_file = NULL;
+	trace_dump_requested = 0;
+	capture_file = NULL;
+	capture_fptr = NULL;
+	max_rooms = 0;
+	max_client_rooms = 0;
+	max_room_players = 0;
+	max_room_spectators = 0;
+	max_memory = 0;
+	memory_total = 0;
+	rate_limit = true;
+	memcpy(client_rates, default_client_rates, sizeof(client_rates));
+	memcpy(room_rates, default_room_rates, sizeof(room_rates));
+	sound_window_ms = 250;
+	atomic_init(&trace_broker.head, 0);
+	atomic_init(&trace_worker.head, 0);
+	atomic_init(&snapshot_write_us, 0);
+	memset(expiry_wheel, 0, sizeof(expiry_wheel));
+	expiry_wheel_time = time(NULL);
 
 	memset(&stats, 0, sizeof(stats));
 
 	for(i=0; i<auth_opt_count; i++){
 		if(!strcmp(auth_opts[i].key, "room-expiry-time")){
 			room_expiry_time = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "lobby-expiry-time")){
+			lobby_expiry_time = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "game-over-expiry-time")){
+			game_over_expiry_time = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "resetting-expiry-time")){
+			resetting_expiry_time = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "reconnect-grace-time")){
+			reconnect_grace_time = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "cleanup-budget-us")){
+			cleanup_budget_us = atol(auth_opts[i].value);
 		}else if(!strcmp(auth_opts[i].key, "state-file")){
 			state_file = strdup(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "rng-seed")){
+			free(rng_seed);
+			rng_seed = strdup(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "background-worker")){
+			background_worker = !strcmp(auth_opts[i].value, "true");
+		}else if(!strcmp(auth_opts[i].key, "log-level")){
+			if(log_level_parse(auth_opts[i].value) >= 0){
+				log_level = log_level_parse(auth_opts[i].value);
+			}
+		}else if(!strcmp(auth_opts[i].key, "trace")){
+			trace_enabled = !strcmp(auth_opts[i].value, "true");
+		}else if(!strcmp(auth_opts[i].key, "trace-file")){
+			free(trace_file);
+			trace_file = strdup(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "trace-dump-seconds")){
+			trace_dump_seconds = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "prom-file")){
+			free(prom_file);
+			prom_file = strdup(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "metrics-interval")){
+			metrics_interval = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "log-file")){
+			free(log_file);
+			log_file = strdup(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "capture-file")){
+			free(capture_file);
+			capture_file = strdup(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "max-rooms")){
+			max_rooms = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "max-rooms-per-client")){
+			max_client_rooms = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "max-players-per-room")){
+			max_room_players = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "max-spectators-per-room")){
+			max_room_spectators = atoi(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "max-memory")){
+			max_memory = (size_t)atoll(auth_opts[i].value);
+		}else if(!strcmp(auth_opts[i].key, "rate-limit")){
+			rate_limit = !strcmp(auth_opts[i].value, "true");
+		}else if(!strcmp(auth_opts[i].key, "sound-window-ms")){
+			sound_window_ms = atoi(auth_opts[i].value);
+		}else if(rate_option(client_rates, "client-rate-", auth_opts[i].key, auth_opts[i].value)
+				|| rate_option(room_rates, "room-rate-", auth_opts[i].key, auth_opts[i].value)){
+			/* parsed by rate_option() */
 		}
 	}
+	log_start();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rng_nonce_last = (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+
+	if(rng_init(&dice_rng) == false){
+		tfdg_log(tll_error, NULL, "rng-seed-failed", NULL, NULL);
+		log_finish();
+		return MOSQ_ERR_UNKNOWN;
+	}
+
 	if(state_file == NULL){
 		state_file = strdup("tfdg-state.json");
 	}
+	if(trace_file == NULL){
+		trace_file = strdup("tfdg-trace.json");
+	}
+	if(trace_enabled){
+		/* The dump is written from the tick, the handler only sets a flag */
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = trace_handle_sigusr2;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = SA_RESTART | SA_SIGINFO;
+		sigaction(SIGUSR2, &sa, &trace_old_sigusr2);
+	}
 	load_full_state();
+	memory_recount();
+	if(capture_file){
+		capture_start();
+	}
 
 	publish_stats();
 
-	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_ACL_CHECK, callback_acl_check, NULL, NULL);
+	if(background_worker){
+		rc = worker_start();
+		if(rc){
+			tfdg_log(tll_error, NULL, "worker-failed", NULL, NULL);
+			goto unwind;
+		}
+	}
+
+	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_ACL_CHECK, callback_acl_check, NULL, NULL);
+	if(rc) goto unwind;
+
+	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_DISCONNECT, callback_disconnect, NULL, NULL);
+	if(rc) goto unwind;
+
+	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_RELOAD, callback_reload, NULL, NULL);
+	if(rc) goto unwind;
+
+	rc = mosquitto_callback_register(mosq_pid, MOSQ_EVT_TICK, callback_tick, NULL, NULL);
+	if(rc) goto unwind;
+
+	return MOSQ_ERR_SUCCESS;
+
+unwind:
+	/* The broker unloads the plugin after a failed init without calling
+	 * mosquitto_plugin_cleanup(), so nothing may be left running or pointing
+	 * into it. Undone in reverse order, unregistering a callback that wasn't
+	 * registered is harmless. */
+	tfdg_log(tll_error, NULL, "init-failed", NULL, "rc=%d", rc);
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, callback_tick, NULL);
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_RELOAD, callback_reload, NULL);
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_DISCONNECT, callback_disconnect, NULL);
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_ACL_CHECK, callback_acl_check, NULL);
+	worker_stop();
+	capture_stop();
+	if(trace_enabled){
+		sigaction(SIGUSR2, &trace_old_sigusr2, NULL);
+	}
+	log_finish();
+	return rc;
 }
 
 int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
 {
+	cleanup_queue_drain(-1);
 	save_full_state();
+	worker_stop();
 	//cleanup_all();
 	cJSON_Delete(j_full_state);
 	j_full_state = NULL;
+	cJSON_Delete(j_statistics);
+	j_statistics = NULL;
 	free(state_file);
+	free(rng_seed);
+	rng_seed = NULL;
+	pool_cleanup(&room_pool);
+	pool_cleanup(&player_pool);
+	pool_cleanup(&client_id_pool);
+	rate_cooling = NULL;
+	log_finish();
+	free(log_file);
+	log_file = NULL;
+	free(prom_file);
+	prom_file = NULL;
+	if(trace_enabled){
+		sigaction(SIGUSR2, &trace_old_sigusr2, NULL);
+	}
+	free(trace_file);
+	trace_file = NULL;
+	capture_stop();
+	free(capture_file);
+	capture_file = NULL;
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, callback_tick, NULL);
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_RELOAD, callback_reload, NULL);
+	mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_DISCONNECT, callback_disconnect, NULL);
 	return mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_ACL_CHECK, callback_acl_check, NULL);
 }
 
@@ -1366,7 +4182,8 @@ void load_stats(void)
 }
 
 
-void publish_stats(void)
+/* Build the tfdg/stats payload from the aggregate stats */
+static int stats_payload(char **payload, int *payloadlen)
 {
 	cJSON *tree, *jtmp, *j_array;
 	char *json_str;
@@ -1375,7 +4192,7 @@ void publish_stats(void)
 	double success, fail, total, count;
 
 	tree = cJSON_CreateObject();
-	if(tree == NULL) return;
+	if(tree == NULL) return MOSQ_ERR_NOMEM;
 
 	/* Calza */
 	total = stats.calza_success + stats.calza_fail;
@@ -1385,14 +4202,14 @@ void publish_stats(void)
 	jtmp = cJSON_CreateNumber(success);
 	if(jtmp == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "calza-success", jtmp);
 
 	jtmp = cJSON_CreateNumber(fail);
 	if(jtmp == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "calza-fail", jtmp);
 
@@ -1404,14 +4221,14 @@ void publish_stats(void)
 	jtmp = cJSON_CreateNumber(success);
 	if(jtmp == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "dudo-success", jtmp);
 
 	jtmp = cJSON_CreateNumber(fail);
 	if(jtmp == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "dudo-fail", jtmp);
 
@@ -1419,7 +4236,7 @@ void publish_stats(void)
 	j_array = cJSON_CreateArray();
 	if(j_array == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "players", j_array);
 
@@ -1433,7 +4250,7 @@ void publish_stats(void)
 		jtmp = cJSON_CreateNumber(count);
 		if(jtmp == NULL){
 			cJSON_Delete(tree);
-			return;
+			return MOSQ_ERR_NOMEM;
 		}
 		cJSON_AddItemToArray(j_array, jtmp);
 	}
@@ -1442,7 +4259,7 @@ void publish_stats(void)
 	j_array = cJSON_CreateArray();
 	if(j_array == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "durations", j_array);
 	for(i=0; i<=stats.max_duration; i++){
@@ -1453,7 +4270,7 @@ void publish_stats(void)
 		}
 		if(jtmp == NULL){
 			cJSON_Delete(tree);
-			return;
+			return MOSQ_ERR_NOMEM;
 		}
 		cJSON_AddItemToArray(j_array, jtmp);
 	}
@@ -1462,7 +4279,7 @@ void publish_stats(void)
 	j_array = cJSON_CreateArray();
 	if(j_array == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "dice-count", j_array);
 
@@ -1475,7 +4292,7 @@ void publish_stats(void)
 		jtmp = cJSON_CreateNumber(count);
 		if(jtmp == NULL){
 			cJSON_Delete(tree);
-			return;
+			return MOSQ_ERR_NOMEM;
 		}
 		cJSON_AddItemToArray(j_array, jtmp);
 	}
@@ -1484,7 +4301,7 @@ void publish_stats(void)
 	j_array = cJSON_CreateArray();
 	if(j_array == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "dice-values", j_array);
 
@@ -1497,7 +4314,7 @@ void publish_stats(void)
 		jtmp = cJSON_CreateNumber(count);
 		if(jtmp == NULL){
 			cJSON_Delete(tree);
-			return;
+			return MOSQ_ERR_NOMEM;
 		}
 		cJSON_AddItemToArray(j_array, jtmp);
 	}
@@ -1506,7 +4323,7 @@ void publish_stats(void)
 	j_array = cJSON_CreateArray();
 	if(j_array == NULL){
 		cJSON_Delete(tree);
-		return;
+		return MOSQ_ERR_NOMEM;
 	}
 	cJSON_AddItemToObject(tree, "thrown-dice-values", j_array);
 
@@ -1519,7 +4336,7 @@ void publish_stats(void)
 		jtmp = cJSON_CreateNumber(count);
 		if(jtmp == NULL){
 			cJSON_Delete(tree);
-			return;
+			return MOSQ_ERR_NOMEM;
 		}
 		cJSON_AddItemToArray(j_array, jtmp);
 	}
@@ -1527,13 +4344,30 @@ void publish_stats(void)
 	tree->precision = 1;
 	json_str = cJSON_PrintUnformatted(tree);
 	cJSON_Delete(tree);
-	if(json_str == NULL) return;
+	if(json_str == NULL) return MOSQ_ERR_NOMEM;
 	json_str_len = strlen(json_str);
 	if(json_str_len > MQTT_MAX_PAYLOAD){
-		return;
+		free(json_str);
+		return MOSQ_ERR_PAYLOAD_SIZE;
 	}
 
-	mosquitto_broker_publish(NULL, "tfdg/stats", (int)json_str_len, json_str, 1, 1, NULL);
+	*payload = json_str;
+	*payloadlen = (int)json_str_len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void publish_stats(void)
+{
+	char *payload;
+	int payloadlen;
+	uint64_t start;
+
+	start = trace_begin();
+	if(stats_payload(&payload, &payloadlen) == MOSQ_ERR_SUCCESS){
+		broker_publish("tfdg/stats", payloadlen, payload, true);
+	}
+	trace_span(&trace_broker, tt_publish_stats, start);
 }
 
 
@@ -1602,19 +4436,25 @@ static cJSON *room_create_json(const char *uuid)
 	jtmp = cJSON_CreateBool(false);
 	cJSON_AddItemToObject(j_options, "swap-direction", jtmp);
 
+	jtmp = cJSON_CreateBool(false);
+	cJSON_AddItemToObject(j_options, "random-position", jtmp);
+
 	return j_room;
 }
 
 
-void room_append_player(struct tfdg_room *room_s, struct tfdg_player *player_s, bool onload)
+int room_append_player(struct tfdg_room *room_s, struct tfdg_player *player_s, bool onload)
 {
 	cJSON *j_players;
 
-	CDL_APPEND(room_s->players, player_s);
+	if(room_add_seat(room_s, player_s) != MOSQ_ERR_SUCCESS){
+		return MOSQ_ERR_NOMEM;
+	}
 	if(onload == false){
 		j_players = cJSON_GetObjectItemCaseSensitive(room_s->json, "players");
 		cJSON_AddItemToArray(j_players, player_s->json);
 	}
+	return MOSQ_ERR_SUCCESS;
 }
 
 void room_append_lost_player(struct tfdg_room *room_s, struct tfdg_player *player_s)
@@ -1626,14 +4466,14 @@ void room_delete_player(struct tfdg_room *room_s, struct tfdg_player *player_s)
 {
 	cJSON *j_players;
 
-	CDL_DELETE(room_s->players, player_s);
+	room_remove_seat(room_s, player_s);
 	j_players = cJSON_GetObjectItemCaseSensitive(room_s->json, "players");
 	cJSON_DetachItemViaPointer(j_players, player_s->json);
 	cJSON_Delete(player_s->json);
 	player_s->json = NULL;
 
 	if(player_s == room_s->host){
-		room_set_host(room_s, room_s->players);
+		room_set_host(room_s, room_first_player(room_s));
 		tfdg_send_host(room_s);
 	}
 
@@ -1722,6 +4562,10 @@ void room_set_last_event(struct tfdg_room *room_s, time_t last_event)
 	jtmp = cJSON_GetObjectItemCaseSensitive(room_s->json, "last-event");
 	cJSON_SetNumberValue(jtmp, (double)last_event);
 	room_s->last_event = last_event;
+	if(room_is_finished(room_s) == false){
+		room_s->idle_expiry_time = last_event + room_state_expiry_time(room_s->state);
+		room_update_expiry(room_s);
+	}
 }
 
 
@@ -1765,6 +4609,8 @@ void room_set_state(struct tfdg_room *room_s, enum tfdg_game_state state)
 	jtmp = cJSON_GetObjectItemCaseSensitive(room_s->json, "state");
 	cJSON_SetNumberValue(jtmp, state);
 	room_s->state = state;
+	room_s->idle_expiry_time = room_s->last_event + room_state_expiry_time(state);
+	room_update_expiry(room_s);
 }
 
 
@@ -1781,9 +4627,7 @@ void room_set_host(struct tfdg_room *room_s, struct tfdg_player *host)
 	room_s->host = host;
 
 	if(host){
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "new-host", host->uuid, host->name);
+		tfdg_log(tll_info, room_s->uuid, "new-host", host, NULL);
 	}
 }
 
@@ -1868,28 +4712,52 @@ void room_set_starter(struct tfdg_room *room_s, struct tfdg_player *starter)
 }
 
 
-void room_shuffle_players(struct tfdg_room *room_s)
+/* Fisher-Yates shuffle of the seats. Returns true if anyone moved. */
+bool room_shuffle_players(struct tfdg_room *room_s)
 {
-	int count, cur_count;
-	struct tfdg_player *list, *p;
-	unsigned char bytes[1000];
+	int count;
+	struct tfdg_player *p;
+	struct tfdg_rng *rng;
+	cJSON *j_players;
 	int i, j;
-
-	CDL_COUNT(room_s->players, p, count);
-
-	list = NULL;
-	if(RAND_bytes(bytes, count) == 1){
-		cur_count = count;
+	bool changed = false;
+
+	count = room_s->seat_count;
+	rng = room_rng(room_s);
+	for(i=count-1; i>0; i--){
+		j = (int)rng_uniform(rng, (uint32_t)(i+1));
+		p = room_s->seats[i];
+		room_s->seats[i] = room_s->seats[j];
+		room_s->seats[j] = p;
+	}
+	for(i=0; i<count; i++){
+		if(room_s->seats[i]->seat != i){
+			room_s->seats[i]->seat = i;
+			changed = true;
+		}
+	}
+	if(changed){
+		/* Keep the saved order in step, so a reload seats players the same way */
+		j_players = cJSON_GetObjectItemCaseSensitive(room_s->json, "players");
 		for(i=0; i<count; i++){
-			p = room_s->players;
-			for(j=0; j<bytes[i]%cur_count; j++){
-				p = p->next;
-			}
-			CDL_DELETE(room_s->players, p);
-			CDL_APPEND(list, p);
-			cur_count--;
+			cJSON_DetachItemViaPointer(j_players, room_s->seats[i]->json);
+		}
+		for(i=0; i<count; i++){
+			cJSON_AddItemToArray(j_players, room_s->seats[i]->json);
 		}
-		room_s->players = list;
+	}
+	return changed;
+}
+
+
+/* Count the room against the client that created it, for max-rooms-per-client */
+static void room_set_creator(struct tfdg_room *room_s, const char *client_id)
+{
+	if(client_id == NULL) return;
+
+	room_s->creator = client_id_intern(client_id);
+	if(room_s->creator){
+		room_s->creator->rooms_created++;
 	}
 }
 
@@ -1897,12 +4765,13 @@ void room_shuffle_players(struct tfdg_room *room_s)
 static struct tfdg_room *room_create(const char *room)
 {
 	struct tfdg_room *room_s;
+	uint64_t nonce;
 
-	room_s = calloc(1, sizeof(struct tfdg_room));
+	room_s = pool_alloc(&room_pool);
 	if(room_s == NULL) return NULL;
 	room_s->json = room_create_json(room);
 	if(room_s->json == NULL){
-		free(room_s);
+		pool_free(&room_pool, room_s);
 		return NULL;
 	}
 
@@ -1921,6 +4790,14 @@ static struct tfdg_room *room_create(const char *room)
 	room_set_state(room_s, tgs_lobby);
 	strncpy(room_s->uuid, room, sizeof(room_s->uuid));
 	HASH_ADD_KEYPTR(hh, room_by_uuid, room_s->uuid, (unsigned int)strlen(room_s->uuid), room_s);
+	if(rng_seed){
+		nonce = rng_nonce_new();
+		if(room_init_deterministic_rng(room_s, rng_seed, nonce, 0) != MOSQ_ERR_SUCCESS){
+			tfdg_log(tll_error, room_s->uuid, "rng-seed-failed", NULL, "the room's dice are not reproducible");
+		}else if(capture_fptr){
+			capture_record(tct_rng_nonce, NULL, room_s->uuid, &nonce, sizeof(nonce));
+		}
+	}
 	return room_s;
 }
 
@@ -1952,34 +4829,30 @@ static cJSON *player_create_json(void)
 }
 
 
-static void player_set_dice_values(struct tfdg_room *room_s, struct tfdg_player *player_s, unsigned char *bytes, int max_dice_value)
+/* values holds a zero based face for each die, masks a draw in [0, 100) for
+ * each die or NULL if masking is off. The new dice are added to
+ * room_s->faces, the caller is expected to have cleared it for the round. */
+static void player_set_dice_values(struct tfdg_room *room_s, struct tfdg_player *player_s, const uint8_t *values, const uint8_t *masks)
 {
 	int i;
-	int r;
+	int value;
 	cJSON *j_array;
 	cJSON *jtmp;
-	int mask_chance;
 
 	j_array = cJSON_CreateArray();
-	mask_chance = (room_s->options.random_mask_percentage * 255) / 100;
 
-	r = 0;
+	player_s->dice_mask = 0;
 	for(i=0; i<player_s->dice_count; i++){
-		player_s->dice_values[i] = (bytes[r]%max_dice_value)+1;
-		r++;
-		jtmp = cJSON_CreateNumber(player_s->dice_values[i]);
+		value = values[i]+1;
+		player_set_die(player_s, i, value);
+		jtmp = cJSON_CreateNumber(value);
 		cJSON_AddItemToArray(j_array, jtmp);
-		room_s->totals[player_s->dice_values[i]-1]++;
 
-		if(mask_chance > 0){
-			if(bytes[r] <= mask_chance){
-				player_s->dice_mask[i] = 1;
-			}else{
-				player_s->dice_mask[i] = 0;
-			}
-			r++;
+		if(masks && masks[i] < room_s->options.random_mask_percentage){
+			player_s->dice_mask |= 1U << i;
 		}
 	}
+	dice_histogram(player_s->dice, player_s->dice_count, room_s->faces);
 	cJSON_ReplaceItemInObject(player_s->json, "dice", j_array);
 }
 
@@ -1990,7 +4863,7 @@ static void player_set_state(struct tfdg_player *player_s, enum tfdg_player_stat
 
 	jtmp = cJSON_GetObjectItemCaseSensitive(player_s->json, "state");
 	cJSON_SetNumberValue(jtmp, state);
-	player_s->state = state;
+	player_s->state = (int8_t)state;
 }
 
 
@@ -2004,33 +4877,53 @@ static void player_set_ex_palifico(struct tfdg_player *player_s)
 }
 
 
-static void player_set_name(struct tfdg_player *player_s, char *name)
+static void player_set_name(struct tfdg_player *player_s, const char *name)
 {
 	cJSON *jtmp;
 
+	snprintf(player_s->name, sizeof(player_s->name), "%s", name);
 	jtmp = cJSON_GetObjectItemCaseSensitive(player_s->json, "name");
-	cJSON_SetValuestring(jtmp, name);
-	player_s->name = name;
+	cJSON_SetValuestring(jtmp, player_s->name);
 }
 
 
-static void player_set_dice_count(struct tfdg_player *player_s, int dice_count)
+static void player_set_dice_count(struct tfdg_room *room_s, struct tfdg_player *player_s, int dice_count)
 {
 	cJSON *jtmp;
 
+	if(room_player_seated(room_s, player_s)){
+		if(dice_count > player_s->dice_count){
+			room_count_dice(room_s, player_s, player_s->dice_count, dice_count, 1);
+		}else{
+			room_count_dice(room_s, player_s, dice_count, player_s->dice_count, -1);
+		}
+	}
 	jtmp = cJSON_GetObjectItemCaseSensitive(player_s->json, "dice-count");
 	cJSON_SetNumberValue(jtmp, dice_count);
-	player_s->dice_count = dice_count;
+	player_s->dice_count = (uint8_t)dice_count;
+}
+
+
+static void player_set_compact(struct tfdg_room *room_s, struct tfdg_player *player_s, bool compact)
+{
+	if(player_s->compact == compact) return;
+
+	player_s->compact = compact;
+	if(compact){
+		room_s->compact_count++;
+	}else{
+		room_s->compact_count--;
+	}
 }
 
 
-static void player_set_uuid(struct tfdg_player *player_s, char *uuid)
+static void player_set_uuid(struct tfdg_player *player_s, const char *uuid)
 {
 	cJSON *jtmp;
 
+	snprintf(player_s->uuid, sizeof(player_s->uuid), "%s", uuid);
 	jtmp = cJSON_GetObjectItemCaseSensitive(player_s->json, "uuid");
-	cJSON_SetValuestring(jtmp, uuid);
-	player_s->uuid = uuid;
+	cJSON_SetValuestring(jtmp, player_s->uuid);
 }
 
 
@@ -2040,6 +4933,8 @@ static void tfdg_handle_new_name(struct mosquitto_evt_acl_check *ed, struct tfdg
 	char *name = NULL;
 	struct tfdg_player *player_s = NULL;
 
+	if(room_s == NULL) return;
+
 	if(json_parse_name_uuid(ed->payload, ed->payloadlen, &name, &uuid)){
 		return;
 	}
@@ -2049,125 +4944,161 @@ static void tfdg_handle_new_name(struct mosquitto_evt_acl_check *ed, struct tfdg
 
 	find_player_from_json(ed->payload, ed->payloadlen, room_s, &player_s);
 	if(player_s){
-		free(player_s->name);
 		player_set_name(player_s, name);
 
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "new-name", player_s->uuid, player_s->name);
+		tfdg_log(tll_info, room_s->uuid, "new-name", player_s, NULL);
 		easy_publish_player(room_s, "new-name", room_s->host);
 	}
+	free(name);
+}
+
+static void tfdg_send_login_rejected(struct mosquitto_evt_acl_check *ed, const char *room, const char *uuid, enum tfdg_reject reason)
+{
+	cJSON *tree, *jtmp;
+	char *json_str;
+	char topic[200];
+	const char *client_id;
+
+	tfdg_log(tll_notice, room, "login-rejected", NULL, "uuid=\"%s\" reason=\"%s\"", uuid, reject_names[reason]);
+	metrics.login_rejected[reason]++;
+
+	client_id = mosquitto_client_id(ed->client);
+	if(client_id == NULL) return;
+
+	tree = cJSON_CreateObject();
+	if(tree == NULL) return;
+	jtmp = cJSON_CreateString(reject_names[reason]);
+	cJSON_AddItemToObject(tree, "reason", jtmp);
+	json_str = cJSON_PrintUnformatted(tree);
+	cJSON_Delete(tree);
+	if(json_str == NULL) return;
+
+	/* Only the client that tried to log in hears about it */
+	snprintf(topic, sizeof(topic), "tfdg/%s/login-rejected/%s", room, uuid);
+	client_publish(client_id, topic, (int)strlen(json_str), json_str);
 }
 
+
 static void tfdg_handle_login(struct mosquitto_evt_acl_check *ed, const char *room, struct tfdg_room *room_s)
 {
 	char *uuid = NULL;
 	char *name = NULL;
-	struct tfdg_player *player_s = NULL, *p;
-	const char *client_id;
+	struct tfdg_player *player_s = NULL;
+	bool compact;
+	int reject;
 
 	if(json_parse_name_uuid(ed->payload, ed->payloadlen, &name, &uuid)){
 		return;
 	}
+	compact = json_parse_compact(ed->payload, ed->payloadlen);
+
+	if(room_s && room_is_finished(room_s)){
+		/* Clients start a new game in the same room once the old one is over,
+		 * don't make them wait for the finished room to be reclaimed. */
+		room_queue_cleanup(room_s, room_cleanup_reason(room_s));
+		room_s = NULL;
+	}
 
 	if(room_s == NULL){
-		printf(ANSI_YELLOW GAME_NAME ANSI_RED "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET "\n",
-				room, MAX_LOG_LEN, "new-room");
+		reject = admission_check(NULL, mosquitto_client_id(ed->client));
+		if(reject >= 0){
+			tfdg_send_login_rejected(ed, room, uuid, (enum tfdg_reject)reject);
+			free(name);
+			free(uuid);
+			return;
+		}
+		tfdg_log(tll_notice, room, "new-room", NULL, NULL);
 
 		room_s = room_create(room);
-		if(room_s == NULL) return;
+		if(room_s == NULL){
+			free(name);
+			free(uuid);
+			return;
+		}
+		room_set_creator(room_s, mosquitto_client_id(ed->client));
 	}
 
 	room_set_last_event(room_s, time(NULL));
 
 	find_player_from_json(ed->payload, ed->payloadlen, room_s, &player_s);
+	if(player_s == NULL){
+		reject = admission_check(room_s, mosquitto_client_id(ed->client));
+		if(reject >= 0){
+			tfdg_send_login_rejected(ed, room, uuid, (enum tfdg_reject)reject);
+			free(name);
+			free(uuid);
+			return;
+		}
+	}
 
 	if(room_s->state == tgs_lobby){
 		if(player_s == NULL){
-			player_s = calloc(1, sizeof(struct tfdg_player));
+			player_s = pool_alloc(&player_pool);
 			if(player_s == NULL){
 				free(name);
 				free(uuid);
 				return;
 			}
 			player_s->json = player_create_json();
+			player_s->index = room_s->next_player_index++;
 			player_set_uuid(player_s, uuid);
-			uuid = NULL;
 			player_set_name(player_s, name);
-			name = NULL;
-			player_s->client_id = strdup(mosquitto_client_id(ed->client));
-			player_set_dice_count(player_s, room_s->options.max_dice);
-			room_append_player(room_s, player_s, false);
+			player_set_dice_count(room_s, player_s, room_s->options.max_dice);
+			if(room_append_player(room_s, player_s, false) != MOSQ_ERR_SUCCESS){
+				cleanup_detached_player(player_s);
+				free(name);
+				free(uuid);
+				return;
+			}
 			room_set_player_count(room_s, room_s->player_count+1);
 			HASH_ADD_KEYPTR(hh_uuid, room_s->player_by_uuid, player_s->uuid, (unsigned int)strlen(player_s->uuid), player_s);
-			HASH_ADD_KEYPTR(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), player_s);
+			room_set_client(room_s, player_s, mosquitto_client_id(ed->client));
 		}else{
-			HASH_FIND(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), p);
-			if(p){
-				HASH_DELETE(hh_client_id, room_s->player_by_client_id, player_s);
-			}
-			free(player_s->client_id);
-			player_s->client_id = strdup(mosquitto_client_id(ed->client));
-			HASH_ADD_KEYPTR(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), player_s);
+			room_set_client(room_s, player_s, mosquitto_client_id(ed->client));
 		}
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "login", player_s->uuid, player_s->name);
+		tfdg_log(tll_notice, room_s->uuid, "login", player_s, NULL);
 
 		tfdg_send_lobby_players(room_s);
 	}else{
 		if(player_s != NULL){
-			printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-					ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-					room_s->uuid, MAX_LOG_LEN, "re-login", player_s->uuid, player_s->name);
-
-			client_id = mosquitto_client_id(ed->client);
-			HASH_FIND(hh_client_id, room_s->player_by_client_id, client_id, (unsigned int)strlen(client_id), p);
-			if(p){
-				HASH_DELETE(hh_client_id, room_s->player_by_client_id, p);
-			}
+			tfdg_log(tll_notice, room_s->uuid, "re-login", player_s, NULL);
 
-			free(player_s->client_id);
-			player_s->client_id = strdup(client_id);
-
-			HASH_ADD_KEYPTR(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), player_s);
+			room_set_client(room_s, player_s, mosquitto_client_id(ed->client));
 			tfdg_send_current_state(room_s, player_s);
 		}else{
 			/* Spectator */
-			player_s = calloc(1, sizeof(struct tfdg_player));
+			player_s = pool_alloc(&player_pool);
 			if(player_s == NULL){
 				free(name);
 				free(uuid);
 				return;
 			}
 			player_s->json = player_create_json();
+			player_s->index = room_s->next_player_index++;
 
 			player_set_uuid(player_s, uuid);
-			uuid = NULL;
 			player_set_name(player_s, name);
-			name = NULL;
-			player_s->client_id = strdup(mosquitto_client_id(ed->client));
-			player_set_dice_count(player_s, 0);
+			player_set_dice_count(room_s, player_s, 0);
 			player_set_state(player_s, tps_spectator);
 
-			HASH_FIND(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), p);
-			if(p){
-				HASH_DELETE(hh_client_id, room_s->player_by_client_id, p);
-			}
-
-			HASH_ADD_KEYPTR(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), player_s);
+			room_set_client(room_s, player_s, mosquitto_client_id(ed->client));
 			tfdg_send_current_state(room_s, player_s);
 
-			printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-					ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-					room_s->uuid, MAX_LOG_LEN, "spectator", player_s->uuid, player_s->name);
+			tfdg_log(tll_info, room_s->uuid, "spectator", player_s, NULL);
 		}
 	}
+	player_set_compact(room_s, player_s, compact);
+	if(player_s->away){
+		tfdg_log(tll_info, room_s->uuid, "back", player_s, NULL);
+		player_s->away = false;
+		player_s->away_time = 0;
+	}
 	if(room_s->host == NULL){
 		room_set_host(room_s, player_s);
 	}
 	player_s->login_count++;
 	tfdg_send_host(room_s);
+	room_account(room_s);
 	free(name);
 	free(uuid);
 }
@@ -2182,8 +5113,8 @@ static void json_create_player_result(cJSON *tree, struct tfdg_player *player_s)
 	if(player){
 		array = cJSON_CreateArray();
 		for(i=0; i<player_s->dice_count; i++){
-			if(player_s->dice_values[i] != 0){
-				jtmp = cJSON_CreateNumber(player_s->dice_values[i]);
+			if(player_die(player_s, i) != 0){
+				jtmp = cJSON_CreateNumber(player_die(player_s, i));
 				cJSON_AddItemToArray(array, jtmp);
 			}
 		}
@@ -2194,36 +5125,28 @@ static void json_create_player_result(cJSON *tree, struct tfdg_player *player_s)
 
 static cJSON *json_create_results_array(struct tfdg_room *room_s)
 {
-	struct tfdg_player *p, *start = NULL;
 	cJSON *tree;
+	int start = 0;
+	int i, count;
 
+	count = room_s->seat_count;
 	if(room_s->dudo_caller){
-		CDL_FOREACH(room_s->players, p){
-			if(p == room_s->dudo_caller){
-				start = room_s->dudo_caller;
-				break;
-			}
+		if(room_player_seated(room_s, room_s->dudo_caller)){
+			start = room_s->dudo_caller->seat;
 		}
 	}else if(room_s->calza_caller){
-		CDL_FOREACH(room_s->players, p){
-			if(p == room_s->calza_caller){
-				start = room_s->calza_caller;
-				break;
-			}
+		if(room_player_seated(room_s, room_s->calza_caller)){
+			start = room_s->calza_caller->seat;
 		}
 	}
-	if(start == NULL){
-		/* Starter was a player that has lost or left */
-		start = room_s->players;
-	}
+	/* Otherwise the caller was a player that has lost or left, start at the
+	 * first seat. */
 	tree = cJSON_CreateArray();
-	if(room_s->forwards){
-		CDL_FOREACH(start, p){
-			json_create_player_result(tree, p);
-		}
-	}else{
-		CDL_FOREACH2(start, p, prev){
-			json_create_player_result(tree, p);
+	for(i=0; i<count; i++){
+		if(room_s->forwards){
+			json_create_player_result(tree, room_s->seats[(start + i) % count]);
+		}else{
+			json_create_player_result(tree, room_s->seats[(start - i + count) % count]);
 		}
 	}
 	return tree;
@@ -2234,8 +5157,7 @@ static void send_results(struct tfdg_room *room_s, const char *topic_suffix)
 {
 	cJSON *tree;
 
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : " ANSI_MAGENTA "round %d" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, topic_suffix, room_s->round);
+	tfdg_log(tll_info, room_s->uuid, topic_suffix, NULL, "round=%d", room_s->round);
 
 	tree = json_create_results_array(room_s);
 	easy_publish(room_s, topic_suffix, tree);
@@ -2263,7 +5185,7 @@ static void tfdg_handle_logout(struct mosquitto_evt_acl_check *ed, struct tfdg_r
 {
 	char *uuid = NULL;
 	char *name = NULL;
-	struct tfdg_player *player_s = NULL, *p;
+	struct tfdg_player *player_s = NULL;
 
 	if(room_s == NULL) return;
 
@@ -2280,32 +5202,30 @@ static void tfdg_handle_logout(struct mosquitto_evt_acl_check *ed, struct tfdg_r
 
 	player_s->login_count--;
 	if(player_s->login_count > 0){
+		free(name);
+		free(uuid);
 		return;
 	}
 
-	HASH_FIND(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), p);
-	if(p){
-		HASH_DELETE(hh_client_id, room_s->player_by_client_id, p);
-	}
+	room_remove_client(room_s, player_s);
 	if(room_s->state == tgs_lobby){
 		HASH_DELETE(hh_uuid, room_s->player_by_uuid, player_s);
 		room_delete_player(room_s, player_s);
 		room_set_player_count(room_s, room_s->player_count-1);
 
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "logout", player_s->uuid, player_s->name);
+		tfdg_log(tll_notice, room_s->uuid, "logout", player_s, NULL);
 
+		player_set_compact(room_s, player_s, false);
 		cleanup_player(player_s);
 	}
 	free(name);
 	free(uuid);
 
-	if(room_s->players == NULL){
-		cleanup_room(room_s, "lobby");
+	if(room_s->seat_count == 0){
+		room_queue_cleanup(room_s, "lobby");
 	}else{
 		if(player_s == room_s->host){
-			room_set_host(room_s, room_s->players);
+			room_set_host(room_s, room_first_player(room_s));
 			tfdg_send_host(room_s);
 		}
 
@@ -2322,22 +5242,20 @@ static void tfdg_new_round(struct tfdg_room *room_s)
 {
 	struct tfdg_player *p;
 	int i;
-	int count;
-	unsigned char bytes[4001]; /* 200 players * 20 dice */
+	size_t count, stride;
+	uint8_t *values, *masks = NULL;
+	struct tfdg_rng *rng;
 	cJSON *tree, *jtmp;
 	int max_dice_value;
 
 	// FIXME - checks on current state
-	if(room_s->player_count > 199){
-		/* buffer size protection */
-		return;
-	}
-	count = room_s->player_count*room_s->options.max_dice + 1;
-	/* +1 is for random_max_dice_value */
-
-	CDL_FOREACH(room_s->players, p){
+	i = 0;
+	while(i < room_s->seat_count){
+		p = room_s->seats[i];
 		if(p->dice_count == 0){
 			tfdg_handle_player_lost(room_s, p);
+		}else{
+			i++;
 		}
 	}
 
@@ -2352,30 +5270,41 @@ static void tfdg_new_round(struct tfdg_room *room_s)
 		room_s->forwards = true;
 	}
 
-	if(room_s->options.random_position){
-		room_shuffle_players(room_s);
+	if(room_s->options.random_position && room_shuffle_players(room_s)){
 		tfdg_send_lobby_players(room_s);
 	}
 
-	if(RAND_bytes(bytes, count) == 1){
+	stride = (size_t)room_s->options.max_dice;
+	count = (size_t)room_s->seat_count*stride;
+
+	values = room_scratch(room_s, 2*count);
+	if(values){
+		rng = room_rng(room_s);
 		if(room_s->round == 1 || room_s->options.random_max_dice_value == false){
 			max_dice_value = room_s->options.max_dice_value;
 		}else{
-			max_dice_value = 3 + (bytes[count-1] % (room_s->options.max_dice_value - 3 + 1));
+			max_dice_value = 3 + (int)rng_uniform(rng, (uint32_t)(room_s->options.max_dice_value - 3 + 1));
 			publish_int_option(room_s, "max-dice-value", max_dice_value);
 		}
+		/* Roll for the whole room in one pass */
+		rng_uniform_batch(rng, (uint32_t)max_dice_value, values, count);
+		if(room_s->options.random_mask_percentage > 0){
+			masks = &values[count];
+			rng_uniform_batch(rng, 100, masks, count);
+		}
 		room_set_state(room_s, tgs_playing_round);
-		i = 0;
-		CDL_FOREACH(room_s->players, p){
-			player_set_dice_values(room_s, p, &bytes[room_s->options.max_dice*i], max_dice_value);
+		memset(room_s->faces, 0, sizeof(room_s->faces));
+		for(i=0; i<room_s->seat_count; i++){
+			p = room_s->seats[i];
+			player_set_dice_values(room_s, p, &values[stride*(size_t)i], masks ? &masks[stride*(size_t)i] : NULL);
 			player_set_state(p, tps_awaiting_dice);
-			i++;
+		}
+		for(i=0; i<MAX_DICE_VALUE; i++){
+			room_s->totals[i] += room_s->faces[i+1];
 		}
 
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%d (%d players, %s)" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "new-round", room_s->round, room_s->current_count,
-				room_s->forwards?"forwards":"reverse");
+		tfdg_log(tll_info, room_s->uuid, "new-round", NULL, "round=%d players=%d direction=%s",
+				room_s->round, room_s->current_count, room_s->forwards?"forwards":"reverse");
 
 		tree = cJSON_CreateObject();
 		jtmp = player_to_cjson(room_s->starter);
@@ -2386,9 +5315,9 @@ static void tfdg_new_round(struct tfdg_room *room_s)
 			cJSON_AddBoolToObject(tree, "forwards", room_s->forwards);
 			if(room_s->current_count > 2){
 				if(room_s->forwards){
-					jtmp = player_to_cjson(room_s->starter->next);
+					jtmp = player_to_cjson(room_next_player(room_s, room_s->starter));
 				}else{
-					jtmp = player_to_cjson(room_s->starter->prev);
+					jtmp = player_to_cjson(room_prev_player(room_s, room_s->starter));
 				}
 				if(jtmp){
 					cJSON_AddItemToObject(tree, "next-player", jtmp);
@@ -2407,20 +5336,147 @@ static void tfdg_new_round(struct tfdg_room *room_s)
 }
 
 
-/* Remove rooms that haven't seen any changes in two hours */
-static void tfdg_expire_rooms(void)
+static struct tfdg_player *room_first_present_player(struct tfdg_room *room_s)
+{
+	struct tfdg_player *p;
+	int i;
+
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[i];
+		if(p->away == false){
+			return p;
+		}
+	}
+	DL_FOREACH(room_s->lost_players, p){
+		if(p->away == false){
+			return p;
+		}
+	}
+	return NULL;
+}
+
+
+static void player_mark_away(struct tfdg_room *room_s, struct tfdg_player *player_s)
+{
+	time_t expiry_time;
+
+	tfdg_log(tll_info, room_s->uuid, "away", player_s, NULL);
+
+	player_s->away = true;
+	player_s->away_time = time(NULL);
+
+	expiry_time = player_s->away_time + reconnect_grace_time;
+	if(room_s->away_expiry_time == 0 || expiry_time < room_s->away_expiry_time){
+		room_s->away_expiry_time = expiry_time;
+		room_update_expiry(room_s);
+	}
+}
+
+
+/* Deal with players whose reconnect grace time has run out. Lobby players are
+ * removed so their seat is free, players in a game keep their place but can no
+ * longer hold on to being host. */
+static void room_expire_away_players(struct tfdg_room *room_s, time_t now)
+{
+	struct tfdg_player *p, *host;
+	time_t next = 0;
+	bool lobby_changed = false;
+	int i;
+
+	i = 0;
+	while(i < room_s->seat_count){
+		p = room_s->seats[i];
+		i++;
+		if(p->away_time == 0) continue;
+
+		if(p->away_time + reconnect_grace_time > now){
+			if(next == 0 || p->away_time + reconnect_grace_time < next){
+				next = p->away_time + reconnect_grace_time;
+			}
+			continue;
+		}
+		p->away_time = 0;
+
+		if(room_s->state == tgs_lobby){
+			i--; /* The following players move down a seat */
+			tfdg_log(tll_notice, room_s->uuid, "away-timeout", p, NULL);
+
+			room_remove_client(room_s, p);
+			HASH_DELETE(hh_uuid, room_s->player_by_uuid, p);
+			room_delete_player(room_s, p);
+			room_set_player_count(room_s, room_s->player_count-1);
+			player_set_compact(room_s, p, false);
+			cleanup_player(p);
+			lobby_changed = true;
+		}
+	}
+	DL_FOREACH(room_s->lost_players, p){
+		if(p->away_time == 0) continue;
+
+		if(p->away_time + reconnect_grace_time > now){
+			if(next == 0 || p->away_time + reconnect_grace_time < next){
+				next = p->away_time + reconnect_grace_time;
+			}
+			continue;
+		}
+		p->away_time = 0;
+	}
+	room_s->away_expiry_time = next;
+	if(lobby_changed){
+		room_account(room_s);
+	}
+
+	if(room_s->seat_count == 0){
+		room_queue_cleanup(room_s, "lobby");
+		return;
+	}
+	if(room_s->host && room_s->host->away && room_s->host->away_time == 0){
+		host = room_first_present_player(room_s);
+		if(host){
+			room_set_host(room_s, host);
+			tfdg_send_host(room_s);
+		}
+	}
+	if(lobby_changed){
+		tfdg_send_lobby_players(room_s);
+	}
+}
+
+
+/* Remove rooms that have been idle for longer than their state allows, and
+ * finished rooms once their grace period is up. Only the wheel slots for the
+ * seconds since the last call are visited. */
+static void tfdg_expire_rooms(time_t now)
 {
 	struct tfdg_room *room_s, *room_tmp;
-	time_t now;
+	int slot;
 
-	now = time(NULL);
-	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
-		if(now > room_s->last_event + room_expiry_time){
-			printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-					ANSI_MAGENTA "%d players" ANSI_RESET "\n",
-					room_s->uuid, MAX_LOG_LEN, "room-expiring", room_s->current_count);
+	if(now - expiry_wheel_time > EXPIRY_WHEEL_SIZE){
+		/* We've fallen more than a full turn behind, every slot is due */
+		expiry_wheel_time = now - EXPIRY_WHEEL_SIZE;
+	}
+	while(expiry_wheel_time < now){
+		expiry_wheel_time++;
+		slot = (int)(expiry_wheel_time & (EXPIRY_WHEEL_SIZE-1));
+		DL_FOREACH_SAFE2(expiry_wheel[slot], room_s, room_tmp, expiry_next){
+			if(room_s->expiry_time > expiry_wheel_time){
+				continue;
+			}
+			if(room_s->away_expiry_time != 0 && room_s->away_expiry_time <= expiry_wheel_time){
+				room_expire_away_players(room_s, expiry_wheel_time);
+				if(room_s->cleanup_reason){
+					continue;
+				}
+			}
+			if(room_s->idle_expiry_time > expiry_wheel_time){
+				room_update_expiry(room_s);
+			}else{
+				if(room_is_finished(room_s) == false){
+					tfdg_log(tll_notice, room_s->uuid, "room-expiring", NULL, "players=%d", room_s->current_count);
+				}
 
-			cleanup_room(room_s, "expire");
+				room_queue_cleanup(room_s, room_cleanup_reason(room_s));
+			}
 		}
 	}
 }
@@ -2428,12 +5484,9 @@ static void tfdg_expire_rooms(void)
 
 static void tfdg_handle_start_game(struct mosquitto_evt_acl_check *ed, struct tfdg_room *room_s)
 {
-	unsigned char bytes[1];
-	struct tfdg_player *player_s, *p;
+	struct tfdg_player *player_s;
 	int i;
 
-	tfdg_expire_rooms();
-
 	if(room_s == NULL || room_s->state != tgs_lobby || room_s->player_count < 2){
 		return;
 	}
@@ -2442,25 +5495,18 @@ static void tfdg_handle_start_game(struct mosquitto_evt_acl_check *ed, struct tf
 	if(player_s == NULL || player_s != room_s->host) return;
 
 	room_s->current_count = room_s->player_count;
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%d players" ANSI_RESET "(%d)\n",
-			room_s->uuid, MAX_LOG_LEN, "start-game", room_s->current_count, HASH_COUNT(room_by_uuid));
-
-	room_shuffle_players(room_s);
-	tfdg_send_lobby_players(room_s);
+	tfdg_log(tll_notice, room_s->uuid, "start-game", NULL, "players=%d rooms=%u",
+			room_s->current_count, HASH_COUNT(room_by_uuid));
 
-	CDL_FOREACH(room_s->players, p){
-		player_set_dice_count(p, room_s->options.max_dice);
+	if(room_shuffle_players(room_s)){
+		tfdg_send_lobby_players(room_s);
 	}
 
-	if(RAND_bytes(bytes, 1) == 1){
-		room_s->starter = room_s->players;
-		for(i=0; i<bytes[0]%room_s->player_count; i++){
-			room_set_starter(room_s, room_s->starter->next);
-		}
-	}else{
-		room_set_starter(room_s, room_s->players);
+	for(i=0; i<room_s->seat_count; i++){
+		player_set_dice_count(room_s, room_s->seats[i], room_s->options.max_dice);
 	}
+
+	room_set_starter(room_s, room_s->seats[rng_uniform(room_rng(room_s), (uint32_t)room_s->seat_count)]);
 	room_set_start_time(room_s, time(NULL));
 	room_set_last_event(room_s, room_s->start_time);
 
@@ -2479,10 +5525,10 @@ static cJSON *json_create_my_dice_array(struct tfdg_player *player_s)
 
 	tree = cJSON_CreateArray();
 	for(i=0; i<player_s->dice_count; i++){
-		if(player_s->dice_mask[i]){
+		if(player_die_masked(player_s, i)){
 			jtmp = cJSON_CreateNumber(-1);
 		}else{
-			jtmp = cJSON_CreateNumber(player_s->dice_values[i]);
+			jtmp = cJSON_CreateNumber(player_die(player_s, i));
 		}
 		if(jtmp == NULL){
 			return NULL;
@@ -2500,15 +5546,24 @@ static void send_dice(struct tfdg_room *room_s, struct tfdg_player *player_s)
 	char topic[200];
 
 	tree = json_create_my_dice_array(player_s);
-	json_str = cJSON_PrintUnformatted(tree);
-	cJSON_Delete(tree);
-	if(json_str){
+	if(tree == NULL) return;
+
+	/* Only this player can read their dice, so only send their encoding */
+	if(player_s->compact){
+		snprintf(topic, sizeof(topic), "tfdgc/%s/dice/%s", room_s->uuid, player_s->uuid);
+		compact_publish(room_s, topic, tree, false);
+	}else{
+		json_str = cJSON_PrintUnformatted(tree);
+		if(json_str == NULL){
+			cJSON_Delete(tree);
+			return;
+		}
 		snprintf(topic, sizeof(topic), "tfdg/%s/dice/%s", room_s->uuid, player_s->uuid);
-		mosquitto_broker_publish(NULL, topic, (int)strlen(json_str), json_str, 1, 0, NULL);
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "send-dice", player_s->uuid, player_s->name);
+		broker_publish(topic, (int)strlen(json_str), json_str, false);
 	}
+	cJSON_Delete(tree);
+
+	tfdg_log(tll_debug, room_s->uuid, "send-dice", player_s, NULL);
 }
 
 
@@ -2516,9 +5571,11 @@ static cJSON *room_pre_roll_to_cjson(struct tfdg_room *room_s)
 {
 	cJSON *tree, *j_player, *jtmp;
 	struct tfdg_player *p;
+	int i;
 
 	tree = cJSON_CreateArray();
-	CDL_FOREACH(room_s->players, p){
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[i];
 		if(p->state == tps_pre_roll){
 			j_player = player_to_cjson(p);
 			if(j_player){
@@ -2535,16 +5592,17 @@ static cJSON *room_pre_roll_to_cjson(struct tfdg_room *room_s)
 static void room_pre_roll_init(struct tfdg_room *room_s)
 {
 	struct tfdg_player *p;
-	unsigned char bytes[1000];
-	int i;
+	struct tfdg_rng *rng;
+	int i, s;
 	cJSON *tree = NULL, *j_player;
 
+	rng = room_rng(room_s);
 	room_set_state(room_s, tgs_pre_roll);
-	RAND_bytes(bytes, room_s->player_count);
 	i = 0;
-	CDL_FOREACH(room_s->players, p){
+	for(s=0; s<room_s->seat_count; s++){
+		p = room_s->seats[s];
 		if(p->state != tps_pre_roll_lost){
-			p->pre_roll = (uint8_t)((bytes[i] % room_s->options.max_dice_value) + 1);
+			p->pre_roll = (uint8_t)(rng_uniform(rng, (uint32_t)room_s->options.max_dice_value) + 1);
 			player_set_state(p, tps_pre_roll);
 			i++;
 
@@ -2568,20 +5626,19 @@ static void tfdg_handle_pre_roll_result(struct tfdg_room *room_s)
 	int max_rolled = 0, max_rolled_count = 0;
 	struct tfdg_player *p, *starter = NULL;
 
-	for(i=room_s->options.max_dice_value+1; i>=0; i--){
-		CDL_FOREACH(room_s->players, p){
-			if(p->state == tps_pre_roll_sent){
-				if(p->pre_roll == i){
-					max_rolled_count++;
-				}
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[i];
+		if(p->state == tps_pre_roll_sent){
+			if(p->pre_roll > max_rolled){
+				max_rolled = p->pre_roll;
+				max_rolled_count = 1;
+			}else if(p->pre_roll == max_rolled){
+				max_rolled_count++;
 			}
 		}
-		if(max_rolled_count > 0){
-			max_rolled = i;
-			break;
-		}
 	}
-	CDL_FOREACH(room_s->players, p){
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[i];
 		if(p->state == tps_pre_roll_sent && p->pre_roll == max_rolled){
 			player_set_state(p, tps_pre_roll);
 			j_player = player_to_cjson(p);
@@ -2671,9 +5728,9 @@ static cJSON *json_create_dudo_candidates_object(struct tfdg_room *room_s)
 		}
 
 		if(room_s->forwards){
-			j_player = player_to_cjson(room_s->dudo_caller->prev);
+			j_player = player_to_cjson(room_prev_player(room_s, room_s->dudo_caller));
 		}else{
-			j_player = player_to_cjson(room_s->dudo_caller->next);
+			j_player = player_to_cjson(room_next_player(room_s, room_s->dudo_caller));
 		}
 		if(j_player){
 			cJSON_AddItemToArray(tree, j_player);
@@ -2686,18 +5743,12 @@ static cJSON *json_create_dudo_candidates_object(struct tfdg_room *room_s)
 static void report_summary_results(struct tfdg_room *room_s, const char *topic_suffix)
 {
 	cJSON *tree, *array, *jtmp;
-	struct tfdg_player *p;
 	int totals[MAX_DICE_VALUE], totals_wild[MAX_DICE_VALUE];
 	int i;
 
-	memset(totals, 0, sizeof(int)*MAX_DICE_VALUE);
 	memset(totals_wild, 0, sizeof(int)*MAX_DICE_VALUE);
 
-	CDL_FOREACH(room_s->players, p){
-		for(i=0; i<p->dice_count; i++){
-			totals[p->dice_values[i]-1]++;
-		}
-	}
+	memcpy(totals, &room_s->faces[1], sizeof(totals));
 	totals_wild[0] = totals[0];
 	for(i=1; i<room_s->options.max_dice_value; i++){
 		totals_wild[i] = totals[0] + totals[i];
@@ -2723,34 +5774,34 @@ static void report_summary_results(struct tfdg_room *room_s, const char *topic_s
 
 static void tfdg_handle_call_dudo(struct mosquitto_evt_acl_check *ed, struct tfdg_room *room_s)
 {
-	struct tfdg_player *player_s = NULL, *p;
+	struct tfdg_player *player_s = NULL;
 	cJSON *tree;
+	int i;
 
 	player_s = find_player_check_id(ed, room_s);
 	if(player_s == NULL) return;
 
 	if(player_s->state != tps_have_dice
-			|| room_s->state != tgs_playing_round){
+			|| room_s->state != tgs_playing_round
+			|| room_player_seated(room_s, player_s) == false){
 
 		return;
 	}
 
-	CDL_FOREACH(room_s->players, p){
-		player_set_state(player_s, tps_awaiting_loser);
+	for(i=0; i<room_s->seat_count; i++){
+		player_set_state(room_s->seats[i], tps_awaiting_loser);
 	}
 	player_set_state(player_s, tps_dudo_candidate);
 	if(room_s->forwards){
-		player_set_state(player_s->prev, tps_dudo_candidate);
+		player_set_state(room_prev_player(room_s, player_s), tps_dudo_candidate);
 	}else{
-		player_set_state(player_s->next, tps_dudo_candidate);
+		player_set_state(room_next_player(room_s, player_s), tps_dudo_candidate);
 	}
 	room_set_dudo_caller(room_s, player_s);
 
 	tree = json_create_dudo_candidates_object(room_s);
 	if(tree){
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "call-dudo", player_s->uuid, player_s->name);
+		tfdg_log(tll_info, room_s->uuid, "call-dudo", player_s, NULL);
 
 		easy_publish(room_s, "dudo-candidates", tree);
 		cJSON_Delete(tree);
@@ -2764,24 +5815,23 @@ static void tfdg_handle_call_dudo(struct mosquitto_evt_acl_check *ed, struct tfd
 
 static void tfdg_handle_call_calza(struct mosquitto_evt_acl_check *ed, struct tfdg_room *room_s)
 {
-	struct tfdg_player *player_s = NULL, *p;
+	struct tfdg_player *player_s = NULL;
+	int i;
 
 	player_s = find_player_check_id(ed, room_s);
 	if(player_s == NULL) return;
 
 
-	if(player_s->state != tps_have_dice){
+	if(player_s->state != tps_have_dice || room_player_seated(room_s, player_s) == false){
 		return;
 	}
 	if(player_s->dice_count == room_s->options.max_dice){
 		return;
 	}
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "call-calza", player_s->uuid, player_s->name);
+	tfdg_log(tll_info, room_s->uuid, "call-calza", player_s, NULL);
 
-	CDL_FOREACH(room_s->players, p){
-		player_set_state(p, tps_awaiting_loser);
+	for(i=0; i<room_s->seat_count; i++){
+		player_set_state(room_s->seats[i], tps_awaiting_loser);
 	}
 	player_set_state(player_s, tps_calza_candidate);
 	room_set_calza_caller(room_s, player_s);
@@ -2810,31 +5860,25 @@ static cJSON *room_dice_totals(struct tfdg_room *room_s)
 
 static void room_add_to_stats(struct tfdg_room *room_s)
 {
-	int i;
-
-	if(room_s->player_count > 1 && room_s->player_count < 100){
-		stats.players[room_s->player_count]++;
-		if(room_s->player_count > stats.max_players){
-			stats.max_players = room_s->player_count;
-		}
-		stats.duration_counts[room_s->player_count]++;
-		stats.durations[room_s->player_count] += (int)(time(NULL)-room_s->start_time);
-	}
-	stats.calza_success += room_s->calza_success;
-	stats.calza_fail += room_s->calza_fail;
-	stats.dudo_success += room_s->dudo_success;
-	stats.dudo_fail += room_s->dudo_fail;
-
-	if(room_s->options.max_dice >= 3 && room_s->options.max_dice <= 20){
-		stats.dice_count[room_s->options.max_dice]++;
-	}
-	if(room_s->options.max_dice_value >= 3 && room_s->options.max_dice_value <= 9){
-		stats.dice_values[room_s->options.max_dice_value]++;
-	}
-	for(i=0; i<10; i++){
-		stats.thrown_dice_values[i] += room_s->totals[i];
-	}
-	publish_stats();
+	struct tfdg_job *job;
+	struct tfdg_game_result *result;
+
+	job = calloc(1, sizeof(struct tfdg_job));
+	if(job == NULL) return;
+
+	job->type = tj_game_result;
+	result = &job->result;
+	result->player_count = room_s->player_count;
+	result->duration = (int)(time(NULL)-room_s->start_time);
+	result->calza_success = room_s->calza_success;
+	result->calza_fail = room_s->calza_fail;
+	result->dudo_success = room_s->dudo_success;
+	result->dudo_fail = room_s->dudo_fail;
+	result->max_dice = room_s->options.max_dice;
+	result->max_dice_value = room_s->options.max_dice_value;
+	memcpy(result->totals, room_s->totals, sizeof(result->totals));
+
+	job_submit(job);
 }
 
 
@@ -2846,10 +5890,8 @@ static void tfdg_handle_winner(struct tfdg_room *room_s)
 	array = room_dice_totals(room_s);
 	cJSON_AddItemToObject(tree, "totals", array);
 
-	if(room_s->players){
-		/* There is a bug somewhere that means we can't be sure room_s->players is valid at this point.
-		 * We'd be best not to crash at least. */
-		j_player = player_to_cjson(room_s->players);
+	if(room_s->seat_count > 0){
+		j_player = player_to_cjson(room_first_player(room_s));
 		if(j_player){
 			cJSON_AddItemToObject(tree, "winner", j_player);
 		}
@@ -2865,7 +5907,7 @@ static void tfdg_handle_winner(struct tfdg_room *room_s)
 
 static void tfdg_handle_kick_player(struct mosquitto_evt_acl_check *ed, struct tfdg_room *room_s)
 {
-	struct tfdg_player *kicker_s, *player_s = NULL;
+	struct tfdg_player *kicker_s, *kicked_s, *player_s = NULL;
 	const char *client_id;
 
 	/* Find the player structure described by '{"uuid":""}' if it is in this room */
@@ -2876,17 +5918,48 @@ static void tfdg_handle_kick_player(struct mosquitto_evt_acl_check *ed, struct t
 	client_id = mosquitto_client_id(ed->client);
 	HASH_FIND(hh_client_id, room_s->player_by_client_id, client_id, (unsigned int)strlen(client_id), kicker_s);
 
-	if(kicker_s && room_s->host == kicker_s &&
+	if(kicker_s && room_s->host == kicker_s && kicker_s != player_s
+			&& room_player_seated(room_s, player_s) &&
 			(room_s->state == tgs_lobby || room_s->state == tgs_playing_round || room_s->state == tgs_round_over || room_s->state == tgs_game_over)){
 
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "kick-player", player_s->uuid, player_s->name);
+		tfdg_log(tll_notice, room_s->uuid, "kick-player", player_s, NULL);
 
 		easy_publish_player(room_s, "player-left", player_s);
 
+		if(room_s->state == tgs_lobby){
+			/* As for logout, there's no game for them to be part of */
+			room_remove_client(room_s, player_s);
+			HASH_DELETE(hh_uuid, room_s->player_by_uuid, player_s);
+			room_delete_player(room_s, player_s);
+			room_set_player_count(room_s, room_s->player_count-1);
+			player_set_compact(room_s, player_s, false);
+			cleanup_player(player_s);
+			tfdg_send_lobby_players(room_s);
+			return;
+		}
+
+		/* Nothing in the room may refer to them once they are a spectator */
+		if(room_s->starter == player_s){
+			room_set_starter(room_s, room_next_player(room_s, player_s));
+		}
+		if(room_s->dudo_caller == player_s) room_set_dudo_caller(room_s, NULL);
+		if(room_s->calza_caller == player_s) room_set_calza_caller(room_s, NULL);
+		if(room_s->round_loser == player_s) room_set_round_loser(room_s, NULL);
+		if(room_s->round_winner == player_s) room_set_round_winner(room_s, NULL);
+
 		room_delete_player(room_s, player_s);
-		/* Don't add to lost players, they were kicked for a reason */
+		player_set_compact(room_s, player_s, false);
+		/* Don't add to lost players, they were kicked for a reason. They
+		 * stay on as a spectator if they still have a client here. */
+		HASH_DELETE(hh_uuid, room_s->player_by_uuid, player_s);
+		player_set_state(player_s, tps_spectator);
+		kicked_s = NULL;
+		if(player_s->client_id){
+			HASH_FIND(hh_client_id, room_s->player_by_client_id, player_s->client_id, (unsigned int)strlen(player_s->client_id), kicked_s);
+		}
+		if(kicked_s != player_s){
+			cleanup_detached_player(player_s);
+		}
 		room_set_current_count(room_s, room_s->current_count-1);
 
 		if(room_s->current_count == 1){
@@ -2904,15 +5977,12 @@ static void tfdg_handle_reset_game(struct mosquitto_evt_acl_check *ed, struct tf
 	player_s = find_player_check_id(ed, room_s);
 	if(player_s && room_s->host == player_s){
 
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "reset-game", player_s->uuid, player_s->name);
+		tfdg_log(tll_notice, room_s->uuid, "reset-game", player_s, NULL);
 
 		easy_publish(room_s, "reset-game", NULL);
 
 		room_set_state(room_s, tgs_resetting);
 		easy_publish(room_s, "room-closing", NULL);
-		cleanup_room(room_s, "reset-game");
 	}
 }
 
@@ -2926,9 +5996,7 @@ static void tfdg_handle_leave_game(struct mosquitto_evt_acl_check *ed, struct tf
 
 	if(room_s->state == tgs_playing_round || room_s->state == tgs_round_over || room_s->state == tgs_game_over){
 
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "leave-game", player_s->uuid, player_s->name);
+		tfdg_log(tll_notice, room_s->uuid, "leave-game", player_s, NULL);
 
 		easy_publish_player(room_s, "player-left", player_s);
 
@@ -2966,11 +6034,9 @@ static void tfdg_handle_undo_loser(struct mosquitto_evt_acl_check *ed, struct tf
 	if(room_s->round_loser != player_s){
 		return;
 	}
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "undo-loser", player_s->uuid, player_s->name);
+	tfdg_log(tll_info, room_s->uuid, "undo-loser", player_s, NULL);
 
-	player_set_dice_count(player_s, player_s->dice_count+1);
+	player_set_dice_count(room_s, player_s, player_s->dice_count+1);
 	room_set_round_loser(room_s, NULL);
 
 	if(player_s->state == tps_dudo_candidate){
@@ -3004,11 +6070,10 @@ static void tfdg_handle_undo_winner(struct mosquitto_evt_acl_check *ed, struct t
 	if(room_s->round_winner != player_s){
 		return;
 	}
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "undo-winner", player_s->uuid, player_s->name);
+	tfdg_log(tll_info, room_s->uuid, "undo-winner", player_s, NULL);
 
-	player_set_dice_count(player_s, player_s->dice_count-1);
+	player_set_dice_count(room_s, player_s, player_s->dice_count-1);
+	room_set_round_winner(room_s, NULL);
 
 	easy_publish_player(room_s, "undo-winner", player_s);
 }
@@ -3016,14 +6081,11 @@ static void tfdg_handle_undo_winner(struct mosquitto_evt_acl_check *ed, struct t
 
 static void tfdg_handle_player_lost(struct tfdg_room *room_s, struct tfdg_player *player_s)
 {
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "game-lost", player_s->uuid, player_s->name);
+	tfdg_log(tll_info, room_s->uuid, "game-lost", player_s, NULL);
 
-	room_set_starter(room_s, player_s->next);
+	room_set_starter(room_s, room_next_player(room_s, player_s));
 
 	room_delete_player(room_s, player_s);
-	CDL_DELETE(room_s->players, player_s);
 	DL_APPEND(room_s->lost_players, player_s);
 	room_s->current_count--;
 
@@ -3053,16 +6115,14 @@ static void tfdg_handle_i_lost(struct mosquitto_evt_acl_check *ed, struct tfdg_r
 	}
 	room_set_state(room_s, tgs_round_over);
 	room_set_round_loser(room_s, player_s);
-	player_set_dice_count(player_s, player_s->dice_count-1);
+	player_set_dice_count(room_s, player_s, player_s->dice_count-1);
 
 	if(player_s->dice_count == 0 && room_s->current_count == 2){
 		/* Game is over, no chance of undo */
 		tfdg_handle_player_lost(room_s, player_s);
 		tfdg_handle_winner(room_s);
 	}else{
-		printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-				ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-				room_s->uuid, MAX_LOG_LEN, "round-lost", player_s->uuid, player_s->name);
+		tfdg_log(tll_info, room_s->uuid, "round-lost", player_s, NULL);
 
 		easy_publish_player(room_s, "round-loser", player_s);
 		if(player_s->dice_count == 0){
@@ -3084,6 +6144,8 @@ static void tfdg_handle_i_won(struct mosquitto_evt_acl_check *ed, struct tfdg_ro
 	struct tfdg_player *player_s = NULL;
 
 	player_s = find_player_check_id(ed, room_s);
+	if(player_s == NULL) return;
+	if(room_s->round_winner || room_s->round_loser) return; /* Round already decided */
 
 	/* Check that the client is in the correct state. */
 	if(player_s->state != tps_calza_candidate){
@@ -3092,11 +6154,9 @@ static void tfdg_handle_i_won(struct mosquitto_evt_acl_check *ed, struct tfdg_ro
 	room_set_calza_success(room_s, room_s->calza_success+1);
 	room_set_state(room_s, tgs_round_over);
 	room_set_round_winner(room_s, player_s);
-	player_set_dice_count(player_s, player_s->dice_count+1);
+	player_set_dice_count(room_s, player_s, player_s->dice_count+1);
 
-	printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-			ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET "\n",
-			room_s->uuid, MAX_LOG_LEN, "calza-won", player_s->uuid, player_s->name);
+	tfdg_log(tll_info, room_s->uuid, "calza-won", player_s, NULL);
 
 	easy_publish_player(room_s, "round-winner", player_s);
 	room_set_starter(room_s, player_s);
@@ -3127,26 +6187,37 @@ static void publish_int_option(struct tfdg_room *room_s, const char *option, int
 }
 
 
+/* Repeats of a sound inside sound-window-ms are dropped, every client
+ * already has one to play. */
 static void tfdg_handle_sound(const struct mosquitto_evt_acl_check *ed, struct tfdg_room *room_s, const char *type)
 {
-	char topic[200];
+	char topic_suffix[20];
 	uint8_t value;
 	cJSON *tree, *jtmp;
-	char *json_str;
+	uint64_t now_ms, *last_ms;
 
-	if(room_s->state != tgs_playing_round){
+	if(room_s == NULL || room_s->state != tgs_playing_round){
 		return;
 	}
-	RAND_bytes(&value, 1);
+	if(sound_window_ms > 0){
+		now_ms = now_ns()/1000000;
+		last_ms = &room_s->sound_ms[strcmp(type, "higher") ? 1 : 0];
+		if(*last_ms && now_ms - *last_ms < (uint64_t)sound_window_ms){
+			metrics.sounds_coalesced++;
+			command_dropped = true;
+			return;
+		}
+		*last_ms = now_ms;
+	}
+	value = (uint8_t)rng_uniform(room_rng(room_s), 256);
 
 	tree = cJSON_CreateObject();
 	jtmp = cJSON_CreateNumber(value);
 	cJSON_AddItemToObject(tree, "sound", jtmp);
-	json_str = cJSON_PrintUnformatted(tree);
-	cJSON_Delete(tree);
 
-	snprintf(topic, sizeof(topic), "tfdg/%s/snd-%s", room_s->uuid, type);
-	mosquitto_broker_publish(NULL, topic, (int)strlen(json_str), json_str, 1, 0, NULL);
+	snprintf(topic_suffix, sizeof(topic_suffix), "snd-%s", type);
+	easy_publish(room_s, topic_suffix, tree);
+	cJSON_Delete(tree);
 }
 
 
@@ -3184,10 +6255,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 				if(ival >= 3 && ival <= MAX_DICE){
 					room_set_option_int(room_s, &room_s->options.max_dice, "max-dice", ival);
 
-					printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-							ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-							room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-							"max-dice", ival);
+					tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "max-dice=%d", ival);
 
 					publish_int_option(room_s, "max-dice", ival);
 				}
@@ -3198,10 +6266,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 				if(ival >= 3 && ival <= MAX_DICE_VALUE){
 					room_set_option_int(room_s, &room_s->options.max_dice_value, "max-dice-value", ival);
 
-					printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-							ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-							room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-							"max-dice-value", ival);
+					tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "max-dice-value=%d", ival);
 
 					publish_int_option(room_s, "max-dice-value", ival);
 				}
@@ -3210,10 +6275,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 			if(cJSON_IsBool(j_value)){
 				room_set_option_bool(room_s, &room_s->options.random_max_dice_value, "random-max-dice-value", cJSON_IsTrue(j_value));
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"random-max-dice-value", cJSON_IsTrue(j_value));
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "random-max-dice-value=%d", cJSON_IsTrue(j_value));
 
 				publish_bool_option(room_s, "random-max-dice-value", cJSON_IsTrue(j_value));
 			}
@@ -3222,10 +6284,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 				ival = j_value->valueint;
 				room_set_option_int(room_s, &room_s->options.random_mask_percentage, "random-mask-percentage", ival);
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"random-mask-percentage", ival);
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "random-mask-percentage=%d", ival);
 
 				publish_int_option(room_s, "random-mask-percentage", ival);
 			}
@@ -3233,10 +6292,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 			if(cJSON_IsBool(j_value)){
 				room_set_option_bool(room_s, &room_s->options.random_position, "random-position", cJSON_IsTrue(j_value));
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"random-position", cJSON_IsTrue(j_value));
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "random-position=%d", cJSON_IsTrue(j_value));
 
 				publish_bool_option(room_s, "random-position", cJSON_IsTrue(j_value));
 			}
@@ -3244,10 +6300,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 			if(cJSON_IsBool(j_value)){
 				room_set_option_bool(room_s, &room_s->options.swap_direction, "swap-direction", cJSON_IsTrue(j_value));
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"swap-direction", cJSON_IsTrue(j_value));
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "swap-direction=%d", cJSON_IsTrue(j_value));
 
 				publish_bool_option(room_s, "swap-direction", cJSON_IsTrue(j_value));
 			}
@@ -3255,10 +6308,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 			if(cJSON_IsBool(j_value)){
 				room_set_option_bool(room_s, &room_s->options.roll_dice_at_start, "roll-dice-at-start", cJSON_IsTrue(j_value));
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"roll-dice-at-start", cJSON_IsTrue(j_value));
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "roll-dice-at-start=%d", cJSON_IsTrue(j_value));
 
 				publish_bool_option(room_s, "roll-dice-at-start", cJSON_IsTrue(j_value));
 			}
@@ -3266,10 +6316,7 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 			if(cJSON_IsBool(j_value)){
 				room_set_option_bool(room_s, &room_s->options.show_results_table, "show-results-table", cJSON_IsTrue(j_value));
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"show-results-table", cJSON_IsTrue(j_value));
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "show-results-table=%d", cJSON_IsTrue(j_value));
 
 				publish_bool_option(room_s, "show-results-table", cJSON_IsTrue(j_value));
 			}
@@ -3277,50 +6324,76 @@ static void tfdg_handle_set_option(struct mosquitto_evt_acl_check *ed, struct tf
 			if(cJSON_IsBool(j_value)){
 				room_set_option_bool(room_s, &room_s->options.losers_see_dice, "losers-see-dice", cJSON_IsTrue(j_value));
 
-				printf(ANSI_YELLOW GAME_NAME ANSI_BLUE "%s" ANSI_RESET " : " ANSI_GREEN "%-*s" ANSI_RESET " : "
-						ANSI_MAGENTA "%s" ANSI_RESET " : " ANSI_CYAN "%s" ANSI_RESET " %s = %d\n",
-						room_s->uuid, MAX_LOG_LEN, "setting-option", player_s->uuid, player_s->name,
-						"losers-see-dice", cJSON_IsTrue(j_value));
+				tfdg_log(tll_info, room_s->uuid, "setting-option", player_s, "losers-see-dice=%d", cJSON_IsTrue(j_value));
+
+				publish_bool_option(room_s, "losers-see-dice", cJSON_IsTrue(j_value));
+			}
+		}
+		cJSON_Delete(tree);
+	}
+}
+
+
+static enum tfdg_command command_lookup(const char *cmd)
+{
+	int i;
 
-				publish_bool_option(room_s, "losers-see-dice", cJSON_IsTrue(j_value));
-			}
+	for(i=0; i<tc_unknown; i++){
+		if(!strcmp(cmd, command_names[i])){
+			return (enum tfdg_command)i;
 		}
-		cJSON_Delete(tree);
 	}
+	return tc_unknown;
 }
 
 
-static int callback_acl_check(int event, void *event_data, void *userdata)
+static int acl_check(struct mosquitto_evt_acl_check *ed)
 {
-	struct mosquitto_evt_acl_check *ed = event_data;
 	struct tfdg_room *room_s = NULL;
 	struct tfdg_player *player_s = NULL;
 	char *room;
 	char *cmd;
 	char *player;
 	const char *client_id;
-
-	if(strncmp(ed->topic, "tfdg/", 5) != 0){
-		/* We only want messages in the 'tfdg/' tree. */
+	const char *topic;
+	bool compact;
+	enum tfdg_command command;
+	uint64_t trace_start;
+
+	/* We only want messages in the 'tfdg/' and 'tfdgc/' trees. */
+	if(strncmp(ed->topic, "tfdg/", 5) == 0){
+		topic = ed->topic+5;
+		compact = false;
+	}else if(strncmp(ed->topic, "tfdgc/", 6) == 0){
+		topic = ed->topic+6;
+		compact = true;
+	}else{
 		return MOSQ_ERR_PLUGIN_DEFER;
 	}
 
 	/* Subscription access check */
 	if(ed->access == MOSQ_ACL_SUBSCRIBE){
 		if(strcmp(ed->topic, "tfdg/#") == 0
-				|| strcmp(ed->topic, "tfdg/stats") == 0){
+				|| strcmp(ed->topic, "tfdgc/#") == 0
+				|| strcmp(ed->topic, "tfdg/stats") == 0
+				|| strcmp(ed->topic, "tfdg/metrics") == 0){
 
 			return MOSQ_ERR_SUCCESS;
 		}else{
 			return MOSQ_ERR_ACL_DENIED;
 		}
 	}else if(ed->access == MOSQ_ACL_READ){
-		if(strcmp(ed->topic, "tfdg/stats") == 0){
+		if(strcmp(ed->topic, "tfdg/stats") == 0
+				|| strcmp(ed->topic, "tfdg/metrics") == 0){
+
 			return MOSQ_ERR_SUCCESS;
 		}
+	}else if(ed->access == MOSQ_ACL_WRITE && compact){
+		/* Commands are only accepted on the 'tfdg/' tree */
+		return MOSQ_ERR_ACL_DENIED;
 	}
 
-	tfdg_topic_tokenise(ed->topic+5, &room, &cmd, &player);
+	tfdg_topic_tokenise(topic, &room, &cmd, &player);
 
 	if(room == NULL || cmd == NULL){
 		free(room);
@@ -3347,13 +6420,6 @@ static int callback_acl_check(int event, void *event_data, void *userdata)
 	if(ed->access == MOSQ_ACL_READ){
 		free(room);
 
-		if(strcmp(cmd, "room-closing") == 0 && room_s && room_s->state == tgs_game_over){
-			free(cmd);
-			free(player);
-			cleanup_room(room_s, "game-over");
-			return MOSQ_ERR_ACL_DENIED;
-		}
-
 		/* Players can only read messages from:
 		 * tfdg/<room>/dice/<player>
 		 * tfdg/<room>/<cmds>
@@ -3369,6 +6435,7 @@ static int callback_acl_check(int event, void *event_data, void *userdata)
 
 
 			if(player_s == NULL ||
+					player_s->compact != compact ||
 					strcmp(player_s->uuid, player) != 0){
 
 				free(player);
@@ -3378,9 +6445,14 @@ static int callback_acl_check(int event, void *event_data, void *userdata)
 				return MOSQ_ERR_SUCCESS;
 			}
 		}else if(strcmp(cmd, "loser-results") == 0 || strcmp(cmd, "loser-summary-results") == 0){
+			if(room_s == NULL){
+				free(cmd);
+				free(player);
+				return MOSQ_ERR_ACL_DENIED;
+			}
 			client_id = mosquitto_client_id(ed->client);
 			DL_FOREACH(room_s->lost_players, player_s){
-				if(strcmp(player_s->client_id, client_id) == 0){
+				if(strcmp(player_s->client_id, client_id) == 0 && player_s->compact == compact){
 					free(cmd);
 					free(player);
 					return MOSQ_ERR_SUCCESS;
@@ -3390,6 +6462,8 @@ static int callback_acl_check(int event, void *event_data, void *userdata)
 			free(player);
 			return MOSQ_ERR_ACL_DENIED;
 		}else if(strcmp(cmd, "reset-game") == 0){
+			free(cmd);
+			free(player);
 			return MOSQ_ERR_SUCCESS;
 		}else{
 			free(cmd);
@@ -3402,51 +6476,87 @@ static int callback_acl_check(int event, void *event_data, void *userdata)
 				return MOSQ_ERR_ACL_DENIED;
 			}
 			HASH_FIND(hh_client_id, room_s->player_by_client_id, client_id, (unsigned int)strlen(client_id), player_s);
-			if(player_s == NULL){
+			if(player_s == NULL || player_s->compact != compact){
 				return MOSQ_ERR_ACL_DENIED;
 			}else{
 				return MOSQ_ERR_SUCCESS;
 			}
 		}
 	}else if(ed->access == MOSQ_ACL_WRITE){
+		command = command_lookup(cmd);
+		metrics.commands[command]++;
+		if(rate_check(ed, room_s, command) == false){
+			command_dropped = true;
+			free(room);
+			free(cmd);
+			free(player);
+			return MOSQ_ERR_ACL_DENIED;
+		}
 		if(room_s){
 			room_set_last_event(room_s, time(NULL));
 		}
-		if(!strcmp(cmd, "login")){
-			tfdg_handle_login(ed, room, room_s);
-		}else if(!strcmp(cmd, "logout")){
-			tfdg_handle_logout(ed, room_s);
-		}else if(!strcmp(cmd, "start-game")){
-			tfdg_handle_start_game(ed, room_s);
-		}else if(!strcmp(cmd, "new-name")){
-			tfdg_handle_new_name(ed, room_s);
-		}else if(!strcmp(cmd, "roll-dice")){
-			tfdg_handle_roll_dice(ed, room_s);
-		}else if(!strcmp(cmd, "call-dudo")){
-			tfdg_handle_call_dudo(ed, room_s);
-		}else if(!strcmp(cmd, "call-calza")){
-			tfdg_handle_call_calza(ed, room_s);
-		}else if(!strcmp(cmd, "i-lost")){
-			tfdg_handle_i_lost(ed, room_s);
-		}else if(!strcmp(cmd, "i-won")){
-			tfdg_handle_i_won(ed, room_s);
-		}else if(!strcmp(cmd, "undo-loser")){
-			tfdg_handle_undo_loser(ed, room_s);
-		}else if(!strcmp(cmd, "undo-winner")){
-			tfdg_handle_undo_winner(ed, room_s);
-		}else if(!strcmp(cmd, "leave-game")){
-			tfdg_handle_leave_game(ed, room_s);
-		}else if(!strcmp(cmd, "kick-player")){
-			tfdg_handle_kick_player(ed, room_s);
-		}else if(!strcmp(cmd, "reset-game")){
-			tfdg_handle_reset_game(ed, room_s);
-		}else if(!strcmp(cmd, "set-option")){
-			tfdg_handle_set_option(ed, room_s);
-		}else if(!strcmp(cmd, "snd-higher")){
-			tfdg_handle_sound(ed, room_s, "higher");
-		}else if(!strcmp(cmd, "snd-exact")){
-			tfdg_handle_sound(ed, room_s, "exact");
+		trace_start = trace_begin();
+		switch(command){
+			case tc_login:
+				tfdg_handle_login(ed, room, room_s);
+				break;
+			case tc_logout:
+				tfdg_handle_logout(ed, room_s);
+				break;
+			case tc_start_game:
+				tfdg_handle_start_game(ed, room_s);
+				break;
+			case tc_new_name:
+				tfdg_handle_new_name(ed, room_s);
+				break;
+			case tc_roll_dice:
+				tfdg_handle_roll_dice(ed, room_s);
+				break;
+			case tc_call_dudo:
+				tfdg_handle_call_dudo(ed, room_s);
+				break;
+			case tc_call_calza:
+				tfdg_handle_call_calza(ed, room_s);
+				break;
+			case tc_i_lost:
+				tfdg_handle_i_lost(ed, room_s);
+				break;
+			case tc_i_won:
+				tfdg_handle_i_won(ed, room_s);
+				break;
+			case tc_undo_loser:
+				tfdg_handle_undo_loser(ed, room_s);
+				break;
+			case tc_undo_winner:
+				tfdg_handle_undo_winner(ed, room_s);
+				break;
+			case tc_leave_game:
+				tfdg_handle_leave_game(ed, room_s);
+				break;
+			case tc_kick_player:
+				tfdg_handle_kick_player(ed, room_s);
+				break;
+			case tc_reset_game:
+				tfdg_handle_reset_game(ed, room_s);
+				break;
+			case tc_set_option:
+				tfdg_handle_set_option(ed, room_s);
+				break;
+			case tc_snd_higher:
+				tfdg_handle_sound(ed, room_s, "higher");
+				break;
+			case tc_snd_exact:
+				tfdg_handle_sound(ed, room_s, "exact");
+				break;
+			default:
+				break;
+		}
+		if(room_s && (command == tc_logout || command == tc_new_name
+					|| command == tc_leave_game || command == tc_kick_player)){
+
+			room_account(room_s);
 		}
+		trace_span(&trace_broker, command, trace_start);
 		free(room);
 		free(cmd);
 		free(player);
@@ -3461,3 +6571,560 @@ static int callback_acl_check(int event, void *event_data, void *userdata)
 
 	return MOSQ_ERR_SUCCESS;
 }
+
+
+static void hist_record(struct tfdg_histogram *hist, uint64_t value)
+{
+	int msb, shift;
+	size_t idx;
+
+	if(value >= ((uint64_t)1 << HIST_MAX_BITS)){
+		value = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+	}
+	if(value < (1 << HIST_SUB_BITS)){
+		idx = (size_t)value;
+	}else{
+		msb = 63 - __builtin_clzll(value);
+		shift = msb - HIST_SUB_BITS;
+		idx = ((size_t)(shift+1) << HIST_SUB_BITS)
+			+ (size_t)((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+	}
+	hist->counts[idx]++;
+	hist->count++;
+	hist->sum += value;
+	if(value > hist->max){
+		hist->max = value;
+	}
+}
+
+
+/* Highest value that falls in bucket idx */
+static uint64_t hist_bucket_value(size_t idx)
+{
+	int shift;
+
+	if(idx < (1 << HIST_SUB_BITS)){
+		return idx;
+	}
+	shift = (int)(idx >> HIST_SUB_BITS) - 1;
+	return (((uint64_t)1 << HIST_SUB_BITS | (idx & ((1 << HIST_SUB_BITS) - 1))) << shift)
+		+ ((uint64_t)1 << shift) - 1;
+}
+
+
+static uint64_t hist_percentile(const struct tfdg_histogram *hist, double q)
+{
+	uint64_t target, seen = 0;
+	size_t i;
+
+	if(hist->count == 0) return 0;
+
+	target = (uint64_t)((double)hist->count * q);
+	if((double)target < (double)hist->count * q || target == 0){
+		target++;
+	}
+	for(i=0; i<HIST_BUCKETS; i++){
+		seen += hist->counts[i];
+		if(seen >= target){
+			return hist_bucket_value(i) < hist->max ? hist_bucket_value(i) : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+
+static void hist_add_to_cjson(cJSON *tree, const char *name, const struct tfdg_histogram *hist)
+{
+	cJSON *j_hist;
+
+	j_hist = cJSON_CreateObject();
+	if(j_hist == NULL) return;
+	cJSON_AddItemToObject(tree, name, j_hist);
+
+	cJSON_AddNumberToObject(j_hist, "count", (double)hist->count);
+	cJSON_AddNumberToObject(j_hist, "p50-ns", (double)hist_percentile(hist, 0.5));
+	cJSON_AddNumberToObject(j_hist, "p99-ns", (double)hist_percentile(hist, 0.99));
+	cJSON_AddNumberToObject(j_hist, "p999-ns", (double)hist_percentile(hist, 0.999));
+	cJSON_AddNumberToObject(j_hist, "max-ns", (double)hist->max);
+}
+
+
+static void pool_add_to_cjson(cJSON *tree, const char *name, const struct tfdg_pool *pool)
+{
+	cJSON *j_pool;
+
+	j_pool = cJSON_CreateObject();
+	if(j_pool == NULL) return;
+	cJSON_AddItemToObject(tree, name, j_pool);
+
+	cJSON_AddNumberToObject(j_pool, "in-use", (double)pool->in_use);
+	cJSON_AddNumberToObject(j_pool, "chunks", (double)pool->chunk_count);
+	cJSON_AddNumberToObject(j_pool, "bytes", (double)pool->chunk_count*POOL_CHUNK_ITEMS*(double)pool->item_size);
+}
+
+
+static const char *room_state_name(enum tfdg_game_state state)
+{
+	switch(state){
+		case tgs_lobby:
+			return "lobby";
+		case tgs_playing_round:
+			return "playing-round";
+		case tgs_sending_results:
+			return "sending-results";
+		case tgs_awaiting_loser:
+			return "awaiting-loser";
+		case tgs_round_over:
+			return "round-over";
+		case tgs_game_over:
+			return "game-over";
+		case tgs_pre_roll:
+			return "pre-roll";
+		case tgs_pre_roll_over:
+			return "pre-roll-over";
+		case tgs_resetting:
+			return "resetting";
+		default:
+			return "none";
+	}
+}
+
+
+static void hist_merge(struct tfdg_histogram *dest, const struct tfdg_histogram *src)
+{
+	size_t i;
+
+	for(i=0; i<HIST_BUCKETS; i++){
+		dest->counts[i] += src->counts[i];
+	}
+	dest->count += src->count;
+	dest->sum += src->sum;
+	if(src->max > dest->max){
+		dest->max = src->max;
+	}
+}
+
+
+static void metrics_accumulate(void)
+{
+	int i;
+
+	hist_merge(&metrics_total.acl_read, &metrics.acl_read);
+	hist_merge(&metrics_total.acl_write, &metrics.acl_write);
+	for(i=0; i<TC_COUNT; i++){
+		metrics_total.commands[i] += metrics.commands[i];
+	}
+	metrics_total.publish_count += metrics.publish_count;
+	metrics_total.publish_bytes += metrics.publish_bytes;
+	for(i=0; i<TR_COUNT; i++){
+		metrics_total.login_rejected[i] += metrics.login_rejected[i];
+	}
+	for(i=0; i<TRC_COUNT; i++){
+		metrics_total.throttled[0][i] += metrics.throttled[0][i];
+		metrics_total.throttled[1][i] += metrics.throttled[1][i];
+	}
+	metrics_total.sounds_coalesced += metrics.sounds_coalesced;
+	if(metrics.snapshot_count > 0){
+		metrics_total.snapshot_count += metrics.snapshot_count;
+		metrics_total.snapshot_serialise_us = metrics.snapshot_serialise_us;
+	}
+}
+
+
+/* Cumulative buckets at each power of two from 1us to ~1s */
+static void prom_histogram(FILE *fptr, const char *access, const struct tfdg_histogram *hist)
+{
+	uint64_t seen = 0;
+	size_t idx = 0, end;
+	int bits;
+
+	for(bits=10; bits<=30; bits++){
+		end = (size_t)(bits - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+		while(idx < end){
+			seen += hist->counts[idx];
+			idx++;
+		}
+		fprintf(fptr, "tfdg_acl_check_duration_seconds_bucket{access=\"%s\",le=\"%g\"} %lu\n",
+				access, (double)((uint64_t)1 << bits)/1e9, (unsigned long)seen);
+	}
+	fprintf(fptr, "tfdg_acl_check_duration_seconds_bucket{access=\"%s\",le=\"+Inf\"} %lu\n",
+			access, (unsigned long)hist->count);
+	fprintf(fptr, "tfdg_acl_check_duration_seconds_sum{access=\"%s\"} %g\n",
+			access, (double)hist->sum/1e9);
+	fprintf(fptr, "tfdg_acl_check_duration_seconds_count{access=\"%s\"} %lu\n",
+			access, (unsigned long)hist->count);
+}
+
+
+static void prom_gauge(FILE *fptr, const char *name, const char *help)
+{
+	fprintf(fptr, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+}
+
+
+/* Format the broker thread metrics, the worker adds the game stats and
+ * writes the file. */
+static void metrics_write_prom(const int *room_counts, size_t largest_room)
+{
+	struct tfdg_job *job;
+	FILE *fptr;
+	char *buf = NULL;
+	size_t len = 0;
+	int i;
+
+	fptr = open_memstream(&buf, &len);
+	if(fptr == NULL) return;
+
+	prom_counter(fptr, "tfdg_commands_total", "Commands received by type.");
+	for(i=0; i<TC_COUNT; i++){
+		fprintf(fptr, "tfdg_commands_total{command=\"%s\"} %ld\n", command_names[i], metrics_total.commands[i]);
+	}
+
+	fprintf(fptr, "# HELP tfdg_acl_check_duration_seconds Time spent in the ACL check callback.\n"
+			"# TYPE tfdg_acl_check_duration_seconds histogram\n");
+	prom_histogram(fptr, "read", &metrics_total.acl_read);
+	prom_histogram(fptr, "write", &metrics_total.acl_write);
+
+	prom_gauge(fptr, "tfdg_rooms", "Live rooms by state.");
+	for(i=0; i<tgs_resetting+2; i++){
+		if(strcmp(room_state_name((enum tfdg_game_state)(i-1)), "none")){
+			fprintf(fptr, "tfdg_rooms{state=\"%s\"} %d\n", room_state_name((enum tfdg_game_state)(i-1)), room_counts[i]);
+		}
+	}
+	prom_gauge(fptr, "tfdg_players", "Players in live rooms.");
+	fprintf(fptr, "tfdg_players{client=\"connected\"} %u\n", client_player_count);
+	fprintf(fptr, "tfdg_players{client=\"any\"} %ld\n", player_pool.in_use);
+
+	prom_counter(fptr, "tfdg_publish_total", "Messages published by the plugin.");
+	fprintf(fptr, "tfdg_publish_total %ld\n", metrics_total.publish_count);
+	prom_counter(fptr, "tfdg_publish_bytes_total", "Payload bytes published by the plugin.");
+	fprintf(fptr, "tfdg_publish_bytes_total %ld\n", metrics_total.publish_bytes);
+
+	prom_counter(fptr, "tfdg_state_saves_total", "State file saves.");
+	fprintf(fptr, "tfdg_state_saves_total %ld\n", metrics_total.snapshot_count);
+	prom_gauge(fptr, "tfdg_state_save_seconds", "Duration of the last state save by stage.");
+	fprintf(fptr, "tfdg_state_save_seconds{stage=\"serialise\"} %g\n", (double)metrics_total.snapshot_serialise_us/1e6);
+	fprintf(fptr, "tfdg_state_save_seconds{stage=\"write\"} %g\n", (double)atomic_load(&snapshot_write_us)/1e6);
+
+	prom_gauge(fptr, "tfdg_pool_items", "Items in use in each object pool.");
+	fprintf(fptr, "tfdg_pool_items{pool=\"rooms\"} %ld\n", room_pool.in_use);
+	fprintf(fptr, "tfdg_pool_items{pool=\"players\"} %ld\n", player_pool.in_use);
+	fprintf(fptr, "tfdg_pool_items{pool=\"client-ids\"} %ld\n", client_id_pool.in_use);
+
+	prom_gauge(fptr, "tfdg_room_memory_bytes", "Memory held by rooms, as counted for max-memory.");
+	fprintf(fptr, "tfdg_room_memory_bytes{room=\"all\"} %zu\n", memory_total);
+	fprintf(fptr, "tfdg_room_memory_bytes{room=\"largest\"} %zu\n", largest_room);
+	prom_counter(fptr, "tfdg_login_rejected_total", "Logins turned away by an admission limit.");
+	for(i=0; i<TR_COUNT; i++){
+		fprintf(fptr, "tfdg_login_rejected_total{reason=\"%s\"} %ld\n", reject_names[i], metrics_total.login_rejected[i]);
+	}
+	prom_counter(fptr, "tfdg_throttled_total", "Commands dropped by a rate limit, by bucket and command class.");
+	for(i=0; i<TRC_COUNT; i++){
+		fprintf(fptr, "tfdg_throttled_total{bucket=\"client\",class=\"%s\"} %ld\n", rate_class_names[i], metrics_total.throttled[0][i]);
+		fprintf(fptr, "tfdg_throttled_total{bucket=\"room\",class=\"%s\"} %ld\n", rate_class_names[i], metrics_total.throttled[1][i]);
+	}
+	prom_counter(fptr, "tfdg_sounds_coalesced_total", "Sounds dropped because the same sound was sent within sound-window-ms.");
+	fprintf(fptr, "tfdg_sounds_coalesced_total %ld\n", metrics_total.sounds_coalesced);
+
+	prom_counter(fptr, "tfdg_log_dropped_total", "Log records dropped because the log ring was full.");
+	fprintf(fptr, "tfdg_log_dropped_total %ld\n", atomic_load(&log_dropped));
+
+	if(fclose(fptr)){
+		free(buf);
+		return;
+	}
+
+	job = calloc(1, sizeof(struct tfdg_job));
+	if(job == NULL){
+		free(buf);
+		return;
+	}
+	job->type = tj_write_prom;
+	job->prom = buf;
+	job_submit(job);
+}
+
+
+/* Publish the retained tfdg/metrics topic and start a new interval */
+static void publish_metrics(time_t now)
+{
+	cJSON *tree, *j_obj, *j_bucket;
+	struct tfdg_room *room_s, *room_tmp;
+	int room_counts[tgs_resetting+2]; /* indexed by state+1 */
+	double elapsed;
+	char *json_str;
+	uint64_t start;
+	size_t largest_room;
+	int i, j;
+
+	start = trace_begin();
+	largest_room = memory_recount();
+	memset(room_counts, 0, sizeof(room_counts));
+	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
+		if(room_s->state >= tgs_none && room_s->state <= tgs_resetting){
+			room_counts[room_s->state+1]++;
+		}
+	}
+	metrics_accumulate();
+	if(prom_file){
+		metrics_write_prom(room_counts, largest_room);
+	}
+
+	tree = cJSON_CreateObject();
+	if(tree == NULL) return;
+
+	elapsed = (double)(now - metrics_start);
+	if(elapsed < 1){
+		elapsed = 1;
+	}
+	cJSON_AddNumberToObject(tree, "interval", elapsed);
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "rooms", j_obj);
+		cJSON_AddNumberToObject(j_obj, "total", HASH_COUNT(room_by_uuid));
+		for(i=0; i<tgs_resetting+2; i++){
+			if(room_counts[i] > 0){
+				cJSON_AddNumberToObject(j_obj, room_state_name((enum tfdg_game_state)(i-1)), room_counts[i]);
+			}
+		}
+	}
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "players", j_obj);
+		cJSON_AddNumberToObject(j_obj, "connected", client_player_count);
+		cJSON_AddNumberToObject(j_obj, "total", (double)player_pool.in_use);
+	}
+
+	/* Commands per second */
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "commands", j_obj);
+		for(i=0; i<TC_COUNT; i++){
+			cJSON_AddNumberToObject(j_obj, command_names[i], (double)metrics.commands[i]/elapsed);
+		}
+	}
+
+	hist_add_to_cjson(tree, "acl-read", &metrics.acl_read);
+	hist_add_to_cjson(tree, "acl-write", &metrics.acl_write);
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "publish", j_obj);
+		cJSON_AddNumberToObject(j_obj, "count", (double)metrics.publish_count);
+		cJSON_AddNumberToObject(j_obj, "bytes", (double)metrics.publish_bytes);
+	}
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "snapshot", j_obj);
+		cJSON_AddNumberToObject(j_obj, "count", (double)metrics.snapshot_count);
+		cJSON_AddNumberToObject(j_obj, "serialise-us", (double)metrics.snapshot_serialise_us);
+		cJSON_AddNumberToObject(j_obj, "write-us", (double)atomic_load(&snapshot_write_us));
+	}
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "memory", j_obj);
+		pool_add_to_cjson(j_obj, "rooms", &room_pool);
+		pool_add_to_cjson(j_obj, "players", &player_pool);
+		pool_add_to_cjson(j_obj, "client-ids", &client_id_pool);
+		cJSON_AddNumberToObject(j_obj, "room-bytes", (double)memory_total);
+		cJSON_AddNumberToObject(j_obj, "largest-room-bytes", (double)largest_room);
+	}
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "login-rejected", j_obj);
+		for(i=0; i<TR_COUNT; i++){
+			cJSON_AddNumberToObject(j_obj, reject_names[i], (double)metrics.login_rejected[i]);
+		}
+	}
+
+	j_obj = cJSON_CreateObject();
+	if(j_obj){
+		cJSON_AddItemToObject(tree, "throttled", j_obj);
+		for(j=0; j<2; j++){
+			j_bucket = cJSON_CreateObject();
+			if(j_bucket == NULL) continue;
+			cJSON_AddItemToObject(j_obj, j ? "room" : "client", j_bucket);
+			for(i=0; i<TRC_COUNT; i++){
+				cJSON_AddNumberToObject(j_bucket, rate_class_names[i], (double)metrics.throttled[j][i]);
+			}
+		}
+		cJSON_AddNumberToObject(j_obj, "sounds-coalesced", (double)metrics.sounds_coalesced);
+	}
+
+	cJSON_AddNumberToObject(tree, "log-dropped", (double)atomic_load(&log_dropped));
+
+	tree->precision = 1;
+	json_str = cJSON_PrintUnformatted(tree);
+	cJSON_Delete(tree);
+
+	memset(&metrics, 0, sizeof(metrics));
+	metrics_start = now;
+
+	if(json_str){
+		broker_publish("tfdg/metrics", (int)strlen(json_str), json_str, true);
+	}
+	trace_span(&trace_broker, tt_publish_metrics, start);
+}
+
+
+static void trace_request_dump(void)
+{
+	struct tfdg_job *job;
+
+	job = calloc(1, sizeof(struct tfdg_job));
+	if(job == NULL) return;
+
+	job->type = tj_trace_dump;
+	job->trace_seconds = trace_dump_seconds;
+	tfdg_log(tll_notice, NULL, "trace-dump", NULL, "file=\"%s\" seconds=%d", trace_file, trace_dump_seconds);
+	job_submit(job);
+}
+
+
+/* Installed with SA_SIGINFO so that a previous handler of either kind can be
+ * passed everything it expects */
+static void trace_handle_sigusr2(int signal, siginfo_t *info, void *context)
+{
+	trace_dump_requested = 1;
+	if(trace_old_sigusr2.sa_flags & SA_SIGINFO){
+		if(trace_old_sigusr2.sa_sigaction){
+			trace_old_sigusr2.sa_sigaction(signal, info, context);
+		}
+	}else if(trace_old_sigusr2.sa_handler != SIG_DFL
+			&& trace_old_sigusr2.sa_handler != SIG_IGN){
+
+		trace_old_sigusr2.sa_handler(signal);
+	}
+}
+
+
+static int callback_tick(int event, void *event_data, void *userdata)
+{
+	time_t now;
+	uint64_t start;
+
+	start = trace_begin();
+	now = time(NULL);
+	tfdg_expire_rooms(now);
+	cleanup_queue_drain(cleanup_budget_us);
+	rate_cool();
+	worker_collect();
+	if(metrics_interval > 0 && now - metrics_start >= metrics_interval){
+		publish_metrics(now);
+	}
+	trace_span(&trace_broker, tt_tick, start);
+
+	if(capture_fptr && now != capture_flushed){
+		capture_flush();
+		capture_flushed = now;
+	}
+
+	if(trace_dump_requested){
+		trace_dump_requested = 0;
+		trace_request_dump();
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int callback_acl_check(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_acl_check *ed = event_data;
+	struct timespec start, end;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	command_dropped = false;
+	rc = acl_check(ed);
+	if(rc != MOSQ_ERR_PLUGIN_DEFER
+			&& (ed->access == MOSQ_ACL_READ || ed->access == MOSQ_ACL_WRITE)){
+
+		/* A replay runs without the rate limits or sound window, so leave
+		 * out the commands they dropped */
+		if(capture_fptr && ed->access == MOSQ_ACL_WRITE && command_dropped == false){
+			capture_record(tct_command, mosquitto_client_id(ed->client), ed->topic, ed->payload, ed->payloadlen);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		hist_record(ed->access == MOSQ_ACL_WRITE ? &metrics.acl_write : &metrics.acl_read,
+				(uint64_t)((end.tv_sec - start.tv_sec)*1000000000L + (end.tv_nsec - start.tv_nsec)));
+		if(trace_enabled){
+			trace_span(&trace_broker, ed->access == MOSQ_ACL_WRITE ? tt_acl_write : tt_acl_read,
+					(uint64_t)start.tv_sec*1000000000 + (uint64_t)start.tv_nsec);
+		}
+	}
+	return rc;
+}
+
+
+/* Only the log level can be changed without restarting the plugin */
+static int callback_reload(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_reload *ed = event_data;
+	int i;
+
+	for(i=0; i<ed->option_count; i++){
+		if(!strcmp(ed->options[i].key, "log-level")){
+			if(log_level_parse(ed->options[i].value) >= 0){
+				log_level = log_level_parse(ed->options[i].value);
+				tfdg_log(tll_notice, NULL, "log-level", NULL, "level=%s", ed->options[i].value);
+			}
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int callback_disconnect(int event, void *event_data, void *userdata)
+{
+	struct mosquitto_evt_disconnect *ed = event_data;
+	struct tfdg_player *player_s, *player_tmp;
+	struct tfdg_room *room_s;
+	struct tfdg_client_id *client;
+	const char *client_id;
+	bool captured = false;
+
+	client_id = mosquitto_client_id(ed->client);
+	if(client_id == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	rate_release(client_id);
+
+	HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+	if(client == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	/* Freeing the last spectator may free client, so only player_tmp is
+	 * safe to use once player_s has been handled. */
+	DL_FOREACH_SAFE2(client->players, player_s, player_tmp, client_next){
+		if(player_s->away) continue;
+
+		room_s = player_s->room;
+		if(capture_fptr && captured == false){
+			capture_record(tct_disconnect, client_id, NULL, NULL, 0);
+			captured = true;
+		}
+
+		if(player_s->state == tps_spectator){
+			/* Spectators have no seat to keep */
+			room_remove_client(room_s, player_s);
+			player_set_compact(room_s, player_s, false);
+			if(player_s != room_s->host){
+				cleanup_detached_player(player_s);
+			}
+			room_account(room_s);
+			continue;
+		}
+
+		player_mark_away(room_s, player_s);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
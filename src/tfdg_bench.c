@@ -0,0 +1,326 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Benchmarks for the tfdg plugin. The plugin source is included directly and
+ * driven through the callbacks it registers, with the broker functions it
+ * uses replaced by tfdg_stubs.c. Plugin logging goes to /dev/null, results go
+ * to stderr.
+ */
+
+#include "plugin_tfdg.c"
+#include "tfdg_stubs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_STATE_FILE "tfdg-bench-state.json"
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+
+static long max_rss_kb(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+
+static size_t heap_in_use(void)
+{
+	struct mallinfo2 mi;
+
+	mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+
+static void bench_command(struct stub_client *client, const char *room, const char *cmd, const char *payload)
+{
+	struct mosquitto_evt_acl_check ed;
+	char topic[200];
+
+	snprintf(topic, sizeof(topic), "tfdg/%s/%s", room, cmd);
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)client;
+	ed.topic = topic;
+	ed.payload = payload;
+	ed.payloadlen = (uint32_t)strlen(payload);
+	ed.access = MOSQ_ACL_WRITE;
+	stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+}
+
+
+static void bench_tick(void)
+{
+	struct mosquitto_evt_tick ed;
+
+	memset(&ed, 0, sizeof(ed));
+	stub_callbacks[MOSQ_EVT_TICK](MOSQ_EVT_TICK, &ed, NULL);
+}
+
+
+static void bench_plugin_init(bool trace)
+{
+	struct mosquitto_opt opts[5];
+
+	opts[0].key = "state-file";
+	opts[0].value = BENCH_STATE_FILE;
+	opts[1].key = "cleanup-budget-us";
+	opts[1].value = "-1";
+	opts[2].key = "trace";
+	opts[2].value = trace ? "true" : "false";
+	opts[3].key = "rate-limit";
+	opts[3].value = "false";
+	opts[4].key = "sound-window-ms";
+	opts[4].value = "0";
+
+	unlink(BENCH_STATE_FILE);
+	memset(stub_callbacks, 0, sizeof(stub_callbacks));
+	mosquitto_plugin_init(NULL, NULL, opts, 5);
+}
+
+
+static void bench_plugin_cleanup(void)
+{
+	mosquitto_plugin_cleanup(NULL, NULL, 0);
+	unlink(BENCH_STATE_FILE);
+}
+
+/* ======================================================================/
+ *
+ * Benchmarks
+ *
+ * ====================================================================== */
+
+/* Create a room, fill it with players, empty it again and let the tick tear
+ * it down. Client ids are reused between rooms, as they would be by players
+ * moving on to their next game. */
+static void BENCH_room_churn(int room_count, int player_count, bool trace)
+{
+	struct stub_client *clients;
+	char (*payloads)[100];
+	char room[40];
+	double start, elapsed;
+	long rss_start;
+	int r, p;
+
+	clients = calloc((size_t)player_count, sizeof(struct stub_client));
+	payloads = calloc((size_t)player_count, sizeof(*payloads));
+	if(clients == NULL || payloads == NULL){
+		free(clients);
+		free(payloads);
+		return;
+	}
+	for(p=0; p<player_count; p++){
+		snprintf(clients[p].id, sizeof(clients[p].id), "bench-client-%d", p);
+		snprintf(payloads[p], sizeof(payloads[p]),
+				"{\"name\":\"Player %d\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", p, p);
+	}
+
+	bench_plugin_init(trace);
+	stub_publish_count = 0;
+	stub_publish_bytes = 0;
+	rss_start = max_rss_kb();
+	start = now_s();
+
+	for(r=0; r<room_count; r++){
+		snprintf(room, sizeof(room), "00000000-0000-0000-0000-%012d", r);
+		for(p=0; p<player_count; p++){
+			bench_command(&clients[p], room, "login", payloads[p]);
+		}
+		for(p=0; p<player_count; p++){
+			bench_command(&clients[p], room, "logout", payloads[p]);
+		}
+		if(r % 1000 == 999){
+			bench_tick();
+		}
+	}
+	bench_tick();
+
+	elapsed = now_s() - start;
+	bench_plugin_cleanup();
+
+	fprintf(stderr, "room-churn%s: %d rooms, %d players: %.3fs, %.0f rooms/s, %.2fus/room, "
+			"%ld publishes (%ld bytes), max rss %ld kB (+%ld kB)\n",
+			trace ? " (trace)" : "", room_count, player_count, elapsed, room_count/elapsed, elapsed*1e6/room_count,
+			stub_publish_count, stub_publish_bytes, max_rss_kb(), max_rss_kb()-rss_start);
+
+	free(clients);
+	free(payloads);
+}
+
+
+/* Fill rooms with players and leave them in the lobby, then report the heap
+ * used per room and per player. This includes the JSON mirror of each room
+ * and player, not just the plugin structs. */
+static void BENCH_footprint(int room_count, int player_count)
+{
+	struct stub_client *clients;
+	char payload[100];
+	char room[40];
+	size_t heap_start, heap_rooms, heap_players;
+	int r, p;
+
+	clients = calloc((size_t)room_count*(size_t)player_count, sizeof(struct stub_client));
+	if(clients == NULL){
+		return;
+	}
+
+	bench_plugin_init(false);
+	heap_start = heap_in_use();
+
+	/* Empty rooms first, so the per-player cost can be separated out. */
+	for(r=0; r<room_count; r++){
+		snprintf(room, sizeof(room), "00000000-0000-0000-0000-%012d", r);
+		snprintf(clients[r*player_count].id, sizeof(clients[0].id), "bench-client-%d-0", r);
+		snprintf(payload, sizeof(payload),
+				"{\"name\":\"Player 0\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", 0);
+		bench_command(&clients[r*player_count], room, "login", payload);
+	}
+	heap_rooms = heap_in_use();
+
+	for(r=0; r<room_count; r++){
+		snprintf(room, sizeof(room), "00000000-0000-0000-0000-%012d", r);
+		for(p=1; p<player_count; p++){
+			snprintf(clients[r*player_count+p].id, sizeof(clients[0].id), "bench-client-%d-%d", r, p);
+			snprintf(payload, sizeof(payload),
+					"{\"name\":\"Player %d\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", p, p);
+			bench_command(&clients[r*player_count+p], room, "login", payload);
+		}
+	}
+	heap_players = heap_in_use();
+
+	bench_plugin_cleanup();
+
+	fprintf(stderr, "footprint: %d rooms, %d players: %.0f bytes/room (with host), %.0f bytes/player\n",
+			room_count, player_count,
+			(double)(heap_rooms - heap_start)/room_count,
+			player_count > 1 ? (double)(heap_players - heap_rooms)/(room_count*(player_count-1)) : 0.0);
+
+	free(clients);
+}
+
+
+/* Play rounds in a single room of player_count players, with a different
+ * player calling dudo and losing each round so nobody is knocked out. The
+ * time for the lobby to fill is reported separately from the rounds. */
+static void BENCH_round_scaling(int player_count, int round_count)
+{
+	struct stub_client *clients;
+	char (*payloads)[100];
+	const char *room = "00000000-0000-0000-0000-000000000001";
+	double start, login_elapsed, round_elapsed;
+	long publishes;
+	int r, p, caller;
+
+	clients = calloc((size_t)player_count, sizeof(struct stub_client));
+	payloads = calloc((size_t)player_count, sizeof(*payloads));
+	if(clients == NULL || payloads == NULL){
+		free(clients);
+		free(payloads);
+		return;
+	}
+	for(p=0; p<player_count; p++){
+		snprintf(clients[p].id, sizeof(clients[p].id), "bench-client-%d", p);
+		snprintf(payloads[p], sizeof(payloads[p]),
+				"{\"name\":\"Player %d\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", p, p);
+	}
+
+	bench_plugin_init(false);
+
+	start = now_s();
+	for(p=0; p<player_count; p++){
+		bench_command(&clients[p], room, "login", payloads[p]);
+	}
+	login_elapsed = now_s() - start;
+
+	stub_publish_count = 0;
+	start = now_s();
+	bench_command(&clients[0], room, "start-game", payloads[0]);
+	for(r=0; r<round_count; r++){
+		for(p=0; p<player_count; p++){
+			bench_command(&clients[p], room, "roll-dice", payloads[p]);
+		}
+		caller = r % player_count;
+		bench_command(&clients[caller], room, "call-dudo", payloads[caller]);
+		bench_command(&clients[caller], room, "i-lost", payloads[caller]);
+	}
+	round_elapsed = now_s() - start;
+	publishes = stub_publish_count;
+
+	bench_plugin_cleanup();
+
+	fprintf(stderr, "round-scaling: %6d players: lobby fill %.3fs, %d rounds %.3fs, "
+			"%.1fus/round, %.0fns/player/round, %.1f publishes/round\n",
+			player_count, login_elapsed, round_count, round_elapsed,
+			round_elapsed*1e6/round_count, round_elapsed*1e9/round_count/player_count,
+			(double)publishes/round_count);
+
+	free(clients);
+	free(payloads);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int room_count = 100000;
+	int player_count = 6;
+
+	if(argc > 1){
+		room_count = atoi(argv[1]);
+	}
+	if(argc > 2){
+		player_count = atoi(argv[2]);
+	}
+	if(room_count < 1 || player_count < 1){
+		fprintf(stderr, "Usage: tfdg_bench [rooms [players]]\n");
+		return 1;
+	}
+
+	if(freopen("/dev/null", "w", stdout) == NULL){
+		return 1;
+	}
+
+	BENCH_room_churn(room_count, player_count, false);
+	BENCH_room_churn(room_count, player_count, true);
+	BENCH_footprint(room_count/10 > 0 ? room_count/10 : 1, player_count);
+	BENCH_round_scaling(10, 20);
+	BENCH_round_scaling(100, 20);
+	BENCH_round_scaling(1000, 20);
+	BENCH_round_scaling(10000, 20);
+
+	return 0;
+}
@@ -0,0 +1,804 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* End-to-end benchmark for the tfdg plugin.
+ *
+ * A local mosquitto is started on a loopback port with plugin_tfdg.so and a
+ * state file in a temporary directory. Real MQTT clients then play one game
+ * per room, behaving like www/index.html: each subscribes to tfdg/#, sets a
+ * will on tfdg/<room>/logout and sends commands to tfdg/<room>/<command> with
+ * {"name":..., "uuid":...} as the payload. Clients are shared between a few
+ * threads, each of which runs a poll() loop over many connections. All of the
+ * clients of a room are on the same thread, so room state needs no locking.
+ *
+ * Two latencies are reported. Action latency is from a client sending a
+ * command to that client receiving its next room message. Fan-out latency is
+ * from start-game, a call or i-lost being sent to each client in the room
+ * receiving the resulting broadcast. Broker CPU time is read from /proc.
+ *
+ * Everything runs on one machine with no network access needed.
+ */
+
+#define _GNU_SOURCE
+
+#include "mosquitto.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define E2E_HOST "127.0.0.1"
+#define E2E_MAX_DICE 5
+#define E2E_STALL_NS 30000000000ULL
+#define E2E_POLL_MS 100
+
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS-HIST_SUB_BITS+1)<<HIST_SUB_BITS)
+
+struct e2e_histogram{
+	long counts[HIST_BUCKETS];
+	long count;
+	uint64_t max;
+};
+
+struct e2e_thread;
+struct e2e_room;
+
+struct e2e_client{
+	struct mosquitto *mosq;
+	struct e2e_room *room;
+	char id[40];
+	char payload[100];
+	uint64_t sent_ns;
+	long broadcast_seen;
+	int calls_seen;
+	int losers_seen;
+	int index;
+	int dice;
+	bool alive;
+};
+
+struct e2e_room{
+	struct e2e_thread *thread;
+	struct e2e_client *clients;
+	char prefix[60];
+	size_t prefix_len;
+	uint64_t broadcast_ns;
+	long broadcast_seq;
+	int alive_count;
+	int dice_received;
+	int calls_answered;
+	int losers_counted;
+	bool started;
+	bool done;
+};
+
+struct e2e_thread{
+	pthread_t thread;
+	struct e2e_room *rooms;
+	int room_count;
+	struct pollfd *fds;
+	struct e2e_client **fd_clients;
+	struct e2e_histogram action;
+	struct e2e_histogram fanout;
+	long published;
+	long received;
+	long connect_failed;
+	int rooms_done;
+	uint64_t last_progress_ns;
+	unsigned int rng_state;
+};
+
+static int port = 18830;
+static int room_count = 500;
+static int player_count = 6;
+static int thread_count = 4;
+static const char *broker_path = "mosquitto";
+static const char *plugin_path = "./plugin_tfdg.so";
+
+static atomic_bool stop = false;
+static char tmp_dir[] = "/tmp/tfdg-e2e-XXXXXX";
+static char conf_path[PATH_MAX];
+static char state_path[PATH_MAX];
+static char log_path[PATH_MAX];
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+static int hist_bucket(uint64_t value)
+{
+	int bits;
+
+	if(value < (1ULL<<HIST_SUB_BITS)){
+		return (int)value;
+	}
+	bits = 63 - __builtin_clzll(value);
+	if(bits >= HIST_MAX_BITS){
+		return HIST_BUCKETS-1;
+	}
+	return ((bits-HIST_SUB_BITS+1)<<HIST_SUB_BITS)
+		+ (int)((value >> (bits-HIST_SUB_BITS)) & ((1<<HIST_SUB_BITS)-1));
+}
+
+
+static uint64_t hist_bucket_value(int bucket)
+{
+	int bits;
+
+	if(bucket < (1<<HIST_SUB_BITS)){
+		return (uint64_t)bucket;
+	}
+	bits = (bucket>>HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	return ((uint64_t)((1<<HIST_SUB_BITS) + (bucket & ((1<<HIST_SUB_BITS)-1)))) << (bits-HIST_SUB_BITS);
+}
+
+
+static void hist_record(struct e2e_histogram *hist, uint64_t value)
+{
+	hist->counts[hist_bucket(value)]++;
+	hist->count++;
+	if(value > hist->max){
+		hist->max = value;
+	}
+}
+
+
+static uint64_t hist_percentile(const struct e2e_histogram *hist, double percentile)
+{
+	long target, seen = 0;
+	int i;
+
+	if(hist->count == 0) return 0;
+
+	target = (long)((double)hist->count * percentile / 100.0);
+	if(target >= hist->count) target = hist->count-1;
+	for(i=0; i<HIST_BUCKETS; i++){
+		seen += hist->counts[i];
+		if(seen > target){
+			return hist_bucket_value(i);
+		}
+	}
+	return hist->max;
+}
+
+
+static void hist_merge(struct e2e_histogram *dest, const struct e2e_histogram *src)
+{
+	int i;
+
+	for(i=0; i<HIST_BUCKETS; i++){
+		dest->counts[i] += src->counts[i];
+	}
+	dest->count += src->count;
+	if(src->max > dest->max){
+		dest->max = src->max;
+	}
+}
+
+
+static void hist_print(const char *name, const struct e2e_histogram *hist)
+{
+	printf("  %-8s %9ld %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, hist->count,
+			(double)hist_percentile(hist, 50.0)/1000.0,
+			(double)hist_percentile(hist, 90.0)/1000.0,
+			(double)hist_percentile(hist, 99.0)/1000.0,
+			(double)hist_percentile(hist, 99.9)/1000.0,
+			(double)hist->max/1000.0);
+}
+
+
+/* Returns the number of player uuids in a payload, and the player number of
+ * one chosen at random in *player. Players are numbered by their uuid. */
+static int payload_players(struct e2e_thread *t, const struct mosquitto_message *msg, int *player)
+{
+	const char *key = "\"uuid\":\"";
+	const char *p, *end;
+	int count = 0, n;
+
+	if(msg->payload == NULL) return 0;
+
+	p = msg->payload;
+	end = p + msg->payloadlen;
+	while((p = memmem(p, (size_t)(end - p), key, strlen(key))) != NULL){
+		p += strlen(key);
+		if(end - p < 36) break;
+
+		n = (int)strtol(&p[24], NULL, 10);
+		if(n >= 0 && n < player_count){
+			count++;
+			if(player && (unsigned int)rand_r(&t->rng_state) % (unsigned int)count == 0){
+				*player = n;
+			}
+		}
+		p += 36;
+	}
+	return count;
+}
+
+/* ======================================================================/
+ *
+ * Clients
+ *
+ * ====================================================================== */
+
+static void client_send(struct e2e_client *client, const char *cmd, bool broadcast)
+{
+	struct e2e_room *room = client->room;
+	char topic[100];
+
+	snprintf(topic, sizeof(topic), "%s%s", room->prefix, cmd);
+	client->sent_ns = now_ns();
+	if(broadcast){
+		room->broadcast_ns = client->sent_ns;
+		room->broadcast_seq++;
+	}
+	if(mosquitto_publish(client->mosq, NULL, topic, (int)strlen(client->payload), client->payload, 0, false) == MOSQ_ERR_SUCCESS){
+		room->thread->published++;
+	}
+}
+
+
+/* Everybody has their dice, so somebody calls. Calza needs a player without a
+ * full hand. */
+static void room_call(struct e2e_room *room)
+{
+	struct e2e_thread *t = room->thread;
+	struct e2e_client *caller;
+	int p;
+
+	p = (int)((unsigned int)rand_r(&t->rng_state) % (unsigned int)player_count);
+	while(room->clients[p].alive == false){
+		p = (p+1) % player_count;
+	}
+	caller = &room->clients[p];
+
+	room->dice_received = 0;
+	if(caller->dice < E2E_MAX_DICE && rand_r(&t->rng_state) % 4 == 0){
+		client_send(caller, "call-calza", true);
+	}else{
+		client_send(caller, "call-dudo", true);
+	}
+}
+
+
+static void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct e2e_client *client = obj;
+
+	if(rc){
+		client->room->thread->connect_failed++;
+		return;
+	}
+	mosquitto_subscribe(mosq, NULL, "tfdg/#", 0);
+	client_send(client, "login", false);
+}
+
+
+static void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	struct e2e_client *client = obj;
+	struct e2e_room *room = client->room;
+	struct e2e_thread *t = room->thread;
+	const char *cmd;
+	uint64_t now;
+	int player;
+
+	now = now_ns();
+	t->received++;
+
+	if(strncmp(msg->topic, room->prefix, room->prefix_len)){
+		return;
+	}
+	cmd = &msg->topic[room->prefix_len];
+	t->last_progress_ns = now;
+
+	if(client->sent_ns){
+		hist_record(&t->action, now - client->sent_ns);
+		client->sent_ns = 0;
+	}
+	if(client->broadcast_seen < room->broadcast_seq){
+		hist_record(&t->fanout, now - room->broadcast_ns);
+		client->broadcast_seen = room->broadcast_seq;
+	}
+
+	if(!strcmp(cmd, "lobby-players")){
+		if(client->index == 0 && room->started == false
+				&& payload_players(t, msg, NULL) == player_count){
+
+			room->started = true;
+			client_send(client, "start-game", true);
+		}
+	}else if(!strcmp(cmd, "pre-roll-init") || !strcmp(cmd, "pre-roll-results")
+			|| !strcmp(cmd, "round-loser")){
+
+		/* Clients see room messages in order but not in step with each
+		 * other, so the first client to see each round-loser counts it. */
+		if(!strcmp(cmd, "round-loser")){
+			client->losers_seen++;
+			if(client->losers_seen > room->losers_counted
+					&& payload_players(t, msg, &player) > 0){
+
+				room->losers_counted++;
+				room->clients[player].dice--;
+				if(room->clients[player].dice == 0){
+					room->clients[player].alive = false;
+					room->alive_count--;
+				}
+			}
+		}
+		if(client->alive){
+			client_send(client, "roll-dice", false);
+		}
+	}else if(!strncmp(cmd, "dice/", strlen("dice/"))){
+		room->dice_received++;
+		if(room->dice_received == room->alive_count){
+			room_call(room);
+		}
+	}else if(!strcmp(cmd, "dudo-candidates") || !strcmp(cmd, "calza-candidate")){
+		client->calls_seen++;
+		if(client->calls_seen > room->calls_answered
+				&& payload_players(t, msg, &player) > 0){
+
+			room->calls_answered++;
+			client_send(&room->clients[player], "i-lost", true);
+		}
+	}else if(!strcmp(cmd, "winner")){
+		if(room->done == false){
+			room->done = true;
+			t->rooms_done++;
+		}
+	}
+}
+
+
+static int client_connect(struct e2e_client *client)
+{
+	char topic[100];
+
+	client->mosq = mosquitto_new(client->id, true, client);
+	if(client->mosq == NULL){
+		return 1;
+	}
+	mosquitto_connect_callback_set(client->mosq, on_connect);
+	mosquitto_message_callback_set(client->mosq, on_message);
+
+	snprintf(topic, sizeof(topic), "%slogout", client->room->prefix);
+	mosquitto_will_set(client->mosq, topic, (int)strlen(client->payload), client->payload, 1, false);
+
+	return mosquitto_connect(client->mosq, E2E_HOST, port, 30);
+}
+
+
+static void *thread_main(void *arg)
+{
+	struct e2e_thread *t = arg;
+	struct e2e_client *client;
+	uint64_t last_misc = 0, now;
+	int nfds, i, r, p;
+
+	t->fds = calloc((size_t)(t->room_count*player_count), sizeof(struct pollfd));
+	t->fd_clients = calloc((size_t)(t->room_count*player_count), sizeof(struct e2e_client *));
+	if(t->fds == NULL || t->fd_clients == NULL){
+		atomic_store(&stop, true);
+		return NULL;
+	}
+
+	for(r=0; r<t->room_count; r++){
+		for(p=0; p<player_count; p++){
+			if(client_connect(&t->rooms[r].clients[p])){
+				t->connect_failed++;
+			}
+		}
+	}
+
+	t->last_progress_ns = now_ns();
+	while(t->rooms_done < t->room_count && atomic_load(&stop) == false){
+		nfds = 0;
+		for(r=0; r<t->room_count; r++){
+			for(p=0; p<player_count; p++){
+				client = &t->rooms[r].clients[p];
+				if(client->mosq == NULL || mosquitto_socket(client->mosq) < 0) continue;
+
+				t->fds[nfds].fd = mosquitto_socket(client->mosq);
+				t->fds[nfds].events = POLLIN;
+				if(mosquitto_want_write(client->mosq)){
+					t->fds[nfds].events |= POLLOUT;
+				}
+				t->fds[nfds].revents = 0;
+				t->fd_clients[nfds] = client;
+				nfds++;
+			}
+		}
+		if(nfds == 0) break;
+
+		if(poll(t->fds, (nfds_t)nfds, E2E_POLL_MS) < 0 && errno != EINTR){
+			break;
+		}
+		for(i=0; i<nfds; i++){
+			if(t->fds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+				mosquitto_loop_read(t->fd_clients[i]->mosq, 1);
+			}
+			if(t->fds[i].revents & POLLOUT){
+				mosquitto_loop_write(t->fd_clients[i]->mosq, 1);
+			}
+		}
+
+		now = now_ns();
+		if(now - last_misc > 1000000000ULL){
+			for(i=0; i<nfds; i++){
+				mosquitto_loop_misc(t->fd_clients[i]->mosq);
+			}
+			last_misc = now;
+		}
+		if(now - t->last_progress_ns > E2E_STALL_NS){
+			fprintf(stderr, "Warning: No room messages for %llus, giving up on %d rooms.\n",
+					E2E_STALL_NS/1000000000ULL, t->room_count - t->rooms_done);
+			break;
+		}
+	}
+
+	for(r=0; r<t->room_count; r++){
+		for(p=0; p<player_count; p++){
+			client = &t->rooms[r].clients[p];
+			if(client->mosq){
+				mosquitto_disconnect(client->mosq);
+				mosquitto_loop_write(client->mosq, 1);
+				mosquitto_destroy(client->mosq);
+				client->mosq = NULL;
+			}
+		}
+	}
+	free(t->fds);
+	free(t->fd_clients);
+	t->fds = NULL;
+	t->fd_clients = NULL;
+	return NULL;
+}
+
+/* ======================================================================/
+ *
+ * Broker
+ *
+ * ====================================================================== */
+
+static int write_broker_config(void)
+{
+	char plugin_real[PATH_MAX];
+	FILE *fptr;
+
+	if(realpath(plugin_path, plugin_real) == NULL){
+		fprintf(stderr, "Error: Unable to find plugin %s.\n", plugin_path);
+		return 1;
+	}
+	if(mkdtemp(tmp_dir) == NULL){
+		fprintf(stderr, "Error: Unable to create temporary directory.\n");
+		return 1;
+	}
+	snprintf(conf_path, sizeof(conf_path), "%s/mosquitto.conf", tmp_dir);
+	snprintf(state_path, sizeof(state_path), "%s/tfdg-state.json", tmp_dir);
+	snprintf(log_path, sizeof(log_path), "%s/tfdg.log", tmp_dir);
+
+	fptr = fopen(conf_path, "wt");
+	if(fptr == NULL){
+		fprintf(stderr, "Error: Unable to write %s.\n", conf_path);
+		return 1;
+	}
+	fprintf(fptr, "listener %d %s\n", port, E2E_HOST);
+	fprintf(fptr, "allow_anonymous true\n");
+	fprintf(fptr, "persistence false\n");
+	fprintf(fptr, "log_dest none\n");
+	fprintf(fptr, "max_queued_messages 10000\n");
+	fprintf(fptr, "plugin %s\n", plugin_real);
+	fprintf(fptr, "plugin_opt_state-file %s\n", state_path);
+	fprintf(fptr, "plugin_opt_log-file %s\n", log_path);
+	fprintf(fptr, "plugin_opt_rate-limit false\n");
+	fclose(fptr);
+
+	return 0;
+}
+
+
+static void remove_broker_files(void)
+{
+	remove(conf_path);
+	remove(state_path);
+	remove(log_path);
+	rmdir(tmp_dir);
+}
+
+
+static bool broker_listening(void)
+{
+	struct sockaddr_in addr;
+	int sock;
+	bool ok;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(sock < 0) return false;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)port);
+	inet_pton(AF_INET, E2E_HOST, &addr.sin_addr);
+	ok = (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	close(sock);
+	return ok;
+}
+
+
+static pid_t broker_start(void)
+{
+	pid_t pid;
+	int i;
+
+	if(broker_listening()){
+		fprintf(stderr, "Error: Port %d is already in use.\n", port);
+		return -1;
+	}
+
+	pid = fork();
+	if(pid == 0){
+		execlp(broker_path, broker_path, "-c", conf_path, (char *)NULL);
+		fprintf(stderr, "Error: Unable to run %s: %s\n", broker_path, strerror(errno));
+		_exit(1);
+	}else if(pid < 0){
+		return -1;
+	}
+
+	for(i=0; i<100; i++){
+		if(broker_listening()){
+			return pid;
+		}
+		if(waitpid(pid, NULL, WNOHANG) == pid){
+			fprintf(stderr, "Error: Broker exited on startup.\n");
+			return -1;
+		}
+		usleep(50000);
+	}
+	fprintf(stderr, "Error: Broker did not start listening on port %d.\n", port);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+
+/* Returns user+system CPU seconds used by a process */
+static double process_cpu_s(pid_t pid)
+{
+	char path[50];
+	char buf[1024];
+	unsigned long utime, stime;
+	FILE *fptr;
+	char *p;
+	size_t len;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fptr = fopen(path, "rt");
+	if(fptr == NULL) return 0.0;
+	len = fread(buf, 1, sizeof(buf)-1, fptr);
+	fclose(fptr);
+	buf[len] = '\0';
+
+	/* Skip past the command name, which may contain spaces */
+	p = strrchr(buf, ')');
+	if(p == NULL
+			|| sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2){
+
+		return 0.0;
+	}
+	return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+/* ======================================================================/
+ *
+ * Main
+ *
+ * ====================================================================== */
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: tfdg_e2e [-r rooms] [-P players] [-t threads] [-p port] [-b mosquitto] [-s plugin_tfdg.so]\n");
+}
+
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct e2e_thread *threads;
+	struct e2e_room *rooms;
+	struct e2e_client *clients;
+	struct e2e_histogram action, fanout;
+	long published = 0, received = 0, connect_failed = 0;
+	int rooms_done = 0;
+	double cpu_start, cpu_end, elapsed;
+	uint64_t start;
+	pid_t broker;
+	int opt, i, r, p;
+
+	while((opt = getopt(argc, argv, "r:P:t:p:b:s:")) != -1){
+		switch(opt){
+			case 'r':
+				room_count = atoi(optarg);
+				break;
+			case 'P':
+				player_count = atoi(optarg);
+				break;
+			case 't':
+				thread_count = atoi(optarg);
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'b':
+				broker_path = optarg;
+				break;
+			case 's':
+				plugin_path = optarg;
+				break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if(room_count < 1 || player_count < 2 || thread_count < 1 || port < 1 || port > 65535){
+		print_usage();
+		return 1;
+	}
+	if(thread_count > room_count){
+		thread_count = room_count;
+	}
+
+	threads = calloc((size_t)thread_count, sizeof(struct e2e_thread));
+	rooms = calloc((size_t)room_count, sizeof(struct e2e_room));
+	clients = calloc((size_t)room_count*(size_t)player_count, sizeof(struct e2e_client));
+	if(threads == NULL || rooms == NULL || clients == NULL){
+		fprintf(stderr, "Error: Out of memory.\n");
+		free(threads);
+		free(rooms);
+		free(clients);
+		return 1;
+	}
+
+	/* Rooms are split into contiguous blocks, one per thread */
+	for(i=0; i<thread_count; i++){
+		threads[i].rooms = &rooms[room_count*i/thread_count];
+		threads[i].room_count = room_count*(i+1)/thread_count - room_count*i/thread_count;
+		threads[i].rng_state = (unsigned int)i+1;
+		for(r=0; r<threads[i].room_count; r++){
+			threads[i].rooms[r].thread = &threads[i];
+		}
+	}
+	for(r=0; r<room_count; r++){
+		rooms[r].clients = &clients[r*player_count];
+		snprintf(rooms[r].prefix, sizeof(rooms[r].prefix), "tfdg/00000000-0000-0000-0000-%012d/", r);
+		rooms[r].prefix_len = strlen(rooms[r].prefix);
+		rooms[r].alive_count = player_count;
+		for(p=0; p<player_count; p++){
+			rooms[r].clients[p].room = &rooms[r];
+			rooms[r].clients[p].index = p;
+			rooms[r].clients[p].dice = E2E_MAX_DICE;
+			rooms[r].clients[p].alive = true;
+			snprintf(rooms[r].clients[p].id, sizeof(rooms[r].clients[p].id), "tfdg-e2e-%d-%d", r, p);
+			snprintf(rooms[r].clients[p].payload, sizeof(rooms[r].clients[p].payload),
+					"{\"name\":\"Player %d\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", p, p);
+		}
+	}
+
+	raise_fd_limit();
+	broker = -1;
+	if(write_broker_config() == 0){
+		broker = broker_start();
+	}
+	if(broker < 0){
+		remove_broker_files();
+		free(threads);
+		free(rooms);
+		free(clients);
+		return 1;
+	}
+
+	mosquitto_lib_init();
+	cpu_start = process_cpu_s(broker);
+	start = now_ns();
+
+	for(i=0; i<thread_count; i++){
+		if(pthread_create(&threads[i].thread, NULL, thread_main, &threads[i])){
+			fprintf(stderr, "Error: Unable to start client thread.\n");
+			atomic_store(&stop, true);
+			thread_count = i;
+			break;
+		}
+	}
+	memset(&action, 0, sizeof(action));
+	memset(&fanout, 0, sizeof(fanout));
+	for(i=0; i<thread_count; i++){
+		pthread_join(threads[i].thread, NULL);
+		hist_merge(&action, &threads[i].action);
+		hist_merge(&fanout, &threads[i].fanout);
+		published += threads[i].published;
+		received += threads[i].received;
+		connect_failed += threads[i].connect_failed;
+		rooms_done += threads[i].rooms_done;
+	}
+
+	elapsed = (double)(now_ns() - start)/1e9;
+	cpu_end = process_cpu_s(broker);
+
+	kill(broker, SIGTERM);
+	waitpid(broker, NULL, 0);
+	mosquitto_lib_cleanup();
+	remove_broker_files();
+
+	printf("e2e: %d rooms, %d players, %d client threads: %d/%d games in %.3fs",
+			room_count, player_count, thread_count, rooms_done, room_count, elapsed);
+	if(connect_failed){
+		printf(", %ld connections failed", connect_failed);
+	}
+	printf("\n");
+	printf("  %ld commands published, %.0f/s\n", published, (double)published/elapsed);
+	printf("  %ld messages delivered, %.0f/s\n", received, (double)received/elapsed);
+	printf("  broker cpu %.2fs, %.1f%% of one core, %.1fus/delivered message\n",
+			cpu_end - cpu_start, (cpu_end - cpu_start)*100.0/elapsed,
+			received ? (cpu_end - cpu_start)*1e6/(double)received : 0.0);
+	printf("  %-8s %9s %10s %10s %10s %10s %10s\n", "latency", "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	hist_print("action", &action);
+	hist_print("fan-out", &fanout);
+
+	free(threads);
+	free(rooms);
+	free(clients);
+
+	return rooms_done == room_count ? 0 : 1;
+}
@@ -0,0 +1,631 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* In-process load generator for the tfdg plugin.
+ *
+ * Rooms of players play complete games against the plugin as fast as
+ * possible: login, start-game, pre-roll, roll-dice, call-dudo/call-calza,
+ * i-lost, then logout and on to a new room. All rooms are stepped one command
+ * at a time in turn, so games are interleaved as they would be on a busy
+ * broker.
+ *
+ * Every room message the plugin publishes is queued, as the broker does, and
+ * once the command that caused it has returned it is delivered to each client
+ * in the room with a READ ACL check, as if they were all subscribed to
+ * tfdg/<room>/#. The latency of a command includes this fan-out.
+ *
+ * The allocator is replaced so that allocations made by the plugin on the
+ * broker thread can be counted. Plugin logging goes to /dev/null, results go
+ * to stderr.
+ */
+
+#define _GNU_SOURCE
+
+#include "plugin_tfdg.c"
+#include "tfdg_stubs.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_STATE_FILE "tfdg-load-state.json"
+#define LOAD_TOPIC_LEN 128
+#define LOAD_MAX_CANDIDATES 2
+#define LOAD_MAX_ROLL_PASSES 20
+#define LOAD_TICK_INTERVAL 1000
+
+enum load_command{
+	lc_login = 0,
+	lc_start_game = 1,
+	lc_roll_dice = 2,
+	lc_call_dudo = 3,
+	lc_call_calza = 4,
+	lc_i_lost = 5,
+	lc_logout = 6,
+	LC_COUNT
+};
+
+static const char *load_command_names[LC_COUNT] = {
+	"login", "start-game", "roll-dice", "call-dudo", "call-calza", "i-lost", "logout"
+};
+
+enum load_phase{
+	lp_login,
+	lp_start_game,
+	lp_roll,
+	lp_call,
+	lp_lost,
+	lp_logout,
+	lp_done
+};
+
+struct load_room{
+	struct stub_client *clients;
+	bool *alive;
+	int number; /* Used for the room uuid */
+	int games_left;
+	enum load_phase phase;
+	int cursor;
+	int passes;
+	int round_start;
+	int caller;
+	bool new_round;
+	bool game_over;
+	int candidates[LOAD_MAX_CANDIDATES];
+	int candidate_count;
+};
+
+struct load_message{
+	int room_number;
+	char topic[LOAD_TOPIC_LEN];
+	char *payload;
+	int payloadlen;
+};
+
+static struct load_room *rooms = NULL;
+static int room_count = 100;
+static int player_count = 6;
+static char (*payloads)[100] = NULL;
+
+static struct load_message *queue = NULL;
+static int queue_len = 0;
+static int queue_size = 0;
+
+static long read_checks = 0;
+static long fanout_dropped = 0;
+static long games_completed = 0;
+static long games_stuck = 0;
+static long rounds_played = 0;
+static long commands[LC_COUNT];
+static long command_allocs[LC_COUNT];
+static struct tfdg_histogram latency[LC_COUNT];
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* Allocator calls made on each thread, and on all threads. Only the broker
+ * thread's count is attributed to commands. */
+static _Thread_local long thread_allocs = 0;
+static atomic_long total_allocs = 0;
+
+/* ======================================================================/
+ *
+ * Allocator
+ *
+ * ====================================================================== */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	thread_allocs++;
+	atomic_fetch_add_explicit(&total_allocs, 1, memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+	thread_allocs++;
+	atomic_fetch_add_explicit(&total_allocs, 1, memory_order_relaxed);
+	return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+	thread_allocs++;
+	atomic_fetch_add_explicit(&total_allocs, 1, memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/* ======================================================================/
+ *
+ * Replacement functions
+ *
+ * ====================================================================== */
+
+/* Queue the message for delivery once the current callback has returned.
+ * Only room messages have subscribers. */
+static int load_publish(const char *client_id, const char *topic, int payloadlen, void *payload, bool retain)
+{
+	struct load_message *msg;
+
+	if(strncmp(topic, "tfdg/", 5) || strlen(topic) < 5+36
+			|| strlen(topic) >= LOAD_TOPIC_LEN || queue_len == queue_size){
+
+		if(!strncmp(topic, "tfdg/", 5) && queue_len == queue_size){
+			fanout_dropped++;
+		}
+		free(payload);
+		return 0;
+	}
+
+	msg = &queue[queue_len];
+	msg->room_number = atoi(&topic[5+24]);
+	strcpy(msg->topic, topic);
+	msg->payload = payload;
+	msg->payloadlen = payloadlen;
+	queue_len++;
+
+	return 0;
+}
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+static int load_random(int limit)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (int)(rng_state % (uint64_t)limit);
+}
+
+
+static struct load_room *room_for_number(int number)
+{
+	struct load_room *room;
+
+	room = &rooms[number % room_count];
+	if(room->number != number || room->phase == lp_done){
+		return NULL;
+	}
+	return room;
+}
+
+
+/* Find the next player uuid in a JSON payload and return the player number
+ * it was given, or -1. */
+static int find_player(const struct load_message *msg, const char **pos)
+{
+	const char *key = "\"uuid\":\"";
+	const char *end = msg->payload + msg->payloadlen;
+	const char *p;
+
+	p = memmem(*pos, (size_t)(end - *pos), key, strlen(key));
+	if(p == NULL || end - p < (long)strlen(key) + 36){
+		*pos = end;
+		return -1;
+	}
+	p += strlen(key);
+	*pos = p + 36;
+
+	return (int)strtol(&p[24], NULL, 10);
+}
+
+
+/* Watch the room messages for the things a client would react to. */
+static void load_observe(struct load_room *room, const struct load_message *msg)
+{
+	const char *suffix = &msg->topic[5+36];
+	const char *pos = msg->payload;
+	int player;
+
+	if(!strcmp(suffix, "/new-round")){
+		room->new_round = true;
+	}else if(!strcmp(suffix, "/dudo-candidates") || !strcmp(suffix, "/calza-candidate")){
+		room->candidate_count = 0;
+		while(room->candidate_count < LOAD_MAX_CANDIDATES){
+			player = find_player(msg, &pos);
+			if(player < 0) break;
+			if(player < player_count){
+				room->candidates[room->candidate_count++] = player;
+			}
+		}
+	}else if(!strcmp(suffix, "/player-lost")){
+		player = find_player(msg, &pos);
+		if(player >= 0 && player < player_count){
+			room->alive[player] = false;
+		}
+	}else if(!strcmp(suffix, "/winner")){
+		room->game_over = true;
+	}
+}
+
+
+/* Deliver queued messages to every client in their room. Delivery may queue
+ * more messages, so keep going until the queue is empty. */
+static void load_deliver(void)
+{
+	struct mosquitto_evt_acl_check ed;
+	struct load_message *msg;
+	struct load_room *room;
+	int i, p;
+
+	for(i=0; i<queue_len; i++){
+		msg = &queue[i];
+		room = room_for_number(msg->room_number);
+		if(room){
+			for(p=0; p<player_count; p++){
+				memset(&ed, 0, sizeof(ed));
+				ed.client = (struct mosquitto *)&room->clients[p];
+				ed.topic = msg->topic;
+				ed.payload = msg->payload;
+				ed.payloadlen = (uint32_t)msg->payloadlen;
+				ed.access = MOSQ_ACL_READ;
+				stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+				read_checks++;
+			}
+		}
+	}
+	for(i=0; i<queue_len; i++){
+		msg = &queue[i];
+		room = room_for_number(msg->room_number);
+		if(room && msg->payload){
+			load_observe(room, msg);
+		}
+		free(msg->payload);
+	}
+	queue_len = 0;
+}
+
+
+/* Send a command from one client, deliver what it published, and record how
+ * long that took and how many allocations it made. */
+static void load_command(struct load_room *room, int player, enum load_command cmd)
+{
+	struct mosquitto_evt_acl_check ed;
+	char topic[LOAD_TOPIC_LEN];
+	uint64_t start;
+	long allocs;
+
+	snprintf(topic, sizeof(topic), "tfdg/00000000-0000-0000-0000-%012d/%s",
+			room->number, load_command_names[cmd]);
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)&room->clients[player];
+	ed.topic = topic;
+	ed.payload = payloads[player];
+	ed.payloadlen = (uint32_t)strlen(payloads[player]);
+	ed.access = MOSQ_ACL_WRITE;
+
+	allocs = thread_allocs;
+	start = now_ns();
+	stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+	load_deliver();
+	hist_record(&latency[cmd], now_ns() - start);
+	command_allocs[cmd] += thread_allocs - allocs;
+	commands[cmd]++;
+}
+
+
+static void load_tick(void)
+{
+	struct mosquitto_evt_tick ed;
+
+	memset(&ed, 0, sizeof(ed));
+	stub_callbacks[MOSQ_EVT_TICK](MOSQ_EVT_TICK, &ed, NULL);
+	load_deliver();
+}
+
+
+static int random_alive_player(struct load_room *room)
+{
+	int p, i;
+
+	p = load_random(player_count);
+	for(i=0; i<player_count; i++){
+		if(room->alive[(p+i)%player_count]){
+			return (p+i)%player_count;
+		}
+	}
+	return 0;
+}
+
+
+static void room_next_game(struct load_room *room)
+{
+	int p;
+
+	room->games_left--;
+	if(room->games_left == 0){
+		room->phase = lp_done;
+		return;
+	}
+	room->number += room_count;
+	room->phase = lp_login;
+	room->cursor = 0;
+	room->game_over = false;
+	for(p=0; p<player_count; p++){
+		room->alive[p] = true;
+	}
+}
+
+
+/* Send the next command for a room, as the next client to act would. Returns
+ * false once the room has played all of its games. */
+static bool room_step(struct load_room *room)
+{
+	switch(room->phase){
+		case lp_login:
+			load_command(room, room->cursor, lc_login);
+			room->cursor++;
+			if(room->cursor == player_count){
+				room->phase = lp_start_game;
+			}
+			break;
+
+		case lp_start_game:
+			load_command(room, 0, lc_start_game);
+			room->phase = lp_roll;
+			room->cursor = 0;
+			room->passes = 0;
+			room->round_start = -1;
+			room->new_round = false;
+			break;
+
+		case lp_roll:
+			/* Everybody rolls until a round has started, then once more
+			 * around the table from the player whose roll started it. The
+			 * first passes are the pre-roll, which is repeated on a tie. */
+			if(room->alive[room->cursor]){
+				load_command(room, room->cursor, lc_roll_dice);
+			}
+			if(room->new_round && room->round_start < 0){
+				room->round_start = room->cursor;
+			}
+			room->cursor = (room->cursor+1) % player_count;
+			if(room->cursor == room->round_start){
+				room->phase = lp_call;
+				room->caller = random_alive_player(room);
+				room->candidate_count = 0;
+			}else if(room->cursor == 0 && room->round_start < 0
+					&& ++room->passes == LOAD_MAX_ROLL_PASSES){
+
+				games_stuck++;
+				room->phase = lp_logout;
+			}
+			break;
+
+		case lp_call:
+			/* Calza can't be called with a full hand, so fall back to dudo
+			 * if it is refused. */
+			if(load_random(4) == 0){
+				load_command(room, room->caller, lc_call_calza);
+				if(room->candidate_count == 0){
+					load_command(room, room->caller, lc_call_dudo);
+				}
+			}else{
+				load_command(room, room->caller, lc_call_dudo);
+			}
+			if(room->candidate_count == 0){
+				games_stuck++;
+				room->phase = lp_logout;
+				room->cursor = 0;
+			}else{
+				room->phase = lp_lost;
+			}
+			break;
+
+		case lp_lost:
+			load_command(room, room->candidates[load_random(room->candidate_count)], lc_i_lost);
+			rounds_played++;
+			room->cursor = 0;
+			if(room->game_over){
+				games_completed++;
+				room->phase = lp_logout;
+			}else{
+				room->phase = lp_roll;
+				room->passes = 0;
+				room->round_start = -1;
+				room->new_round = false;
+			}
+			break;
+
+		case lp_logout:
+			load_command(room, room->cursor, lc_logout);
+			room->cursor++;
+			if(room->cursor == player_count){
+				room_next_game(room);
+			}
+			break;
+
+		case lp_done:
+			return false;
+	}
+	return true;
+}
+
+
+static void load_plugin_init(void)
+{
+	struct mosquitto_opt opts[5];
+
+	opts[0].key = "state-file";
+	opts[0].value = LOAD_STATE_FILE;
+	opts[1].key = "cleanup-budget-us";
+	opts[1].value = "-1";
+	opts[2].key = "rng-seed";
+	opts[2].value = "tfdg-load";
+	opts[3].key = "rate-limit";
+	opts[3].value = "false";
+	opts[4].key = "sound-window-ms";
+	opts[4].value = "0";
+
+	unlink(LOAD_STATE_FILE);
+	memset(stub_callbacks, 0, sizeof(stub_callbacks));
+	stub_publish = load_publish;
+	mosquitto_plugin_init(NULL, NULL, opts, 5);
+}
+
+
+static void load_plugin_cleanup(void)
+{
+	mosquitto_plugin_cleanup(NULL, NULL, 0);
+	load_deliver();
+	unlink(LOAD_STATE_FILE);
+}
+
+
+static void load_report(double elapsed, long total_allocs_run)
+{
+	struct tfdg_histogram all;
+	long command_count = 0, alloc_count = 0;
+	int i;
+
+	memset(&all, 0, sizeof(all));
+	for(i=0; i<LC_COUNT; i++){
+		command_count += commands[i];
+		alloc_count += command_allocs[i];
+		hist_merge(&all, &latency[i]);
+	}
+
+	fprintf(stderr, "load: %d rooms, %d players: %ld games (%ld stuck), %ld rounds in %.3fs\n",
+			room_count, player_count, games_completed, games_stuck, rounds_played, elapsed);
+	fprintf(stderr, "  %ld commands, %.0f commands/s\n",
+			command_count, (double)command_count/elapsed);
+	fprintf(stderr, "  %ld ACL checks (%ld read), %.0f ACL checks/s, %.1f reads/command, %ld fan-out dropped\n",
+			command_count+read_checks, read_checks, (double)(command_count+read_checks)/elapsed,
+			(double)read_checks/(double)command_count, fanout_dropped);
+	fprintf(stderr, "  %.1f allocations/command on the broker thread, %.1f/command on all threads\n",
+			(double)alloc_count/(double)command_count, (double)total_allocs_run/(double)command_count);
+	fprintf(stderr, "  %-10s %9s %8s %8s %8s %8s %8s %8s\n",
+			"command", "count", "allocs", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+	for(i=0; i<LC_COUNT; i++){
+		if(commands[i] == 0) continue;
+		fprintf(stderr, "  %-10s %9ld %8.1f %8lu %8lu %8lu %8lu %8lu\n",
+				load_command_names[i], commands[i], (double)command_allocs[i]/(double)commands[i],
+				hist_percentile(&latency[i], 0.5), hist_percentile(&latency[i], 0.9),
+				hist_percentile(&latency[i], 0.99), hist_percentile(&latency[i], 0.999),
+				latency[i].max);
+	}
+	fprintf(stderr, "  %-10s %9ld %8.1f %8lu %8lu %8lu %8lu %8lu\n",
+			"all", command_count, (double)alloc_count/(double)command_count,
+			hist_percentile(&all, 0.5), hist_percentile(&all, 0.9),
+			hist_percentile(&all, 0.99), hist_percentile(&all, 0.999),
+			all.max);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int games_per_room = 10;
+	struct stub_client *clients;
+	bool *alive;
+	long steps = 0, allocs_start;
+	uint64_t start;
+	bool active;
+	int r, p;
+
+	if(argc > 1){
+		room_count = atoi(argv[1]);
+	}
+	if(argc > 2){
+		player_count = atoi(argv[2]);
+	}
+	if(argc > 3){
+		games_per_room = atoi(argv[3]);
+	}
+	if(room_count < 1 || player_count < 2 || games_per_room < 1){
+		fprintf(stderr, "Usage: tfdg_load [rooms [players [games-per-room]]]\n");
+		return 1;
+	}
+
+	if(freopen("/dev/null", "w", stdout) == NULL){
+		return 1;
+	}
+
+	rooms = calloc((size_t)room_count, sizeof(struct load_room));
+	clients = calloc((size_t)room_count*(size_t)player_count, sizeof(struct stub_client));
+	alive = calloc((size_t)room_count*(size_t)player_count, sizeof(bool));
+	payloads = calloc((size_t)player_count, sizeof(*payloads));
+	queue_size = 64 + 8*player_count;
+	queue = calloc((size_t)queue_size, sizeof(struct load_message));
+	if(rooms == NULL || clients == NULL || alive == NULL || payloads == NULL || queue == NULL){
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	for(p=0; p<player_count; p++){
+		snprintf(payloads[p], sizeof(payloads[p]),
+				"{\"name\":\"Player %d\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", p, p);
+	}
+	for(r=0; r<room_count; r++){
+		rooms[r].clients = &clients[r*player_count];
+		rooms[r].alive = &alive[r*player_count];
+		rooms[r].number = r;
+		rooms[r].games_left = games_per_room;
+		rooms[r].phase = lp_login;
+		for(p=0; p<player_count; p++){
+			rooms[r].alive[p] = true;
+			snprintf(rooms[r].clients[p].id, sizeof(rooms[r].clients[p].id), "load-client-%d-%d", r, p);
+		}
+	}
+
+	load_plugin_init();
+
+	allocs_start = atomic_load(&total_allocs);
+	start = now_ns();
+	do{
+		active = false;
+		for(r=0; r<room_count; r++){
+			if(room_step(&rooms[r])){
+				active = true;
+			}
+			if(++steps % LOAD_TICK_INTERVAL == 0){
+				load_tick();
+			}
+		}
+	}while(active);
+	load_tick();
+
+	load_report((double)(now_ns() - start)/1e9, atomic_load(&total_allocs) - allocs_start);
+
+	load_plugin_cleanup();
+
+	free(rooms);
+	free(clients);
+	free(alive);
+	free(payloads);
+	free(queue);
+
+	return 0;
+}
@@ -0,0 +1,484 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Micro-benchmarks for the individual parsing, validation and serialisation
+ * kernels of the tfdg plugin. The plugin source is included directly so its
+ * static functions can be called.
+ *
+ * Each kernel is run for enough iterations to take MICRO_SAMPLE_NS, and this
+ * is repeated MICRO_SAMPLES times. The median time per operation is reported,
+ * which is much steadier than the mean on a shared machine.
+ *
+ * Results are written as JSON to stdout, or to the file given with -o. With
+ * -b, results are compared against a previous results file and the exit code
+ * is 1 if any kernel is slower by more than the threshold given with -t, in
+ * percent. A summary goes to stderr.
+ */
+
+#include "plugin_tfdg.c"
+#include "tfdg_stubs.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+#define MICRO_STATE_FILE "tfdg-micro-state.json"
+#define MICRO_ROOM "00000000-0000-0000-0000-000000000001"
+#define MICRO_PLAYERS 6
+#define MICRO_SAMPLES 9
+#define MICRO_SAMPLE_NS 20000000ULL
+#define MICRO_DEFAULT_THRESHOLD 10.0
+
+struct micro_result{
+	char name[50];
+	long iterations;
+	double ns_per_op;
+	double min_ns_per_op;
+};
+
+static struct stub_client micro_clients[MICRO_PLAYERS];
+static char micro_payloads[MICRO_PLAYERS][100];
+static struct tfdg_room *micro_room = NULL;
+static struct micro_result *micro_results = NULL;
+static int micro_result_count = 0;
+static const char *micro_filter = NULL;
+static volatile long micro_sink = 0;
+
+/* ======================================================================/
+ *
+ * Kernels
+ *
+ * ====================================================================== */
+
+static void KERNEL_topic_tokenise(void)
+{
+	char *room, *cmd, *player;
+
+	tfdg_topic_tokenise(MICRO_ROOM "/roll-dice/00000000-0000-0000-0001-000000000003",
+			&room, &cmd, &player);
+	micro_sink += (long)(room != NULL);
+	free(room);
+	free(cmd);
+	free(player);
+}
+
+
+static void KERNEL_validate_uuid(void)
+{
+	micro_sink += validate_uuid("00000000-0000-0000-0001-000000000003");
+}
+
+
+static void KERNEL_json_parse_name_uuid(void)
+{
+	char *name, *uuid;
+
+	json_parse_name_uuid(micro_payloads[3], strlen(micro_payloads[3]), &name, &uuid);
+	micro_sink += (long)(name != NULL);
+	free(name);
+	free(uuid);
+}
+
+
+static void KERNEL_find_player_from_json(void)
+{
+	struct tfdg_player *player_s;
+
+	micro_sink += find_player_from_json(micro_payloads[3], strlen(micro_payloads[3]), micro_room, &player_s);
+}
+
+
+static void KERNEL_send_current_state(void)
+{
+	tfdg_send_current_state(micro_room, micro_room->seats[0]);
+}
+
+
+static void KERNEL_results_array(void)
+{
+	cJSON *array;
+
+	array = json_create_results_array(micro_room);
+	micro_sink += cJSON_GetArraySize(array);
+	cJSON_Delete(array);
+}
+
+
+static void KERNEL_summary_results(void)
+{
+	report_summary_results(micro_room, "summary-results");
+}
+
+
+static void KERNEL_save_full_state(void)
+{
+	save_full_state();
+}
+
+
+static void KERNEL_load_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	load_stats();
+}
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+static uint64_t micro_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+static uint64_t micro_time(void (*kernel)(void), long iterations)
+{
+	uint64_t start;
+	long i;
+
+	start = micro_now_ns();
+	for(i=0; i<iterations; i++){
+		kernel();
+	}
+	return micro_now_ns() - start;
+}
+
+
+static int double_cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+
+static void micro_run(const char *name, void (*kernel)(void))
+{
+	struct micro_result *result;
+	double samples[MICRO_SAMPLES];
+	long iterations = 1;
+	int i;
+
+	if(micro_filter && strstr(name, micro_filter) == NULL){
+		return;
+	}
+
+	/* Warm up and find an iteration count that fills a sample */
+	while(micro_time(kernel, iterations) < MICRO_SAMPLE_NS/4){
+		iterations *= 2;
+	}
+	iterations *= 4;
+
+	for(i=0; i<MICRO_SAMPLES; i++){
+		samples[i] = (double)micro_time(kernel, iterations) / (double)iterations;
+	}
+	qsort(samples, MICRO_SAMPLES, sizeof(double), double_cmp);
+
+	result = realloc(micro_results, sizeof(struct micro_result)*(size_t)(micro_result_count+1));
+	if(result == NULL) return;
+	micro_results = result;
+	result = &micro_results[micro_result_count];
+	micro_result_count++;
+
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->iterations = iterations;
+	result->ns_per_op = samples[MICRO_SAMPLES/2];
+	result->min_ns_per_op = samples[0];
+
+	fprintf(stderr, "%-28s %12.1f ns/op (min %.1f, %ld iterations)\n",
+			name, result->ns_per_op, result->min_ns_per_op, iterations);
+}
+
+
+static void micro_command(int player, const char *cmd)
+{
+	struct mosquitto_evt_acl_check ed;
+	char topic[200];
+
+	snprintf(topic, sizeof(topic), "tfdg/%s/%s", MICRO_ROOM, cmd);
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)&micro_clients[player];
+	ed.topic = topic;
+	ed.payload = micro_payloads[player];
+	ed.payloadlen = (uint32_t)strlen(micro_payloads[player]);
+	ed.access = MOSQ_ACL_WRITE;
+	stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+}
+
+
+/* Set up a room of MICRO_PLAYERS players part way through the first round,
+ * which is what most of the kernels work on. */
+static int micro_setup(void)
+{
+	struct mosquitto_opt opts[6];
+	int p, pass;
+
+	opts[0].key = "state-file";
+	opts[0].value = MICRO_STATE_FILE;
+	opts[1].key = "background-worker";
+	opts[1].value = "false";
+	opts[2].key = "log-level";
+	opts[2].value = "error";
+	opts[3].key = "rng-seed";
+	opts[3].value = "tfdg-micro";
+	opts[4].key = "rate-limit";
+	opts[4].value = "false";
+	opts[5].key = "sound-window-ms";
+	opts[5].value = "0";
+
+	unlink(MICRO_STATE_FILE);
+	if(mosquitto_plugin_init(NULL, NULL, opts, 6) != MOSQ_ERR_SUCCESS){
+		return 1;
+	}
+
+	for(p=0; p<MICRO_PLAYERS; p++){
+		snprintf(micro_clients[p].id, sizeof(micro_clients[p].id), "micro-client-%d", p);
+		snprintf(micro_payloads[p], sizeof(micro_payloads[p]),
+				"{\"name\":\"Player %d\",\"uuid\":\"00000000-0000-0000-0001-%012d\"}", p, p);
+		micro_command(p, "login");
+	}
+	micro_command(0, "start-game");
+
+	HASH_FIND(hh, room_by_uuid, MICRO_ROOM, (unsigned int)strlen(MICRO_ROOM), micro_room);
+	if(micro_room == NULL){
+		return 1;
+	}
+	for(pass=0; pass<20 && micro_room->state != tgs_playing_round; pass++){
+		for(p=0; p<MICRO_PLAYERS; p++){
+			micro_command(p, "roll-dice");
+		}
+	}
+	for(p=0; p<MICRO_PLAYERS; p++){
+		micro_command(p, "roll-dice");
+	}
+	if(micro_room->state != tgs_playing_round){
+		return 1;
+	}
+	return 0;
+}
+
+
+/* Grow the stats history to the given number of games. The records are made
+ * by the plugin, but given a duration so that load_stats() counts them. */
+static void micro_grow_history(int games)
+{
+	cJSON *j_result, *jtmp;
+
+	while(cJSON_GetArraySize(j_stats_games) < games){
+		add_room_to_stats(micro_room, "game-over");
+	}
+	cJSON_ArrayForEach(j_result, j_stats_games){
+		jtmp = cJSON_GetObjectItem(j_result, "duration");
+		if(jtmp){
+			cJSON_SetNumberValue(jtmp, 600);
+		}
+	}
+}
+
+
+static cJSON *micro_results_to_cjson(void)
+{
+	cJSON *tree, *array, *j_result, *jtmp;
+	int i;
+
+	tree = cJSON_CreateObject();
+	jtmp = cJSON_CreateNumber(MICRO_SAMPLES);
+	cJSON_AddItemToObject(tree, "samples", jtmp);
+
+	array = cJSON_CreateArray();
+	cJSON_AddItemToObject(tree, "benchmarks", array);
+	for(i=0; i<micro_result_count; i++){
+		j_result = cJSON_CreateObject();
+		cJSON_AddItemToArray(array, j_result);
+
+		jtmp = cJSON_CreateString(micro_results[i].name);
+		cJSON_AddItemToObject(j_result, "name", jtmp);
+		jtmp = cJSON_CreateNumber((double)micro_results[i].iterations);
+		cJSON_AddItemToObject(j_result, "iterations", jtmp);
+		jtmp = cJSON_CreateNumber(micro_results[i].ns_per_op);
+		cJSON_AddItemToObject(j_result, "ns_per_op", jtmp);
+		jtmp = cJSON_CreateNumber(micro_results[i].min_ns_per_op);
+		cJSON_AddItemToObject(j_result, "min_ns_per_op", jtmp);
+	}
+	return tree;
+}
+
+
+static char *micro_read_file(const char *path)
+{
+	FILE *fptr;
+	long len;
+	char *buf;
+
+	fptr = fopen(path, "rt");
+	if(fptr == NULL) return NULL;
+
+	fseek(fptr, 0, SEEK_END);
+	len = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+	buf = calloc(1, (size_t)len+1);
+	if(buf && fread(buf, 1, (size_t)len, fptr) != (size_t)len){
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fptr);
+	return buf;
+}
+
+
+/* Returns the number of kernels that are slower than the baseline by more than
+ * threshold percent, or -1 if the baseline can't be read. */
+static int micro_compare(const char *path, double threshold)
+{
+	cJSON *tree, *j_result, *j_name, *j_ns;
+	char *json_str;
+	double change;
+	int i, regressions = 0;
+
+	json_str = micro_read_file(path);
+	if(json_str == NULL){
+		fprintf(stderr, "Error: Unable to read baseline %s.\n", path);
+		return -1;
+	}
+	tree = cJSON_Parse(json_str);
+	free(json_str);
+	if(tree == NULL){
+		fprintf(stderr, "Error: Baseline %s is not valid JSON.\n", path);
+		return -1;
+	}
+
+	fprintf(stderr, "\nAgainst %s (threshold %.1f%%):\n", path, threshold);
+	for(i=0; i<micro_result_count; i++){
+		cJSON_ArrayForEach(j_result, cJSON_GetObjectItem(tree, "benchmarks")){
+			j_name = cJSON_GetObjectItem(j_result, "name");
+			j_ns = cJSON_GetObjectItem(j_result, "ns_per_op");
+			if(cJSON_IsString(j_name) && cJSON_IsNumber(j_ns) && j_ns->valuedouble > 0
+					&& !strcmp(j_name->valuestring, micro_results[i].name)){
+
+				change = (micro_results[i].ns_per_op - j_ns->valuedouble)*100.0/j_ns->valuedouble;
+				fprintf(stderr, "%-28s %12.1f -> %12.1f ns/op %+7.1f%%%s\n",
+						micro_results[i].name, j_ns->valuedouble, micro_results[i].ns_per_op,
+						change, change > threshold ? "  REGRESSION" : "");
+				if(change > threshold){
+					regressions++;
+				}
+				break;
+			}
+		}
+	}
+	cJSON_Delete(tree);
+	return regressions;
+}
+
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: tfdg_micro [-o results.json] [-b baseline.json] [-t threshold-percent] [-f filter]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const int history_sizes[] = {0, 1000, 10000};
+	const char *output = NULL, *baseline = NULL;
+	double threshold = MICRO_DEFAULT_THRESHOLD;
+	char name[50];
+	char *json_str;
+	cJSON *tree;
+	FILE *fptr;
+	int opt, i, rc = 0;
+
+	while((opt = getopt(argc, argv, "o:b:t:f:")) != -1){
+		switch(opt){
+			case 'o':
+				output = optarg;
+				break;
+			case 'b':
+				baseline = optarg;
+				break;
+			case 't':
+				threshold = atof(optarg);
+				break;
+			case 'f':
+				micro_filter = optarg;
+				break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+
+	if(micro_setup()){
+		fprintf(stderr, "Error: Unable to set up the benchmark room.\n");
+		return 1;
+	}
+
+	micro_run("topic_tokenise", KERNEL_topic_tokenise);
+	micro_run("validate_uuid", KERNEL_validate_uuid);
+	micro_run("json_parse_name_uuid", KERNEL_json_parse_name_uuid);
+	micro_run("find_player_from_json", KERNEL_find_player_from_json);
+	micro_run("send_current_state", KERNEL_send_current_state);
+	micro_run("json_create_results_array", KERNEL_results_array);
+	micro_run("report_summary_results", KERNEL_summary_results);
+	for(i=0; i<(int)(sizeof(history_sizes)/sizeof(history_sizes[0])); i++){
+		micro_grow_history(history_sizes[i]);
+		snprintf(name, sizeof(name), "save_full_state/%d", history_sizes[i]);
+		micro_run(name, KERNEL_save_full_state);
+		snprintf(name, sizeof(name), "load_stats/%d", history_sizes[i]);
+		micro_run(name, KERNEL_load_stats);
+	}
+
+	mosquitto_plugin_cleanup(NULL, NULL, 0);
+	unlink(MICRO_STATE_FILE);
+
+	tree = micro_results_to_cjson();
+	json_str = cJSON_Print(tree);
+	cJSON_Delete(tree);
+	if(json_str == NULL){
+		free(micro_results);
+		return 1;
+	}
+	if(output){
+		fptr = fopen(output, "wt");
+		if(fptr == NULL){
+			fprintf(stderr, "Error: Unable to write %s.\n", output);
+			rc = 1;
+		}else{
+			fprintf(fptr, "%s\n", json_str);
+			fclose(fptr);
+		}
+	}else{
+		printf("%s\n", json_str);
+	}
+	free(json_str);
+
+	if(baseline){
+		i = micro_compare(baseline, threshold);
+		if(i != 0){
+			rc = 1;
+		}
+	}
+
+	free(micro_results);
+	return rc;
+}
@@ -0,0 +1,752 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Replay a capture made with the plugin's capture-file option back into the
+ * plugin, in-process.
+ *
+ * By default commands are sent at the pace they were recorded, optionally
+ * sped up with -x. With -m they are sent as fast as possible. Ticks are sent
+ * every REPLAY_TICK_MS of recorded time in both cases, so the interleaving of
+ * commands and ticks is the same, although room expiry still follows the
+ * wall clock.
+ *
+ * Every room message the plugin publishes is delivered with a READ ACL check
+ * to each client that last sent a command to that room, on tfdg/ or tfdgc/
+ * depending on the encoding it logged in with. The latency of a command
+ * includes this fan-out. Messages for a single client aren't ACL checked by
+ * the broker, so they are only counted.
+ *
+ * The capture header holds the rng-seed the plugin was running with, and
+ * each seeded room's nonce is recorded when it is created. If the seed was
+ * set, the replay is deterministic and the fingerprint of everything
+ * published can be compared between builds. The plugin starts with no rooms,
+ * or with the state file given with -i, which should be the one the captured
+ * broker started with.
+ *
+ * Plugin logging goes to /dev/null, results go to stderr.
+ */
+
+#define _GNU_SOURCE
+
+#include "plugin_tfdg.c"
+#include "tfdg_stubs.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_STATE_FILE "tfdg-replay-state.json"
+#define REPLAY_TICK_MS 100
+
+/* The plugin's commands, plus anything it doesn't recognise */
+static const char *replay_command_names[] = {
+	"login", "logout", "start-game", "new-name", "roll-dice", "call-dudo",
+	"call-calza", "i-lost", "i-won", "undo-loser", "undo-winner",
+	"leave-game", "kick-player", "reset-game", "set-option", "snd-higher",
+	"snd-exact", "other", "disconnect"
+};
+#define RC_COUNT ((int)(sizeof(replay_command_names)/sizeof(replay_command_names[0])))
+#define RC_OTHER (RC_COUNT-2)
+#define RC_DISCONNECT (RC_COUNT-1)
+
+struct replay_room;
+
+struct replay_client{
+	UT_hash_handle hh;
+	struct replay_client *next, *prev; /* members of room */
+	struct replay_room *room;
+	char *id;
+	bool compact;
+};
+
+struct replay_room{
+	UT_hash_handle hh;
+	struct replay_client *members;
+	char *uuid;
+};
+
+struct replay_record{
+	struct replay_client *client;
+	struct replay_room *room;
+	char *topic;
+	const char *payload;
+	uint64_t time_ns;
+	uint64_t rng_nonce; /* for a room this command creates */
+	uint32_t payloadlen;
+	int command;
+};
+
+struct replay_message{
+	char *topic;
+	char *payload;
+	int payloadlen;
+};
+
+static struct replay_client *clients = NULL;
+static struct replay_room *rooms = NULL;
+static struct replay_record *records = NULL;
+static long record_count = 0;
+static char *capture = NULL;
+static char *capture_seed = NULL;
+
+static struct replay_message *queue = NULL;
+static int queue_len = 0;
+static int queue_size = 0;
+
+static long read_checks = 0;
+static uint64_t fingerprint = 0xcbf29ce484222325ULL; /* FNV-1a */
+static long commands[RC_COUNT];
+static struct tfdg_histogram latency[RC_COUNT];
+
+/* ======================================================================/
+ *
+ * Replacement functions
+ *
+ * ====================================================================== */
+
+static const char *replay_client_id(const struct mosquitto *client)
+{
+	return ((const struct replay_client *)client)->id;
+}
+
+
+static void fingerprint_add(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for(i=0; i<len; i++){
+		fingerprint ^= p[i];
+		fingerprint *= 0x100000001b3ULL;
+	}
+}
+
+
+static int replay_publish(const char *client_id, const char *topic, int payloadlen, void *payload, bool retain)
+{
+	struct replay_message *msg;
+
+	fingerprint_add(topic, strlen(topic)+1);
+	if(payload){
+		fingerprint_add(payload, (size_t)payloadlen);
+	}
+	if(client_id){
+		free(payload);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(queue_len == queue_size){
+		msg = realloc(queue, sizeof(struct replay_message)*(size_t)(queue_size ? queue_size*2 : 64));
+		if(msg == NULL){
+			free(payload);
+			return MOSQ_ERR_NOMEM;
+		}
+		queue = msg;
+		queue_size = queue_size ? queue_size*2 : 64;
+	}
+	msg = &queue[queue_len];
+	msg->topic = strdup(topic);
+	if(msg->topic == NULL){
+		free(payload);
+		return MOSQ_ERR_NOMEM;
+	}
+	msg->payload = payload;
+	msg->payloadlen = payloadlen;
+	queue_len++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+static void sleep_until_ns(uint64_t target)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(target / 1000000000);
+	ts.tv_nsec = (long)(target % 1000000000);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0){
+	}
+}
+
+
+static struct replay_client *client_get(const char *id, size_t len)
+{
+	struct replay_client *client;
+
+	HASH_FIND(hh, clients, id, (unsigned)len, client);
+	if(client == NULL){
+		client = calloc(1, sizeof(struct replay_client));
+		if(client == NULL) return NULL;
+		client->id = strndup(id, len);
+		if(client->id == NULL){
+			free(client);
+			return NULL;
+		}
+		HASH_ADD_KEYPTR(hh, clients, client->id, (unsigned)len, client);
+	}
+	return client;
+}
+
+
+static struct replay_room *room_get(const char *uuid, size_t len)
+{
+	struct replay_room *room;
+
+	HASH_FIND(hh, rooms, uuid, (unsigned)len, room);
+	if(room == NULL){
+		room = calloc(1, sizeof(struct replay_room));
+		if(room == NULL) return NULL;
+		room->uuid = strndup(uuid, len);
+		if(room->uuid == NULL){
+			free(room);
+			return NULL;
+		}
+		HASH_ADD_KEYPTR(hh, rooms, room->uuid, (unsigned)len, room);
+	}
+	return room;
+}
+
+
+/* Return the room segment of a tfdg/ or tfdgc/ topic, or NULL */
+static const char *topic_room(const char *topic, size_t *len)
+{
+	const char *room, *end;
+
+	if(!strncmp(topic, "tfdg/", 5)){
+		room = topic+5;
+	}else if(!strncmp(topic, "tfdgc/", 6)){
+		room = topic+6;
+	}else{
+		return NULL;
+	}
+	end = strchr(room, '/');
+	if(end == NULL){
+		return NULL;
+	}
+	*len = (size_t)(end - room);
+	return room;
+}
+
+
+static int topic_command(const char *topic)
+{
+	const char *cmd;
+	size_t len;
+	int i;
+
+	cmd = topic_room(topic, &len);
+	if(cmd == NULL){
+		return RC_OTHER;
+	}
+	cmd += len+1;
+	len = strcspn(cmd, "/");
+	for(i=0; i<RC_OTHER; i++){
+		if(strlen(replay_command_names[i]) == len && !strncmp(cmd, replay_command_names[i], len)){
+			return i;
+		}
+	}
+	return RC_OTHER;
+}
+
+/* ======================================================================/
+ *
+ * Capture loading
+ *
+ * ====================================================================== */
+
+static bool capture_take(const char **pos, const char *end, void *dest, size_t len)
+{
+	if((size_t)(end - *pos) < len){
+		return false;
+	}
+	memcpy(dest, *pos, len);
+	*pos += len;
+	return true;
+}
+
+
+/* Read the whole capture into memory and index it, so that neither disk
+ * reads nor parsing are part of the replay. The record payloads point into
+ * the capture buffer. */
+static int capture_load(const char *path)
+{
+	FILE *fptr;
+	long size;
+	const char *pos, *end;
+	struct replay_record *rec;
+	size_t room_len;
+	const char *room;
+	uint64_t time_ns, rng_nonce = 0;
+	uint32_t payloadlen;
+	uint16_t seed_len, client_id_len, topic_len;
+	uint8_t type;
+	long alloc = 0;
+
+	fptr = fopen(path, "rb");
+	if(fptr == NULL){
+		fprintf(stderr, "Error: Unable to open %s.\n", path);
+		return 1;
+	}
+	fseek(fptr, 0, SEEK_END);
+	size = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+	capture = malloc((size_t)size + 1);
+	if(capture == NULL || fread(capture, 1, (size_t)size, fptr) != (size_t)size){
+		fprintf(stderr, "Error: Unable to read %s.\n", path);
+		fclose(fptr);
+		return 1;
+	}
+	fclose(fptr);
+
+	pos = capture;
+	end = capture + size;
+	if(size < (long)strlen(CAPTURE_MAGIC) || memcmp(pos, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))){
+		fprintf(stderr, "Error: %s is not a tfdg capture.\n", path);
+		return 1;
+	}
+	pos += strlen(CAPTURE_MAGIC);
+	if(!capture_take(&pos, end, &seed_len, sizeof(seed_len)) || end - pos < seed_len){
+		fprintf(stderr, "Error: %s is truncated.\n", path);
+		return 1;
+	}
+	if(seed_len){
+		capture_seed = strndup(pos, seed_len);
+		pos += seed_len;
+	}
+
+	while(pos < end){
+		if(!capture_take(&pos, end, &type, sizeof(type))
+				|| !capture_take(&pos, end, &time_ns, sizeof(time_ns))
+				|| !capture_take(&pos, end, &client_id_len, sizeof(client_id_len))
+				|| !capture_take(&pos, end, &topic_len, sizeof(topic_len))
+				|| !capture_take(&pos, end, &payloadlen, sizeof(payloadlen))
+				|| (size_t)(end - pos) < (size_t)client_id_len + topic_len + payloadlen){
+
+			/* A broker that was killed may have left a partial record */
+			fprintf(stderr, "Warning: %s has a truncated record, ignoring the rest.\n", path);
+			break;
+		}
+
+		/* Written while the command that created the room was handled, so
+		 * before the command's own record */
+		if(type == tct_rng_nonce){
+			pos += client_id_len + topic_len;
+			if(payloadlen == sizeof(rng_nonce)){
+				memcpy(&rng_nonce, pos, sizeof(rng_nonce));
+			}
+			pos += payloadlen;
+			continue;
+		}
+
+		if(record_count == alloc){
+			alloc = alloc ? alloc*2 : 4096;
+			rec = realloc(records, sizeof(struct replay_record)*(size_t)alloc);
+			if(rec == NULL){
+				fprintf(stderr, "Error: Out of memory.\n");
+				return 1;
+			}
+			records = rec;
+		}
+		rec = &records[record_count];
+		memset(rec, 0, sizeof(struct replay_record));
+		rec->time_ns = time_ns;
+		rec->rng_nonce = rng_nonce;
+		rng_nonce = 0;
+		rec->client = client_get(pos, client_id_len);
+		pos += client_id_len;
+		rec->topic = strndup(pos, topic_len);
+		pos += topic_len;
+		rec->payload = pos;
+		rec->payloadlen = payloadlen;
+		pos += payloadlen;
+		if(rec->client == NULL || rec->topic == NULL){
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+
+		if(type == tct_disconnect){
+			rec->command = RC_DISCONNECT;
+		}else{
+			rec->command = topic_command(rec->topic);
+			room = topic_room(rec->topic, &room_len);
+			if(room){
+				rec->room = room_get(room, room_len);
+			}
+			if(rec->command == 0 && memmem(rec->payload, rec->payloadlen, "\"cbor\"", strlen("\"cbor\""))){
+				rec->client->compact = true;
+			}
+		}
+		record_count++;
+	}
+	return 0;
+}
+
+
+static void capture_free(void)
+{
+	struct replay_client *client, *client_tmp;
+	struct replay_room *room, *room_tmp;
+	long i;
+
+	for(i=0; i<record_count; i++){
+		free(records[i].topic);
+	}
+	free(records);
+	records = NULL;
+	record_count = 0;
+	HASH_ITER(hh, clients, client, client_tmp){
+		HASH_DELETE(hh, clients, client);
+		free(client->id);
+		free(client);
+	}
+	HASH_ITER(hh, rooms, room, room_tmp){
+		HASH_DELETE(hh, rooms, room);
+		free(room->uuid);
+		free(room);
+	}
+	free(capture);
+	capture = NULL;
+	free(capture_seed);
+	capture_seed = NULL;
+	free(queue);
+	queue = NULL;
+	queue_size = 0;
+}
+
+/* ======================================================================/
+ *
+ * Replay
+ *
+ * ====================================================================== */
+
+/* Deliver queued messages to every client in their room. Delivery may queue
+ * more messages, so keep going until the queue is empty. */
+static void replay_deliver(void)
+{
+	struct mosquitto_evt_acl_check ed;
+	struct replay_message *msg;
+	struct replay_room *room;
+	struct replay_client *client;
+	const char *uuid;
+	size_t len;
+	bool compact;
+	int i;
+
+	for(i=0; i<queue_len; i++){
+		msg = &queue[i];
+		uuid = topic_room(msg->topic, &len);
+		room = NULL;
+		if(uuid){
+			HASH_FIND(hh, rooms, uuid, (unsigned)len, room);
+		}
+		if(room){
+			compact = !strncmp(msg->topic, "tfdgc/", 6);
+			DL_FOREACH(room->members, client){
+				if(client->compact != compact) continue;
+
+				memset(&ed, 0, sizeof(ed));
+				ed.client = (struct mosquitto *)client;
+				ed.topic = msg->topic;
+				ed.payload = msg->payload;
+				ed.payloadlen = (uint32_t)msg->payloadlen;
+				ed.access = MOSQ_ACL_READ;
+				stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+				read_checks++;
+			}
+		}
+	}
+	for(i=0; i<queue_len; i++){
+		free(queue[i].topic);
+		free(queue[i].payload);
+	}
+	queue_len = 0;
+}
+
+
+static void replay_tick(void)
+{
+	struct mosquitto_evt_tick ed;
+
+	memset(&ed, 0, sizeof(ed));
+	stub_callbacks[MOSQ_EVT_TICK](MOSQ_EVT_TICK, &ed, NULL);
+	replay_deliver();
+}
+
+
+/* Clients are members of the room they last sent a command to, until they
+ * disconnect. */
+static void replay_record(const struct replay_record *rec)
+{
+	struct mosquitto_evt_acl_check ed;
+	struct mosquitto_evt_disconnect de;
+	struct replay_client *client = rec->client;
+	uint64_t start;
+
+	if(rec->command == RC_DISCONNECT){
+		if(client->room){
+			DL_DELETE(client->room->members, client);
+			client->room = NULL;
+		}
+		memset(&de, 0, sizeof(de));
+		de.client = (struct mosquitto *)client;
+		start = now_ns();
+		stub_callbacks[MOSQ_EVT_DISCONNECT](MOSQ_EVT_DISCONNECT, &de, NULL);
+	}else{
+		if(rec->room && client->room != rec->room){
+			if(client->room){
+				DL_DELETE(client->room->members, client);
+			}
+			DL_APPEND(rec->room->members, client);
+			client->room = rec->room;
+		}
+		memset(&ed, 0, sizeof(ed));
+		ed.client = (struct mosquitto *)client;
+		ed.topic = rec->topic;
+		ed.payload = rec->payload;
+		ed.payloadlen = rec->payloadlen;
+		ed.access = MOSQ_ACL_WRITE;
+		rng_nonce_next = rec->rng_nonce;
+		start = now_ns();
+		stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+		rng_nonce_next = 0;
+	}
+	replay_deliver();
+	hist_record(&latency[rec->command], now_ns() - start);
+	commands[rec->command]++;
+}
+
+
+/* Returns the largest amount the replay fell behind the recorded pace */
+static uint64_t replay_run(bool max_speed, double speed)
+{
+	uint64_t start, target, next_tick, lag, max_lag = 0;
+	uint64_t tick_ns = REPLAY_TICK_MS*1000000ULL;
+	uint64_t first;
+	long i;
+
+	if(record_count == 0) return 0;
+
+	first = records[0].time_ns;
+	next_tick = tick_ns;
+	start = now_ns();
+	for(i=0; i<record_count; i++){
+		while(records[i].time_ns - first >= next_tick){
+			if(!max_speed){
+				sleep_until_ns(start + (uint64_t)((double)next_tick/speed));
+			}
+			replay_tick();
+			next_tick += tick_ns;
+		}
+		if(!max_speed){
+			target = start + (uint64_t)((double)(records[i].time_ns - first)/speed);
+			if(now_ns() < target){
+				sleep_until_ns(target);
+			}else{
+				lag = now_ns() - target;
+				if(lag > max_lag){
+					max_lag = lag;
+				}
+			}
+		}
+		replay_record(&records[i]);
+	}
+	replay_tick();
+	return max_lag;
+}
+
+
+static int replay_plugin_init(const char *initial_state)
+{
+	struct mosquitto_opt opts[4];
+	FILE *src, *dest;
+	char buf[4096];
+	size_t len;
+	int opt_count = 3;
+
+	/* Commands the rate limits or the sound window dropped aren't in the
+	 * capture, and replay runs faster than real time, so both are off */
+	opts[0].key = "state-file";
+	opts[0].value = REPLAY_STATE_FILE;
+	opts[1].key = "rate-limit";
+	opts[1].value = "false";
+	opts[2].key = "sound-window-ms";
+	opts[2].value = "0";
+	if(capture_seed){
+		opts[3].key = "rng-seed";
+		opts[3].value = capture_seed;
+		opt_count++;
+	}
+
+	unlink(REPLAY_STATE_FILE);
+	if(initial_state){
+		/* Copied, because the plugin overwrites its state file */
+		src = fopen(initial_state, "rb");
+		if(src == NULL){
+			fprintf(stderr, "Error: Unable to open %s.\n", initial_state);
+			return 1;
+		}
+		dest = fopen(REPLAY_STATE_FILE, "wb");
+		if(dest == NULL){
+			fclose(src);
+			fprintf(stderr, "Error: Unable to write %s.\n", REPLAY_STATE_FILE);
+			return 1;
+		}
+		while((len = fread(buf, 1, sizeof(buf), src)) > 0){
+			fwrite(buf, 1, len, dest);
+		}
+		fclose(src);
+		fclose(dest);
+	}
+
+	memset(stub_callbacks, 0, sizeof(stub_callbacks));
+	stub_client_id = replay_client_id;
+	stub_publish = replay_publish;
+	if(mosquitto_plugin_init(NULL, NULL, opts, opt_count)){
+		fprintf(stderr, "Error: Plugin init failed.\n");
+		return 1;
+	}
+	replay_deliver();
+	return 0;
+}
+
+
+static void replay_plugin_cleanup(void)
+{
+	mosquitto_plugin_cleanup(NULL, NULL, 0);
+	replay_deliver();
+	unlink(REPLAY_STATE_FILE);
+}
+
+
+static void replay_report(double elapsed, bool max_speed, double speed, uint64_t max_lag)
+{
+	struct tfdg_histogram all;
+	long command_count = 0;
+	double span;
+	int i;
+
+	memset(&all, 0, sizeof(all));
+	for(i=0; i<RC_COUNT; i++){
+		command_count += commands[i];
+		hist_merge(&all, &latency[i]);
+	}
+	span = (double)(records[record_count-1].time_ns - records[0].time_ns)/1e9;
+
+	fprintf(stderr, "replay: %ld records, %d clients, %d rooms, %.1fs recorded, %s\n",
+			record_count, HASH_CNT(hh, clients), HASH_CNT(hh, rooms), span,
+			capture_seed ? "deterministic" : "not deterministic (no rng-seed)");
+	if(max_speed){
+		fprintf(stderr, "  max speed: %.3fs, %.0f commands/s, %.1fx recorded pace\n",
+				elapsed, (double)command_count/elapsed, elapsed > 0 ? span/elapsed : 0.0);
+	}else{
+		fprintf(stderr, "  %.1fx recorded pace: %.3fs, %.0f commands/s, fell behind by up to %.3fms\n",
+				speed, elapsed, (double)command_count/elapsed, (double)max_lag/1e6);
+	}
+	fprintf(stderr, "  %ld publishes (%ld bytes), %ld READ ACL checks, fingerprint %016lx\n",
+			stub_publish_count, stub_publish_bytes, read_checks, fingerprint);
+	fprintf(stderr, "  %-10s %9s %8s %8s %8s %8s %8s\n",
+			"command", "count", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+	for(i=0; i<RC_COUNT; i++){
+		if(commands[i] == 0) continue;
+		fprintf(stderr, "  %-10s %9ld %8lu %8lu %8lu %8lu %8lu\n",
+				replay_command_names[i], commands[i],
+				hist_percentile(&latency[i], 0.5), hist_percentile(&latency[i], 0.9),
+				hist_percentile(&latency[i], 0.99), hist_percentile(&latency[i], 0.999),
+				latency[i].max);
+	}
+	fprintf(stderr, "  %-10s %9ld %8lu %8lu %8lu %8lu %8lu\n",
+			"all", command_count,
+			hist_percentile(&all, 0.5), hist_percentile(&all, 0.9),
+			hist_percentile(&all, 0.99), hist_percentile(&all, 0.999),
+			all.max);
+}
+
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: tfdg_replay [-m] [-x speed] [-i initial-state.json] capture-file\n");
+	fprintf(stderr, "  -m  replay as fast as possible instead of at the recorded pace\n");
+	fprintf(stderr, "  -x  multiply the recorded pace by speed\n");
+	fprintf(stderr, "  -i  state file to start the plugin with\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *initial_state = NULL;
+	bool max_speed = false;
+	double speed = 1.0;
+	uint64_t start, max_lag;
+	double elapsed;
+	int opt;
+
+	while((opt = getopt(argc, argv, "mx:i:")) != -1){
+		switch(opt){
+			case 'm':
+				max_speed = true;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 'i':
+				initial_state = optarg;
+				break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if(optind != argc-1 || speed <= 0){
+		print_usage();
+		return 1;
+	}
+
+	if(capture_load(argv[optind])){
+		capture_free();
+		return 1;
+	}
+	if(record_count == 0){
+		fprintf(stderr, "Error: %s has no records.\n", argv[optind]);
+		capture_free();
+		return 1;
+	}
+
+	if(freopen("/dev/null", "w", stdout) == NULL){
+		capture_free();
+		return 1;
+	}
+
+	if(replay_plugin_init(initial_state)){
+		capture_free();
+		return 1;
+	}
+	start = now_ns();
+	max_lag = replay_run(max_speed, speed);
+	elapsed = (double)(now_ns() - start)/1e9;
+	replay_plugin_cleanup();
+
+	replay_report(elapsed, max_speed, speed, max_lag);
+	capture_free();
+
+	return 0;
+}
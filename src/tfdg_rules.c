@@ -0,0 +1,642 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Scripted game rule tests for the tfdg plugin. The plugin source is
+ * included directly so its state can be checked.
+ *
+ * Each test plays a short scripted game in its own room through the real
+ * ACL callback, then checks the room and player state the rule is about.
+ * At the end every room is cleaned up and the pools must be empty.
+ *
+ * Run with "make rules", or tfdg_rules. The exit status is non-zero if any
+ * check failed.
+ */
+
+#include "plugin_tfdg.c"
+#include "tfdg_stubs.h"
+
+#include <unistd.h>
+
+#define RULES_STATE_FILE "tfdg-rules-state.json"
+#define RULES_MAX_PUBLISHES 32
+
+static char rules_room[UUIDLEN+1];
+static int rules_room_count = 0;
+static const char *rules_test = "";
+static long rules_checks = 0;
+static long rules_failures = 0;
+static char rules_topics[RULES_MAX_PUBLISHES][200];
+static int rules_topic_count = 0;
+
+/* ======================================================================/
+ *
+ * Replacement functions
+ *
+ * ====================================================================== */
+
+/* Record the topic so tests can check what a command published */
+static int rules_publish(const char *client_id, const char *topic, int payloadlen, void *payload, bool retain)
+{
+	if(rules_topic_count < RULES_MAX_PUBLISHES){
+		snprintf(rules_topics[rules_topic_count], sizeof(rules_topics[0]), "%s", topic);
+		rules_topic_count++;
+	}
+	free(payload);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+#define RULES_CHECK(cond) rules_check((cond), #cond, __LINE__)
+
+static void rules_check(bool ok, const char *what, int line)
+{
+	rules_checks++;
+	if(ok == false){
+		rules_failures++;
+		fprintf(stderr, "tfdg_rules: %s: line %d: %s\n", rules_test, line, what);
+	}
+}
+
+
+static void rules_uuid(char *buf, int n)
+{
+	snprintf(buf, UUIDLEN+1, "00000000-0000-0000-0000-%012d", n);
+}
+
+
+/* Send a command to the current room from the client of player n. The
+ * payload defaults to player n's name and uuid. */
+static void rules_send(int n, const char *cmd, const char *payload)
+{
+	struct mosquitto_evt_acl_check ed;
+	struct stub_client client;
+	char topic[100];
+	char uuid[UUIDLEN+1];
+	char buf[200];
+
+	if(payload == NULL){
+		rules_uuid(uuid, n);
+		snprintf(buf, sizeof(buf), "{\"name\":\"Player %d\",\"uuid\":\"%s\"}", n, uuid);
+		payload = buf;
+	}
+	snprintf(client.id, sizeof(client.id), "rules-%d", n);
+	snprintf(topic, sizeof(topic), "tfdg/%s/%s", rules_room, cmd);
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)&client;
+	ed.topic = topic;
+	ed.payload = payload;
+	ed.payloadlen = (uint32_t)strlen(payload);
+	ed.access = MOSQ_ACL_WRITE;
+
+	rules_topic_count = 0;
+	stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+}
+
+
+/* Player n sends cmd naming player target, as for kick-player */
+static void rules_send_target(int n, const char *cmd, int target)
+{
+	char uuid[UUIDLEN+1];
+	char buf[200];
+
+	rules_uuid(uuid, target);
+	snprintf(buf, sizeof(buf), "{\"name\":\"Player %d\",\"uuid\":\"%s\"}", target, uuid);
+	rules_send(n, cmd, buf);
+}
+
+
+/* The client of player n disconnects */
+static void rules_disconnect(int n)
+{
+	struct mosquitto_evt_disconnect ed;
+	struct stub_client client;
+
+	snprintf(client.id, sizeof(client.id), "rules-%d", n);
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)&client;
+
+	rules_topic_count = 0;
+	stub_callbacks[MOSQ_EVT_DISCONNECT](MOSQ_EVT_DISCONNECT, &ed, NULL);
+}
+
+
+/* true if the last command published to tfdg/<room>/<suffix> */
+static bool rules_published(const char *suffix)
+{
+	char topic[200];
+	int i;
+
+	snprintf(topic, sizeof(topic), "tfdg/%s/%s", rules_room, suffix);
+	for(i=0; i<rules_topic_count; i++){
+		if(strcmp(rules_topics[i], topic) == 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+
+static struct tfdg_room *rules_room_s(void)
+{
+	struct tfdg_room *room_s;
+
+	HASH_FIND(hh, room_by_uuid, rules_room, (unsigned int)strlen(rules_room), room_s);
+	return room_s;
+}
+
+
+static struct tfdg_player *rules_player(int n)
+{
+	struct tfdg_room *room_s;
+	struct tfdg_player *player_s = NULL;
+	char uuid[UUIDLEN+1];
+
+	room_s = rules_room_s();
+	if(room_s == NULL) return NULL;
+
+	rules_uuid(uuid, n);
+	HASH_FIND(hh_uuid, room_s->player_by_uuid, uuid, (unsigned int)strlen(uuid), player_s);
+	return player_s;
+}
+
+
+/* Start a new room with players 1..count logged in, player 1 is the host */
+static void rules_lobby(const char *test, int count)
+{
+	int i;
+
+	rules_test = test;
+	rules_room_count++;
+	snprintf(rules_room, sizeof(rules_room), "11111111-0000-0000-0000-%012d", rules_room_count);
+	for(i=1; i<=count; i++){
+		rules_send(i, "login", NULL);
+	}
+}
+
+
+static void rules_roll_all(int count)
+{
+	int i;
+
+	for(i=1; i<=count; i++){
+		rules_send(i, "roll-dice", NULL);
+	}
+}
+
+
+/* Start a game of count players, with everyone holding their dice */
+static void rules_game(const char *test, int count)
+{
+	char payload[200];
+	char uuid[UUIDLEN+1];
+
+	rules_lobby(test, count);
+	rules_uuid(uuid, 1);
+	snprintf(payload, sizeof(payload), "{\"name\":\"Player 1\",\"uuid\":\"%s\",\"option\":\"roll-dice-at-start\",\"value\":false}", uuid);
+	rules_send(1, "set-option", payload);
+	rules_send(1, "start-game", NULL);
+	rules_roll_all(count);
+}
+
+
+/* Player n calls dudo and loses, then the next round starts */
+static void rules_lose_die(int n, int count)
+{
+	rules_send(n, "call-dudo", NULL);
+	rules_send(n, "i-lost", NULL);
+	rules_roll_all(count);
+}
+
+/* ======================================================================/
+ *
+ * Tests
+ *
+ * ====================================================================== */
+
+/* Undoing a calza win takes back the die and the win, so a second undo does
+ * nothing. */
+static void rules_undo_winner(void)
+{
+	struct tfdg_player *player_s;
+	int dice;
+
+	rules_game("undo-winner", 3);
+	rules_lose_die(2, 3);
+	player_s = rules_player(2);
+	RULES_CHECK(player_s != NULL);
+	if(player_s == NULL) return;
+	dice = player_s->dice_count;
+
+	rules_send(2, "call-calza", NULL);
+	rules_send(2, "i-won", NULL);
+	RULES_CHECK(player_s->dice_count == dice+1);
+	RULES_CHECK(rules_room_s()->round_winner == player_s);
+
+	rules_send(2, "undo-winner", NULL);
+	RULES_CHECK(rules_published("undo-winner"));
+	RULES_CHECK(player_s->dice_count == dice);
+	RULES_CHECK(rules_room_s()->round_winner == NULL);
+
+	rules_send(2, "undo-winner", NULL);
+	RULES_CHECK(rules_published("undo-winner") == false);
+	RULES_CHECK(player_s->dice_count == dice);
+}
+
+
+/* Once a round has a winner or a loser, i-won is ignored */
+static void rules_i_won_decided(void)
+{
+	struct tfdg_player *player_s;
+	int dice, calza_success;
+
+	rules_game("i-won-decided", 3);
+	rules_lose_die(2, 3);
+	player_s = rules_player(2);
+	RULES_CHECK(player_s != NULL);
+	if(player_s == NULL) return;
+	dice = player_s->dice_count;
+
+	rules_send(2, "call-calza", NULL);
+	rules_send(2, "i-won", NULL);
+	calza_success = rules_room_s()->calza_success;
+	rules_send(2, "i-won", NULL);
+	RULES_CHECK(rules_published("round-winner") == false);
+	RULES_CHECK(player_s->dice_count == dice+1);
+	RULES_CHECK(rules_room_s()->calza_success == calza_success);
+
+	rules_game("i-won-after-loss", 3);
+	rules_lose_die(2, 3);
+	player_s = rules_player(2);
+	RULES_CHECK(player_s != NULL);
+	if(player_s == NULL) return;
+	dice = player_s->dice_count;
+
+	rules_send(2, "call-calza", NULL);
+	rules_send(2, "i-lost", NULL);
+	rules_send(2, "i-won", NULL);
+	RULES_CHECK(rules_published("round-winner") == false);
+	RULES_CHECK(player_s->dice_count == dice-1);
+	RULES_CHECK(rules_room_s()->round_winner == NULL);
+}
+
+
+/* The host can't kick themself, in the lobby or in a game */
+static void rules_kick_self(void)
+{
+	struct tfdg_player *player_s;
+
+	rules_lobby("kick-self-lobby", 3);
+	rules_send_target(1, "kick-player", 1);
+	player_s = rules_player(1);
+	RULES_CHECK(rules_published("player-left") == false);
+	RULES_CHECK(player_s != NULL && room_player_seated(rules_room_s(), player_s));
+	RULES_CHECK(rules_room_s()->player_count == 3);
+
+	rules_game("kick-self-game", 3);
+	rules_send_target(1, "kick-player", 1);
+	player_s = rules_player(1);
+	RULES_CHECK(rules_published("player-left") == false);
+	RULES_CHECK(player_s != NULL && room_player_seated(rules_room_s(), player_s));
+	RULES_CHECK(rules_room_s()->current_count == 3);
+	RULES_CHECK(rules_room_s()->host == player_s);
+}
+
+
+/* A player kicked from the lobby is removed, as for a logout, and can join
+ * again */
+static void rules_kick_lobby(void)
+{
+	rules_lobby("kick-lobby", 3);
+	rules_send_target(1, "kick-player", 2);
+	RULES_CHECK(rules_published("player-left"));
+	RULES_CHECK(rules_published("lobby-players"));
+	RULES_CHECK(rules_player(2) == NULL);
+	RULES_CHECK(rules_room_s()->player_count == 2);
+	RULES_CHECK(rules_room_s()->seat_count == 2);
+
+	rules_send(2, "login", NULL);
+	RULES_CHECK(rules_player(2) != NULL);
+	RULES_CHECK(rules_room_s()->player_count == 3);
+}
+
+
+/* A player kicked from a game becomes a spectator while their client is
+ * still connected, and nothing in the room refers to them */
+static void rules_kick_game(void)
+{
+	struct tfdg_room *room_s;
+	struct tfdg_player *player_s, *p;
+	const char *client_id = "rules-2";
+
+	rules_game("kick-game", 3);
+	rules_send(2, "call-dudo", NULL);
+	rules_send(2, "i-lost", NULL);
+	room_s = rules_room_s();
+	player_s = rules_player(2);
+	RULES_CHECK(player_s != NULL && room_s->dudo_caller == player_s && room_s->starter == player_s);
+	if(player_s == NULL) return;
+
+	rules_send_target(1, "kick-player", 2);
+	RULES_CHECK(rules_published("player-left"));
+	RULES_CHECK(rules_player(2) == NULL);
+	RULES_CHECK(room_s->current_count == 2);
+	RULES_CHECK(room_s->seat_count == 2);
+	RULES_CHECK(room_s->dudo_caller != player_s);
+	RULES_CHECK(room_s->round_loser != player_s);
+	RULES_CHECK(room_s->starter != player_s && room_player_seated(room_s, room_s->starter));
+
+	HASH_FIND(hh_client_id, room_s->player_by_client_id, client_id, (unsigned int)strlen(client_id), p);
+	RULES_CHECK(p == player_s && p->state == tps_spectator);
+
+	rules_roll_all(3);
+	RULES_CHECK(room_s->state == tgs_playing_round);
+}
+
+
+/* A compact spectator that goes away, by disconnecting or by its client
+ * logging in as someone else, no longer counts as compact */
+static void rules_compact_spectator(void)
+{
+	struct tfdg_room *room_s;
+	char uuid[UUIDLEN+1];
+	char payload[200];
+
+	rules_game("compact-spectator", 2);
+	room_s = rules_room_s();
+	rules_uuid(uuid, 9);
+	snprintf(payload, sizeof(payload), "{\"name\":\"Player 9\",\"uuid\":\"%s\",\"encoding\":\"cbor\"}", uuid);
+	rules_send(9, "login", payload);
+	RULES_CHECK(room_s->compact_count == 1);
+	rules_disconnect(9);
+	RULES_CHECK(room_s->compact_count == 0);
+
+	rules_send(9, "login", payload);
+	RULES_CHECK(room_s->compact_count == 1);
+	rules_uuid(uuid, 10);
+	snprintf(payload, sizeof(payload), "{\"name\":\"Player 10\",\"uuid\":\"%s\"}", uuid);
+	rules_send(9, "login", payload);
+	RULES_CHECK(room_s->compact_count == 0);
+	rules_disconnect(9);
+}
+
+
+/* A client in two rooms is marked away in both when it disconnects */
+static void rules_client_two_rooms(void)
+{
+	struct tfdg_player *first_s, *second_s;
+
+	rules_lobby("client-two-rooms", 2);
+	first_s = rules_player(1);
+	rules_lobby("client-two-rooms", 2);
+	second_s = rules_player(1);
+	RULES_CHECK(first_s != NULL && second_s != NULL && first_s != second_s);
+	if(first_s == NULL || second_s == NULL) return;
+
+	rules_disconnect(1);
+	RULES_CHECK(first_s->away);
+	RULES_CHECK(second_s->away);
+
+	rules_send(1, "login", NULL);
+	RULES_CHECK(first_s->away);
+	RULES_CHECK(second_s->away == false);
+}
+
+
+/* A client can only have max-rooms-per-client rooms that it created open at
+ * once, and other clients can still create rooms */
+static void rules_max_client_rooms(void)
+{
+	struct tfdg_client_id *client;
+	struct tfdg_room *room_s;
+	const char *client_id = "rules-1";
+
+	HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+	RULES_CHECK(client != NULL);
+	if(client == NULL) return;
+	max_client_rooms = client->rooms_created + 1;
+
+	rules_lobby("max-client-rooms", 1);
+	room_s = rules_room_s();
+	RULES_CHECK(room_s != NULL && room_s->creator == client);
+	if(room_s == NULL) return;
+
+	rules_lobby("max-client-rooms", 1);
+	RULES_CHECK(rules_room_s() == NULL);
+	RULES_CHECK(rules_published("login-rejected/00000000-0000-0000-0000-000000000001"));
+
+	rules_send(2, "login", NULL);
+	RULES_CHECK(rules_room_s() != NULL);
+
+	cleanup_room(room_s, "rules");
+	rules_lobby("max-client-rooms", 1);
+	RULES_CHECK(rules_room_s() != NULL);
+
+	max_client_rooms = 0;
+}
+
+
+/* max-players-per-room counts the seats in the lobby, spectators that join a
+ * game have their own limit */
+static void rules_max_players(void)
+{
+	max_room_players = 2;
+	rules_lobby("max-players", 2);
+	rules_send(3, "login", NULL);
+	RULES_CHECK(rules_player(3) == NULL);
+	RULES_CHECK(rules_published("login-rejected/00000000-0000-0000-0000-000000000003"));
+
+	rules_game("max-players-spectator", 2);
+	rules_send(3, "login", NULL);
+	RULES_CHECK(rules_published("login-rejected/00000000-0000-0000-0000-000000000003") == false);
+	RULES_CHECK(room_spectator_count(rules_room_s()) == 1);
+
+	max_room_spectators = 1;
+	rules_send(4, "login", NULL);
+	RULES_CHECK(rules_published("login-rejected/00000000-0000-0000-0000-000000000004"));
+	RULES_CHECK(room_spectator_count(rules_room_s()) == 1);
+
+	max_room_players = 0;
+	max_room_spectators = 0;
+}
+
+
+/* A seeded room that is created again with the same uuid gets a new nonce,
+ * so it doesn't deal the same dice as the last game. The nonce is saved so a
+ * reload continues the same sequence. */
+static void rules_rng_nonce(void)
+{
+	struct tfdg_room *room_s;
+	struct tfdg_rng rng;
+	uint32_t key[8];
+	cJSON *jtmp;
+
+	rules_lobby("rng-nonce", 1);
+	room_s = rules_room_s();
+	RULES_CHECK(room_s != NULL && room_s->rng != NULL);
+	if(room_s == NULL || room_s->rng == NULL) return;
+	memcpy(key, room_s->rng->key, sizeof(key));
+
+	jtmp = cJSON_GetObjectItemCaseSensitive(room_s->json, "rng-nonce");
+	RULES_CHECK(cJSON_IsString(jtmp));
+	if(cJSON_IsString(jtmp) == false) return;
+	rng_init_seeded(&rng, rng_seed, room_s->uuid, strtoull(jtmp->valuestring, NULL, 10));
+	RULES_CHECK(memcmp(rng.key, key, sizeof(key)) == 0);
+
+	cleanup_room(room_s, "rules");
+	rules_send(1, "login", NULL);
+	room_s = rules_room_s();
+	RULES_CHECK(room_s != NULL && room_s->rng != NULL);
+	if(room_s == NULL || room_s->rng == NULL) return;
+	RULES_CHECK(memcmp(room_s->rng->key, key, sizeof(key)) != 0);
+}
+
+
+/* With rate limiting on, a client that isn't in a room can't use up the
+ * room's budget, a throttled player can still end a round, and a client
+ * that reconnects keeps its empty buckets. */
+static void rules_rate_limit(void)
+{
+	struct tfdg_room *room_s;
+	struct tfdg_player *player_s;
+	struct tfdg_client_id *client;
+	const char *client_id = "rules-7";
+	long throttled;
+	int i;
+
+	rate_limit = true;
+	rules_game("rate-limit", 2);
+	room_s = rules_room_s();
+	RULES_CHECK(room_s != NULL);
+	if(room_s == NULL) return;
+
+	memset(room_s->buckets, 0, sizeof(room_s->buckets));
+	throttled = metrics.throttled[0][trc_game];
+	for(i=0; i<100; i++){
+		rules_send(7, "call-dudo", NULL);
+	}
+	RULES_CHECK(metrics.throttled[0][trc_game] > throttled);
+	RULES_CHECK(room_s->buckets[trc_game].last_ms == 0);
+
+	rules_send(2, "call-dudo", NULL);
+	player_s = rules_player(2);
+	RULES_CHECK(player_s != NULL && room_s->dudo_caller == player_s);
+	HASH_FIND(hh, client_id_by_id, "rules-2", (unsigned int)strlen("rules-2"), client);
+	RULES_CHECK(client != NULL);
+	if(client == NULL || player_s == NULL) return;
+	client->buckets[trc_game].last_ms = now_ns()/1000000;
+	client->buckets[trc_game].tokens = 0;
+	room_s->buckets[trc_game] = client->buckets[trc_game];
+	rules_send(2, "i-lost", NULL);
+	RULES_CHECK(room_s->round_loser == player_s);
+
+	rules_test = "rate-limit-reconnect";
+	HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+	RULES_CHECK(client != NULL);
+	if(client == NULL) return;
+	rules_disconnect(7);
+	RULES_CHECK(client->cool_until_ms != 0);
+	throttled = metrics.throttled[0][trc_game];
+	rules_send(7, "call-dudo", NULL);
+	RULES_CHECK(metrics.throttled[0][trc_game] == throttled+1);
+	RULES_CHECK(client->cool_until_ms == 0);
+
+	/* Let the cool-downs run out so nothing is left in the pools */
+	rules_disconnect(1);
+	rules_disconnect(2);
+	rules_disconnect(7);
+	DL_FOREACH2(rate_cooling, client, cool_next){
+		client->cool_until_ms = 1;
+	}
+	rate_cool();
+	RULES_CHECK(rate_cooling == NULL);
+	HASH_FIND(hh, client_id_by_id, client_id, (unsigned int)strlen(client_id), client);
+	RULES_CHECK(client == NULL);
+
+	rate_limit = false;
+}
+
+
+static void rules_plugin_init(void)
+{
+	struct mosquitto_opt opts[6];
+
+	opts[0].key = "state-file";
+	opts[0].value = RULES_STATE_FILE;
+	opts[1].key = "rng-seed";
+	opts[1].value = "tfdg-rules";
+	opts[2].key = "background-worker";
+	opts[2].value = "false";
+	opts[3].key = "log-level";
+	opts[3].value = "error";
+	/* Only rules_rate_limit() turns this on, the buckets hold client ids */
+	opts[4].key = "rate-limit";
+	opts[4].value = "false";
+	opts[5].key = "sound-window-ms";
+	opts[5].value = "0";
+
+	unlink(RULES_STATE_FILE);
+	memset(stub_callbacks, 0, sizeof(stub_callbacks));
+	stub_publish = rules_publish;
+	mosquitto_plugin_init(NULL, NULL, opts, 6);
+}
+
+
+/* Tear down every room directly, cleanup_all() isn't called by the plugin
+ * cleanup, and check nothing is left in the pools. */
+static void rules_plugin_cleanup(void)
+{
+	struct tfdg_room *room_s, *room_tmp;
+
+	rules_test = "cleanup";
+	cleanup_queue_drain(-1);
+	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
+		cleanup_room(room_s, "rules");
+	}
+	RULES_CHECK(room_pool.in_use == 0);
+	RULES_CHECK(player_pool.in_use == 0);
+	RULES_CHECK(client_id_pool.in_use == 0);
+	mosquitto_plugin_cleanup(NULL, NULL, 0);
+	unlink(RULES_STATE_FILE);
+}
+
+
+int main(int argc, char *argv[])
+{
+	rules_plugin_init();
+
+	rules_undo_winner();
+	rules_i_won_decided();
+	rules_kick_self();
+	rules_kick_lobby();
+	rules_kick_game();
+	rules_compact_spectator();
+	rules_client_two_rooms();
+	rules_max_client_rooms();
+	rules_max_players();
+	rules_rng_nonce();
+	rules_rate_limit();
+
+	rules_plugin_cleanup();
+
+	printf("tfdg_rules: %ld checks, %ld failed\n", rules_checks, rules_failures);
+	return rules_failures ? 1 : 0;
+}
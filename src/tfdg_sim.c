@@ -0,0 +1,872 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Randomised simulator for the tfdg plugin. The plugin source is included
+ * directly so its state can be checked.
+ *
+ * Rooms play random games through the real handlers. Each step looks at the
+ * plugin's state for one room and sends a command a client could legitimately
+ * send: logging in and out, options, start-game, rolling, calling, i-lost and
+ * i-won, undo, sounds, leaving, kicking, resetting, and disconnecting and
+ * coming back, possibly with a new client id. SIM_NOISE percent of steps send
+ * a random command instead, from a random client, sometimes to a room that
+ * doesn't exist.
+ *
+ * After every step the room that was stepped is checked:
+ *  - seats[] and each player's seat agree, and every seated player is in
+ *    player_by_uuid
+ *  - the faces[] totals match the dice held by seated players
+ *  - once a game has started, current_count is the number of seated players
+ *  - every player in player_by_client_id is in its client's player list,
+ *    mapped to this room
+ * Every SIM_GLOBAL_CHECK steps, and at the end, every player in the player
+ * pool must be reachable the way cleanup_room() frees them, so a player that
+ * has been dropped from every list is reported as a leak, and memory_total
+ * must be the sum of what each room was last accounted at. At the end all
+ * rooms are cleaned up and the pools must be empty. Build with
+ * -fsanitize=address to catch leaks outside the pools as well.
+ *
+ * All randomness, in the plugin and here, comes from the seed given with -s,
+ * and the plugin's clock is replaced with one that advances a second every
+ * SIM_SECOND_STEPS steps, so a failure can be reproduced with the seed and
+ * step it reports.
+ */
+
+#include <time.h>
+
+static time_t sim_clock = 1600000000;
+
+static time_t sim_time(time_t *t)
+{
+	if(t) *t = sim_clock;
+	return sim_clock;
+}
+#define time(t) sim_time(t)
+
+#include "plugin_tfdg.c"
+#include "tfdg_stubs.h"
+
+#include <getopt.h>
+#include <unistd.h>
+
+#define SIM_STATE_FILE "tfdg-sim-state.json"
+#define SIM_MAX_PLAYERS 8
+#define SIM_SLOT_PLAYERS (SIM_MAX_PLAYERS+2) /* spare for spectators */
+#define SIM_NOISE 5 /* percent */
+#define SIM_GAME_STEPS 20000 /* before a game is counted as stuck */
+#define SIM_TICK_STEPS 100
+#define SIM_SECOND_STEPS 1000
+#define SIM_GLOBAL_CHECK 10000
+#define SIM_HISTORY 16 /* commands per room shown on failure */
+
+struct sim_player{
+	struct stub_client client;
+	char uuid[UUIDLEN+1];
+	char payload[100];
+	int generation;
+	bool in;
+	bool away;
+};
+
+struct sim_room{
+	struct sim_player players[SIM_SLOT_PLAYERS];
+	char uuid[UUIDLEN+1];
+	int slot;
+	long game;
+	long steps;
+	int target;
+	bool started;
+	char history[SIM_HISTORY][80];
+	int history_pos;
+};
+
+static struct sim_room *sim_rooms = NULL;
+static int sim_room_count = 64;
+static uint64_t sim_rng = 1;
+static uint64_t sim_seed = 1;
+static long sim_step_count = 0;
+static long sim_commands = 0;
+static long sim_games = 0;
+static long sim_games_stuck = 0;
+static long sim_rounds = 0;
+static long sim_checks = 0;
+static const char *sim_last = "";
+
+static const char *sim_noise_commands[] = {
+	"login", "logout", "start-game", "new-name", "roll-dice", "call-dudo",
+	"call-calza", "i-lost", "i-won", "undo-loser", "undo-winner",
+	"leave-game", "kick-player", "reset-game", "set-option", "snd-higher",
+	"snd-exact", "bogus"
+};
+
+/* ======================================================================/
+ *
+ * Helper functions
+ *
+ * ====================================================================== */
+
+static int sim_random(int limit)
+{
+	sim_rng ^= sim_rng << 13;
+	sim_rng ^= sim_rng >> 7;
+	sim_rng ^= sim_rng << 17;
+	return (int)(sim_rng % (uint64_t)limit);
+}
+
+
+static void sim_fail(const struct sim_room *room, const char *fmt, ...)
+{
+	va_list va;
+	int i, pos;
+
+	fprintf(stderr, "tfdg_sim: invariant failed, seed %lu step %ld room %s after %s: ",
+			sim_seed, sim_step_count, room ? room->uuid : "-", sim_last);
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	va_end(va);
+	fprintf(stderr, "\n");
+	if(room){
+		fprintf(stderr, "last commands in this room:\n");
+		for(i=0; i<SIM_HISTORY; i++){
+			pos = (room->history_pos + i) % SIM_HISTORY;
+			if(room->history[pos][0]){
+				fprintf(stderr, "  %s\n", room->history[pos]);
+			}
+		}
+	}
+	exit(1);
+}
+
+
+static void sim_player_set_client(struct sim_room *room, struct sim_player *player, int index)
+{
+	snprintf(player->client.id, sizeof(player->client.id), "sim-%d-%d-%d", room->slot, index, player->generation);
+}
+
+
+static void sim_room_next_game(struct sim_room *room)
+{
+	struct sim_player *player;
+	char uuid[UUIDLEN+1];
+	int i;
+
+	room->game++;
+	room->steps = 0;
+	memset(room->history, 0, sizeof(room->history));
+	room->started = false;
+	room->target = 2 + sim_random(SIM_MAX_PLAYERS-1);
+	snprintf(room->uuid, sizeof(room->uuid), "00000000-0000-0000-%04x-%012lx", room->slot, room->game);
+	for(i=0; i<SIM_SLOT_PLAYERS; i++){
+		player = &room->players[i];
+		player->generation = 0;
+		player->in = false;
+		player->away = false;
+		sim_player_set_client(room, player, i);
+		snprintf(uuid, sizeof(uuid), "00000000-0000-%04x-%04x-%012lx", i, room->slot, room->game);
+		memcpy(player->uuid, uuid, sizeof(uuid));
+		snprintf(player->payload, sizeof(player->payload), "{\"name\":\"P%d\",\"uuid\":\"%s\"}", i, uuid);
+	}
+}
+
+
+static struct sim_player *sim_find_player(struct sim_room *room, const struct tfdg_player *player_s)
+{
+	int i;
+
+	if(player_s == NULL) return NULL;
+
+	for(i=0; i<SIM_SLOT_PLAYERS; i++){
+		if(!strcmp(room->players[i].uuid, player_s->uuid)){
+			return &room->players[i];
+		}
+	}
+	return NULL;
+}
+
+
+static void sim_send(struct sim_room *room, const char *room_uuid, struct stub_client *client, const char *cmd, const char *payload)
+{
+	struct mosquitto_evt_acl_check ed;
+	char topic[200];
+
+	snprintf(topic, sizeof(topic), "tfdg/%s/%s", room_uuid, cmd);
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)client;
+	ed.topic = topic;
+	ed.payload = payload;
+	ed.payloadlen = (uint32_t)strlen(payload);
+	ed.access = MOSQ_ACL_WRITE;
+	sim_last = cmd;
+	snprintf(room->history[room->history_pos], sizeof(room->history[0]), "%s %s%s",
+			client->id, cmd, room_uuid == room->uuid ? "" : " (other room)");
+	room->history_pos = (room->history_pos + 1) % SIM_HISTORY;
+	stub_callbacks[MOSQ_EVT_ACL_CHECK](MOSQ_EVT_ACL_CHECK, &ed, NULL);
+	sim_commands++;
+}
+
+
+static void sim_command(struct sim_room *room, struct sim_player *player, const char *cmd)
+{
+	sim_send(room, room->uuid, &player->client, cmd, player->payload);
+}
+
+
+static void sim_login(struct sim_room *room, struct sim_player *player)
+{
+	sim_command(room, player, "login");
+	player->in = true;
+	player->away = false;
+}
+
+
+static void sim_disconnect(struct sim_room *room, struct sim_player *player)
+{
+	struct mosquitto_evt_disconnect ed;
+
+	memset(&ed, 0, sizeof(ed));
+	ed.client = (struct mosquitto *)&player->client;
+	sim_last = "disconnect";
+	snprintf(room->history[room->history_pos], sizeof(room->history[0]), "%s disconnect", player->client.id);
+	room->history_pos = (room->history_pos + 1) % SIM_HISTORY;
+	stub_callbacks[MOSQ_EVT_DISCONNECT](MOSQ_EVT_DISCONNECT, &ed, NULL);
+	player->away = true;
+
+	/* Browsers that reload come back with a new client id */
+	if(sim_random(2)){
+		player->generation++;
+		sim_player_set_client(room, player, (int)(player - room->players));
+	}
+}
+
+
+static void sim_tick(void)
+{
+	struct mosquitto_evt_tick ed;
+
+	memset(&ed, 0, sizeof(ed));
+	stub_callbacks[MOSQ_EVT_TICK](MOSQ_EVT_TICK, &ed, NULL);
+}
+
+
+/* A random seated player, or one matching state if it isn't tps_none */
+static struct sim_player *sim_seated(struct sim_room *room, struct tfdg_room *room_s, enum tfdg_player_state state)
+{
+	int i, start;
+	struct tfdg_player *p;
+
+	if(room_s->seat_count == 0) return NULL;
+
+	start = sim_random(room_s->seat_count);
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[(start + i) % room_s->seat_count];
+		if(state == tps_none || p->state == state){
+			return sim_find_player(room, p);
+		}
+	}
+	return NULL;
+}
+
+/* ======================================================================/
+ *
+ * Invariants
+ *
+ * ====================================================================== */
+
+static bool sim_is_lost(struct tfdg_room *room_s, const struct tfdg_player *player_s)
+{
+	struct tfdg_player *p;
+
+	DL_FOREACH(room_s->lost_players, p){
+		if(p == player_s) return true;
+	}
+	return false;
+}
+
+
+static void sim_check_room(struct sim_room *room, struct tfdg_room *room_s)
+{
+	struct tfdg_player *p, *tmp, *found;
+	int faces[MAX_DICE_VALUE+1];
+	int i, d;
+
+	sim_checks++;
+	if(room_s->seat_count < 0 || room_s->seat_count > room_s->seat_alloc){
+		sim_fail(room, "seat_count %d, seat_alloc %d", room_s->seat_count, room_s->seat_alloc);
+	}
+
+	memset(faces, 0, sizeof(faces));
+	for(i=0; i<room_s->seat_count; i++){
+		p = room_s->seats[i];
+		if(p->seat != i){
+			sim_fail(room, "player in seat %d thinks it is in seat %d", i, p->seat);
+		}
+		if(p->dice_count > MAX_DICE){
+			sim_fail(room, "player in seat %d has %d dice", i, p->dice_count);
+		}
+		HASH_FIND(hh_uuid, room_s->player_by_uuid, p->uuid, (unsigned int)strlen(p->uuid), found);
+		if(found != p){
+			sim_fail(room, "player in seat %d is not in player_by_uuid", i);
+		}
+		for(d=0; d<p->dice_count; d++){
+			if(player_die(p, d) > MAX_DICE_VALUE){
+				sim_fail(room, "player in seat %d has a die of %d", i, player_die(p, d));
+			}
+			faces[player_die(p, d)]++;
+		}
+	}
+	if(memcmp(faces, room_s->faces, sizeof(faces))){
+		sim_fail(room, "faces[] doesn't match the dice held");
+	}
+
+	DL_FOREACH(room_s->lost_players, p){
+		if(room_player_seated(room_s, p)){
+			sim_fail(room, "lost player is still seated");
+		}
+		HASH_FIND(hh_uuid, room_s->player_by_uuid, p->uuid, (unsigned int)strlen(p->uuid), found);
+		if(found != p){
+			sim_fail(room, "lost player is not in player_by_uuid");
+		}
+	}
+
+	if(room_s->state != tgs_lobby && room_s->state != tgs_resetting
+			&& room_s->current_count != room_s->seat_count){
+
+		sim_fail(room, "current_count %d with %d seated players in state %d",
+				room_s->current_count, room_s->seat_count, room_s->state);
+	}
+
+	HASH_ITER(hh_client_id, room_s->player_by_client_id, p, tmp){
+		if(p->client_id == NULL){
+			sim_fail(room, "player in player_by_client_id has no client id");
+		}
+		if(p->client_mapped == false){
+			sim_fail(room, "player in player_by_client_id isn't mapped to its client");
+			continue;
+		}
+		if(p->room != room_s){
+			sim_fail(room, "player in player_by_client_id is mapped to another room");
+		}
+		DL_FOREACH2(p->client->players, found, client_next){
+			if(found == p) break;
+		}
+		if(found != p){
+			sim_fail(room, "player in player_by_client_id isn't in its client's player list");
+		}
+	}
+}
+
+
+/* Count players the way cleanup_room() finds them: seated, lost, then
+ * anything else with a client. */
+static long sim_room_reachable(struct tfdg_room *room_s)
+{
+	struct tfdg_player *p, *tmp;
+	long count;
+
+	count = room_s->seat_count;
+	DL_FOREACH(room_s->lost_players, p){
+		count++;
+	}
+	HASH_ITER(hh_client_id, room_s->player_by_client_id, p, tmp){
+		if(room_player_seated(room_s, p) == false && sim_is_lost(room_s, p) == false){
+			count++;
+		}
+	}
+	/* A spectator host outlives its client entry */
+	p = room_s->host;
+	if(p && p->state == tps_spectator){
+		tmp = NULL;
+		if(p->client_id){
+			HASH_FIND(hh_client_id, room_s->player_by_client_id, p->client_id, (unsigned int)strlen(p->client_id), tmp);
+		}
+		if(tmp != p) count++;
+	}
+	return count;
+}
+
+
+static void sim_check_global(void)
+{
+	struct tfdg_room *room_s, *room_tmp;
+	struct tfdg_player *p, *tmp, *found;
+	struct tfdg_client_id *client, *client_tmp;
+	long rooms = 0, players = 0;
+	unsigned int mapped;
+	size_t bytes = 0;
+
+	sim_checks++;
+	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
+		rooms++;
+		players += sim_room_reachable(room_s);
+		bytes += room_s->mem_bytes;
+	}
+	for(room_s=cleanup_queue; room_s; room_s=room_s->cleanup_next){
+		rooms++;
+		players += sim_room_reachable(room_s);
+		bytes += room_s->mem_bytes;
+	}
+	if(rooms != room_pool.in_use){
+		sim_fail(NULL, "%ld rooms reachable, %ld in use", rooms, room_pool.in_use);
+	}
+	if(players != player_pool.in_use){
+		sim_fail(NULL, "%ld players reachable, %ld in use", players, player_pool.in_use);
+	}
+	if(bytes != memory_total){
+		sim_fail(NULL, "rooms account for %zu bytes, memory_total is %zu", bytes, memory_total);
+	}
+
+	mapped = 0;
+	HASH_ITER(hh, client_id_by_id, client, client_tmp){
+		DL_FOREACH2(client->players, p, client_next){
+			mapped++;
+			HASH_FIND(hh_client_id, p->room->player_by_client_id, p->client_id, (unsigned int)strlen(p->client_id), found);
+			if(found != p){
+				sim_fail(NULL, "player in a client's player list isn't in its room's player_by_client_id");
+			}
+			for(tmp=p->client_next; tmp; tmp=tmp->client_next){
+				if(tmp->room == p->room){
+					sim_fail(NULL, "client has two players in one room");
+				}
+			}
+		}
+	}
+	if(mapped != client_player_count){
+		sim_fail(NULL, "%u players in client lists, client_player_count is %u", mapped, client_player_count);
+	}
+}
+
+/* ======================================================================/
+ *
+ * Simulation
+ *
+ * ====================================================================== */
+
+static void sim_noise(struct sim_room *room)
+{
+	struct sim_player *player, *other;
+	char payload[200];
+	const char *cmd;
+	const char *room_uuid;
+
+	player = &room->players[sim_random(SIM_SLOT_PLAYERS)];
+	other = &room->players[sim_random(SIM_SLOT_PLAYERS)];
+	cmd = sim_noise_commands[sim_random((int)(sizeof(sim_noise_commands)/sizeof(sim_noise_commands[0])))];
+	room_uuid = sim_random(10) ? room->uuid : "ffffffff-0000-0000-0000-000000000000";
+	if(!strcmp(cmd, "login")){
+		/* Logging in would create the room, and with no game to finish it
+		 * would never go away */
+		room_uuid = room->uuid;
+	}
+
+	switch(sim_random(4)){
+		case 0:
+			/* Someone else's uuid */
+			sim_send(room, room_uuid, &player->client, cmd, other->payload);
+			if(!strcmp(cmd, "login")){
+				/* A uuid is all it takes to log in, so both have to come
+				 * back to be themselves again */
+				if(player->in) player->away = true;
+				if(other->in) other->away = true;
+			}
+			break;
+		case 1:
+			snprintf(payload, sizeof(payload), "{\"option\":\"max-dice\",\"value\":%d,\"uuid\":\"%s\",\"name\":\"X\"}",
+					sim_random(25)-2, player->uuid);
+			sim_send(room, room_uuid, &player->client, cmd, payload);
+			break;
+		case 2:
+			sim_send(room, room_uuid, &player->client, cmd, "{\"name\":");
+			break;
+		default:
+			sim_send(room, room_uuid, &player->client, cmd, player->payload);
+			break;
+	}
+}
+
+
+static void sim_lobby(struct sim_room *room, struct tfdg_room *room_s)
+{
+	static const char *options[] = {
+		"{\"option\":\"max-dice\",\"value\":%d}",
+		"{\"option\":\"max-dice-value\",\"value\":%d}",
+		"{\"option\":\"random-mask-percentage\",\"value\":%d}",
+		"{\"option\":\"random-position\",\"value\":%s}",
+		"{\"option\":\"swap-direction\",\"value\":%s}",
+		"{\"option\":\"roll-dice-at-start\",\"value\":%s}",
+		"{\"option\":\"random-max-dice-value\",\"value\":%s}",
+	};
+	struct sim_player *player, *host;
+	char payload[200];
+	int i, option, count = 0;
+
+	for(i=0; i<room->target; i++){
+		/* The room goes away with its last player, however that happened */
+		if(room_s == NULL) room->players[i].in = false;
+		if(room->players[i].in) count++;
+	}
+	if(room_s == NULL || count < room->target){
+		for(i=0; i<room->target; i++){
+			if(room->players[i].in == false){
+				sim_login(room, &room->players[i]);
+				return;
+			}
+		}
+	}
+
+	host = sim_find_player(room, room_s->host);
+	if(host == NULL){
+		sim_login(room, &room->players[sim_random(room->target)]);
+		return;
+	}
+
+	switch(sim_random(20)){
+		case 0:
+			player = &room->players[sim_random(room->target)];
+			sim_command(room, player, "logout");
+			player->in = false;
+			break;
+		case 1:
+		case 2:
+			option = sim_random((int)(sizeof(options)/sizeof(options[0])));
+			if(option < 3){
+				snprintf(payload, sizeof(payload), options[option], option == 2 ? sim_random(50) : 3+sim_random(4));
+			}else{
+				snprintf(payload, sizeof(payload), options[option], sim_random(2) ? "true" : "false");
+			}
+			sim_send(room, room->uuid, &host->client, "set-option", payload);
+			break;
+		case 3:
+			player = &room->players[sim_random(room->target)];
+			if(player->in){
+				snprintf(payload, sizeof(payload), "{\"name\":\"Q%d\",\"uuid\":\"%s\"}", sim_random(100), player->uuid);
+				sim_send(room, room->uuid, &player->client, "new-name", payload);
+			}
+			break;
+		default:
+			sim_command(room, host, "start-game");
+			room->started = true;
+			break;
+	}
+}
+
+
+static void sim_playing(struct sim_room *room, struct tfdg_room *room_s)
+{
+	struct sim_player *player, *host;
+
+	player = sim_seated(room, room_s, tps_awaiting_dice);
+	if(player){
+		sim_command(room, player, "roll-dice");
+		return;
+	}
+
+	host = sim_find_player(room, room_s->host);
+	switch(sim_random(100)){
+		case 0:
+			player = sim_seated(room, room_s, tps_none);
+			if(player) sim_command(room, player, "leave-game");
+			return;
+		case 1:
+			player = sim_seated(room, room_s, tps_none);
+			if(host && player && player != host){
+				sim_send(room, room->uuid, &host->client, "kick-player", player->payload);
+			}
+			return;
+		case 2:
+			if(host && sim_random(5) == 0){
+				sim_command(room, host, "reset-game");
+			}
+			return;
+		case 3:
+		case 4:
+			player = sim_seated(room, room_s, tps_none);
+			if(player && player->away == false) sim_disconnect(room, player);
+			return;
+		case 5:
+			/* Spectator */
+			player = &room->players[SIM_MAX_PLAYERS + sim_random(SIM_SLOT_PLAYERS-SIM_MAX_PLAYERS)];
+			sim_login(room, player);
+			return;
+		case 6:
+		case 7:
+		case 8:
+			player = sim_seated(room, room_s, tps_have_dice);
+			if(player) sim_command(room, player, sim_random(2) ? "snd-higher" : "snd-exact");
+			return;
+	}
+
+	player = sim_seated(room, room_s, tps_have_dice);
+	if(player){
+		sim_command(room, player, sim_random(4) ? "call-dudo" : "call-calza");
+	}
+}
+
+
+static void sim_awaiting_loser(struct sim_room *room, struct tfdg_room *room_s)
+{
+	struct sim_player *player;
+
+	player = sim_seated(room, room_s, tps_calza_candidate);
+	if(player){
+		sim_command(room, player, sim_random(2) ? "i-won" : "i-lost");
+		return;
+	}
+	player = sim_seated(room, room_s, tps_dudo_candidate);
+	if(player){
+		sim_command(room, player, "i-lost");
+	}
+}
+
+
+static void sim_round_over(struct sim_room *room, struct tfdg_room *room_s)
+{
+	struct sim_player *player;
+
+	switch(sim_random(10)){
+		case 0:
+			player = sim_find_player(room, room_s->round_loser);
+			if(player) sim_command(room, player, "undo-loser");
+			return;
+		case 1:
+			player = sim_find_player(room, room_s->round_winner);
+			if(player) sim_command(room, player, "undo-winner");
+			return;
+	}
+	player = sim_seated(room, room_s, tps_none);
+	if(player){
+		sim_command(room, player, "roll-dice");
+	}
+}
+
+
+/* Everyone logs out, then the slot starts a new game in a new room */
+static void sim_finished(struct sim_room *room, struct tfdg_room *room_s, bool stuck)
+{
+	int i;
+
+	for(i=0; i<SIM_SLOT_PLAYERS; i++){
+		if(room->players[i].in){
+			sim_command(room, &room->players[i], "logout");
+			room->players[i].in = false;
+			return;
+		}
+	}
+	if(stuck){
+		sim_games_stuck++;
+	}else{
+		sim_games++;
+	}
+	if(room_s){
+		sim_rounds += room_s->round;
+	}
+	sim_room_next_game(room);
+}
+
+
+static void sim_step(struct sim_room *room)
+{
+	struct tfdg_room *room_s;
+	struct sim_player *player;
+	int i;
+
+	HASH_FIND(hh, room_by_uuid, room->uuid, (unsigned int)strlen(room->uuid), room_s);
+	room->steps++;
+
+	if(room->steps > SIM_GAME_STEPS){
+		sim_finished(room, room_s, true);
+	}else if(room->started && (room_s == NULL
+			|| room_s->state == tgs_game_over || room_s->state == tgs_resetting
+			|| (room_s->state == tgs_lobby && room_s->seat_count == 0))){
+
+		sim_finished(room, room_s, false);
+	}else if(sim_random(100) < SIM_NOISE){
+		sim_noise(room);
+	}else{
+		/* Players who dropped out come back */
+		for(i=0; i<SIM_SLOT_PLAYERS; i++){
+			player = &room->players[i];
+			if(player->in && player->away && sim_random(3) == 0){
+				sim_login(room, player);
+				return;
+			}
+		}
+
+		if(room_s == NULL || room_s->state == tgs_lobby){
+			sim_lobby(room, room_s);
+		}else{
+			switch(room_s->state){
+				case tgs_pre_roll:
+					player = sim_seated(room, room_s, tps_pre_roll);
+					if(player) sim_command(room, player, "roll-dice");
+					break;
+				case tgs_playing_round:
+					sim_playing(room, room_s);
+					break;
+				case tgs_awaiting_loser:
+					sim_awaiting_loser(room, room_s);
+					break;
+				case tgs_pre_roll_over:
+				case tgs_round_over:
+					sim_round_over(room, room_s);
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	HASH_FIND(hh, room_by_uuid, room->uuid, (unsigned int)strlen(room->uuid), room_s);
+	if(room_s){
+		sim_check_room(room, room_s);
+	}
+}
+
+
+static void sim_plugin_init(void)
+{
+	struct mosquitto_opt opts[8];
+	char seed[40];
+
+	snprintf(seed, sizeof(seed), "tfdg-sim-%lu", sim_seed);
+	opts[0].key = "state-file";
+	opts[0].value = SIM_STATE_FILE;
+	opts[1].key = "rng-seed";
+	opts[1].value = seed;
+	opts[2].key = "background-worker";
+	opts[2].value = "false";
+	opts[3].key = "game-over-expiry-time";
+	opts[3].value = "0";
+	opts[4].key = "resetting-expiry-time";
+	opts[4].value = "0";
+	opts[5].key = "log-level";
+	opts[5].value = "error";
+	/* Rate limits use the real clock, which would make runs unrepeatable */
+	opts[6].key = "rate-limit";
+	opts[6].value = "false";
+	opts[7].key = "sound-window-ms";
+	opts[7].value = "0";
+
+	unlink(SIM_STATE_FILE);
+	memset(stub_callbacks, 0, sizeof(stub_callbacks));
+	mosquitto_plugin_init(NULL, NULL, opts, 8);
+	/* Room nonces count up from the time of init, start them from 0 instead */
+	rng_nonce_last = 0;
+}
+
+
+/* Tear down every room directly, cleanup_all() isn't called by the plugin
+ * cleanup, and check nothing is left in the pools. */
+static void sim_plugin_cleanup(void)
+{
+	struct tfdg_room *room_s, *room_tmp;
+
+	sim_check_global();
+	cleanup_queue_drain(-1);
+	HASH_ITER(hh, room_by_uuid, room_s, room_tmp){
+		cleanup_room(room_s, "sim");
+	}
+	if(room_pool.in_use || player_pool.in_use || client_id_pool.in_use || client_player_count
+			|| memory_total){
+
+		sim_fail(NULL, "%ld rooms, %ld players, %ld client ids, %u mapped clients, %zu bytes left after cleanup",
+				room_pool.in_use, player_pool.in_use, client_id_pool.in_use, client_player_count,
+				memory_total);
+	}
+	mosquitto_plugin_cleanup(NULL, NULL, 0);
+	unlink(SIM_STATE_FILE);
+}
+
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: tfdg_sim [-g games] [-r rooms] [-s seed]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	long game_count = 100000;
+	struct timespec start, end;
+	double elapsed;
+	int opt, r;
+
+	while((opt = getopt(argc, argv, "g:r:s:")) != -1){
+		switch(opt){
+			case 'g':
+				game_count = atol(optarg);
+				break;
+			case 'r':
+				sim_room_count = atoi(optarg);
+				break;
+			case 's':
+				sim_seed = strtoull(optarg, NULL, 10);
+				break;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+	if(game_count < 1 || sim_room_count < 1 || sim_room_count > 0xffff){
+		print_usage();
+		return 1;
+	}
+	sim_rng = sim_seed ? sim_seed : 1;
+
+	if(freopen("/dev/null", "w", stdout) == NULL){
+		return 1;
+	}
+
+	sim_rooms = calloc((size_t)sim_room_count, sizeof(struct sim_room));
+	if(sim_rooms == NULL){
+		return 1;
+	}
+	for(r=0; r<sim_room_count; r++){
+		sim_rooms[r].slot = r;
+		sim_rooms[r].game = -1;
+		sim_room_next_game(&sim_rooms[r]);
+	}
+
+	sim_plugin_init();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(sim_games + sim_games_stuck < game_count){
+		sim_step(&sim_rooms[sim_random(sim_room_count)]);
+		sim_step_count++;
+		if(sim_step_count % SIM_SECOND_STEPS == 0){
+			sim_clock++;
+		}
+		if(sim_step_count % SIM_TICK_STEPS == 0){
+			sim_last = "tick";
+			sim_tick();
+		}
+		if(sim_step_count % SIM_GLOBAL_CHECK == 0){
+			sim_check_global();
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec)/1e9;
+	sim_plugin_cleanup();
+
+	fprintf(stderr, "sim: seed %lu, %d rooms: %ld games (%ld stuck), %ld rounds in %.3fs\n",
+			sim_seed, sim_room_count, sim_games, sim_games_stuck, sim_rounds, elapsed);
+	fprintf(stderr, "  %.0f games/s, %ld commands, %.0f commands/s, %ld publishes, %ld invariant checks\n",
+			(double)sim_games/elapsed, sim_commands, (double)sim_commands/elapsed, stub_publish_count, sim_checks);
+
+	free(sim_rooms);
+	return sim_games_stuck ? 2 : 0;
+}
@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include <stdlib.h>
+
+#include "tfdg_stubs.h"
+
+MOSQ_FUNC_generic_callback stub_callbacks[STUB_MAX_EVENTS];
+stub_publish_fn stub_publish = NULL;
+stub_client_id_fn stub_client_id = NULL;
+long stub_publish_count = 0;
+long stub_publish_bytes = 0;
+
+
+const char *mosquitto_client_id(const struct mosquitto *client)
+{
+	if(stub_client_id){
+		return stub_client_id(client);
+	}
+	return ((const struct stub_client *)client)->id;
+}
+
+
+int mosquitto_broker_publish(
+		const char *client_id,
+		const char *topic,
+		int payloadlen,
+		void *payload,
+		int qos,
+		bool retain,
+		mosquitto_property *properties)
+{
+	stub_publish_count++;
+	stub_publish_bytes += payloadlen;
+	if(stub_publish){
+		return stub_publish(client_id, topic, payloadlen, payload, retain);
+	}
+	free(payload);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mosquitto_callback_register(
+		mosquitto_plugin_id_t *identifier,
+		int event,
+		MOSQ_FUNC_generic_callback cb_func,
+		const void *event_data,
+		void *userdata)
+{
+	if(event < 0 || event >= STUB_MAX_EVENTS) return MOSQ_ERR_INVAL;
+
+	stub_callbacks[event] = cb_func;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mosquitto_callback_unregister(
+		mosquitto_plugin_id_t *identifier,
+		int event,
+		MOSQ_FUNC_generic_callback cb_func,
+		const void *event_data)
+{
+	if(event < 0 || event >= STUB_MAX_EVENTS) return MOSQ_ERR_INVAL;
+
+	stub_callbacks[event] = NULL;
+	return MOSQ_ERR_SUCCESS;
+}
@@ -0,0 +1,53 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+/* Replacements for the broker functions the plugin calls, shared by the tools
+ * that drive plugin_tfdg.c directly: bench, load, micro, replay, rules and
+ * sim. Each tool includes plugin_tfdg.c and links tfdg_stubs.c.
+ *
+ * The callbacks the plugin registers are kept in stub_callbacks[], indexed by
+ * event. A tool passes a struct stub_client as the struct mosquitto, or sets
+ * stub_client_id if it has its own client struct. Publishes are counted, then
+ * handed to stub_publish if it is set or freed otherwise.
+ */
+
+#ifndef TFDG_STUBS_H
+#define TFDG_STUBS_H
+
+#include <stdbool.h>
+
+#include "mosquitto_broker.h"
+#include "mosquitto_plugin.h"
+#include "mosquitto.h"
+
+#define STUB_MAX_EVENTS 32
+#define STUB_CLIENT_ID_LEN 40
+
+struct stub_client{
+	char id[STUB_CLIENT_ID_LEN];
+};
+
+/* Takes ownership of payload */
+typedef int (*stub_publish_fn)(const char *client_id, const char *topic, int payloadlen, void *payload, bool retain);
+typedef const char *(*stub_client_id_fn)(const struct mosquitto *client);
+
+extern MOSQ_FUNC_generic_callback stub_callbacks[STUB_MAX_EVENTS];
+extern stub_publish_fn stub_publish;
+extern stub_client_id_fn stub_client_id;
+extern long stub_publish_count;
+extern long stub_publish_bytes;
+
+#endif